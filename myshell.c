@@ -1,454 +1,9239 @@
-/***************************************************************************//**
-  @file         myshell.c
-  @author       Salvador Prieto
-  @date         09/25/2024
-  @brief        myshell - A custom shell implementation with built-in commands.
-
-  This program implements a simple shell that includes basic commands like
-  SETSHELLNAME, SETTERMINATOR, and alias management, as well as executing
-  standard Unix commands.
-*******************************************************************************/
-
-#include <sys/wait.h>
-#include <sys/types.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-
-/*
-  Global Variables:
-*/
-char *shellname = "myshell"; // Default shell name
-char *terminator = ">";       // Default prompt terminator
-
-#define MAX_ALIASES 10 // Maximum number of allowed aliases
-
-/*
-  Alias Structure
-*/
-struct Alias {
-    char *new_name; // Alias name
-    char *old_name; // Original command name
-};
-
-struct Alias aliases[MAX_ALIASES];
-int alias_count = 0;
-
-/*
-  Function Declarations for builtin shell commands:
- */
-int lsh_cd(char **args);
-int lsh_help(char **args);
-int lsh_exit(char **args);
-int setshellname(char **args);
-int setterminator(char **args);
-int newname(char **args);
-int listnewnames(char **args);
-int savenewnames(char **args);
-int readnewnames(char **args);
-int lsh_stop(char **args);
-
-/*
-  List of builtin commands, followed by their corresponding functions.
- */
-char *builtin_str[] = {
-  "cd",
-  "help",
-  "exit",
-  "setshellname",
-  "setterminator",
-  "newname",
-  "listnewnames",
-  "savenewnames",
-  "readnewnames",
-  "STOP"
-};
-
-int (*builtin_func[]) (char **) = {
-  &lsh_cd,
-  &lsh_help,
-  &lsh_exit,
-  &setshellname,
-  &setterminator,
-  &newname,
-  &listnewnames,
-  &savenewnames,
-  &readnewnames,
-  &lsh_stop
-};
-
-/**
-   @brief Returns the number of built-in commands available in the shell.
-   @return The count of built-in commands.
- */
-int lsh_num_builtins() {
-    return sizeof(builtin_str) / sizeof(char *);
-}
-
-/**
-   @brief Builtin command: change directory.
-   @param args List of args. args[0] is "cd". args[1] is the directory to change to.
-   @return Always returns 1 to continue executing.
- */
-int lsh_cd(char **args) {
-    if (args[1] == NULL) {
-        fprintf(stderr, "lsh: expected argument to \"cd\"\n");
-    } else {
-        if (chdir(args[1]) != 0) {
-            perror("lsh");
-        }
-    }
-    return 1;
-}
-
-/**
-   @brief Builtin command: print help.
-   @param args List of args. Not examined.
-   @return Always returns 1 to continue executing.
- */
-int lsh_help(char **args) {
-    printf("myshell - Available commands:\n");
-    printf("HELP: Show this help message.\n");
-    printf("STOP: Terminate the shell session.\n");
-    printf("SETSHELLNAME <name>: Set the shell prompt name.\n");
-    printf("SETTERMINATOR <terminator>: Set the prompt terminator.\n");
-    printf("NEWNAME <new_name> <old_name>: Create an alias for a command.\n");
-    printf("LISTNEWNAMES: List all aliases.\n");
-    printf("SAVENEWNAMES <file_name>: Save aliases to a file.\n");
-    printf("READNEWNAMES <file_name>: Read aliases from a file.\n");
-    printf("<UNIX_command>: Execute any valid UNIX command.\n");
-    return 1;
-}
-
-/**
-   @brief Builtin command: exit the shell.
-   @param args List of args. Not examined.
-   @return Always returns 0 to terminate execution.
- */
-int lsh_exit(char **args) {
-    return 0;
-}
-
-/**
-   @brief Builtin command: terminate the shell session.
-   @param args List of args. Not examined.
-   @return Always returns 0 to terminate execution.
- */
-int lsh_stop(char **args) {
-    return 0; // Returning 0 will stop the main loop
-}
-
-/**
-   @brief Sets the shell name for the prompt.
-   @param args List of args. args[1] is the new shell name.
-   @return Always returns 1 to continue executing.
- */
-int setshellname(char **args) {
-    if (args[1] == NULL) {
-        shellname = "myshell";
-    } else {
-        shellname = args[1];
-    }
-    return 1;
-}
-
-/**
-   @brief Sets the terminator for the prompt.
-   @param args List of args. args[1] is the new terminator.
-   @return Always returns 1 to continue executing.
- */
-int setterminator(char **args) {
-    if (args[1] == NULL) {
-        terminator = ">";
-    } else {
-        terminator = args[1];
-    }
-    return 1;
-}
-
-/**
-   @brief Manages alias creation and deletion.
-   @param args List of args. args[1] is the new alias, args[2] is the original command.
-   @return Always returns 1 to continue executing.
- */
-int newname(char **args) {
-    // Check for correct argument count
-    if (args[1] == NULL) {
-        fprintf(stderr, "Error: expected 1 or 2 arguments to \"newname\"\n");
-        return 1;
-    }
-
-    // Delete alias if only one argument is provided
-    if (args[2] == NULL) {
-        // Attempt to delete the alias if it exists
-        for (int i = 0; i < alias_count; i++) {
-            if (strcmp(aliases[i].new_name, args[1]) == 0) {
-                // Shift aliases down to remove the alias
-                for (int j = i; j < alias_count - 1; j++) {
-                    aliases[j] = aliases[j + 1];
-                }
-                alias_count--;
-                return 1;
-            }
-        }
-        fprintf(stderr, "Alias not found: %s\n", args[1]);
-    } else {
-        // Add or update alias
-        if (alias_count < MAX_ALIASES) {
-            aliases[alias_count].new_name = strdup(args[1]);
-            aliases[alias_count].old_name = strdup(args[2]);
-            alias_count++;
-        } else {
-            fprintf(stderr, "Maximum number of aliases reached.\n");
-        }
-    }
-    return 1;
-}
-
-/**
-   @brief Lists all defined aliases.
-   @param args List of args. Not examined.
-   @return Always returns 1 to continue executing.
- */
-int listnewnames(char **args) {
-    for (int i = 0; i < alias_count; i++) {
-        printf("%s -> %s\n", aliases[i].new_name, aliases[i].old_name);
-    }
-    return 1;
-}
-
-/**
-   @brief Saves all aliases to a specified file.
-   @param args List of args. args[1] is the file name.
-   @return Always returns 1 to continue executing.
- */
-int savenewnames(char **args) {
-    // Check if the correct argument is provided
-    if (args[1] == NULL) {
-        fprintf(stderr, "Error: argument 1 expected to \"SAVENEWNAMES\"\n");
-        return 1;
-    }
-    
-    FILE *file = fopen(args[1], "w");
-    if (!file) {
-        perror("Error opening file");
-        return 1;
-    }
-    //iterates over all defined aliases and writes each alias pair (new name and original command name) to the specified file.
-    for (int i = 0; i < alias_count; i++) {
-        fprintf(file, "%s %s\n", aliases[i].new_name, aliases[i].old_name);
-    }
-    
-    fclose(file);
-    return 1;
-}
-
-/**
-   @brief Reads aliases from a specified file.
-   @param args List of args. args[1] is the file name.
-   @return Always returns 1 to continue executing.
- */
-int readnewnames(char **args) {
-    // Check if the correct argument is provided
-    if (args[1] == NULL) {
-        fprintf(stderr, "Error: argument 1 expected to \"READNEWNAMES\"\n");
-        return 1;
-    }
-    
-    FILE *file = fopen(args[1], "r");
-    if (!file) {
-        perror("Error opening file");
-        return 1;
-    }
-    // reads pairs of alias and command names from a file and adds them to the shell's alias list until all pairs are read or the maximum alias limit is reached
-    char new_name[256], old_name[256]; 
-    while (fscanf(file, "%s %s", new_name, old_name) == 2) {
-        if (alias_count < MAX_ALIASES) {
-            aliases[alias_count].new_name = strdup(new_name);
-            aliases[alias_count].old_name = strdup(old_name);
-            alias_count++;
-        }
-    }
-    
-    fclose(file);
-    return 1;
-}
-
-/**
-  @brief Launch a program and wait for it to terminate.
-  @param args Null terminated list of arguments (including program).
-  @return Always returns 1 to continue execution.
- */
-int lsh_launch(char **args) {
-    pid_t pid;
-    int status;
-
-    pid = fork();
-    if (pid == 0) {
-        // Child process
-        if (execvp(args[0], args) == -1) {
-            perror("lsh");
-        }
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        // Error forking
-        perror("lsh");
-    } else {
-        // Parent process
-        do {
-            waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-    }
-
-    return 1;
-}
-
-/**
-   @brief Execute shell built-in or launch program.
-   @param args Null terminated list of arguments.
-   @return 1 if the shell should continue running, 0 if it should terminate.
- */
-int lsh_execute(char **args) {
-    int i;
-
-    if (args[0] == NULL) {
-        // An empty command was entered.
-        return 1;
-    }
-
-    // Check for alias replacement
-    for (i = 0; i < alias_count; i++) {
-        if (strcmp(args[0], aliases[i].new_name) == 0) {
-            args[0] = aliases[i].old_name;
-            break;
-        }
-    }
-
-    // Check for built-in commands
-    for (i = 0; i < lsh_num_builtins(); i++) {
-        if (strcmp(args[0], builtin_str[i]) == 0) {
-            return (*builtin_func[i])(args);
-        }
-    }
-
-    // Launch external command
-    return lsh_launch(args);
-}
-
-/**
-   @brief Read a line of input from stdin.
-   @return The line from stdin.
- */
-char *lsh_read_line(void) {
-#define LSH_RL_BUFSIZE 1024
-    int bufsize = LSH_RL_BUFSIZE;
-    int position = 0;
-    char *buffer = malloc(sizeof(char) * bufsize);
-    int c;
-
-    if (!buffer) {
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
-    }
-
-    while (1) {
-        // Read a character
-        c = getchar();
-
-        if (c == EOF) {
-            exit(EXIT_SUCCESS);
-        } else if (c == '\n') {
-            buffer[position] = '\0';
-            return buffer;
-        } else {
-            buffer[position] = c;
-        }
-        position++;
-
-        // If we have exceeded the buffer, reallocate.
-        if (position >= bufsize) {
-            bufsize += LSH_RL_BUFSIZE;
-            buffer = realloc(buffer, bufsize);
-            if (!buffer) {
-                fprintf(stderr, "lsh: allocation error\n");
-                exit(EXIT_FAILURE);
-            }
-        }
-    }
-}
-
-#define LSH_TOK_BUFSIZE 64
-#define LSH_TOK_DELIM " \t\r\n\a"
-/**
-   @brief Split a line into tokens (very naively).
-   @param line The line to be split.
-   @return Null-terminated array of tokens.
- */
-char **lsh_split_line(char *line) {
-    int bufsize = LSH_TOK_BUFSIZE, position = 0;
-    char **tokens = malloc(bufsize * sizeof(char*));
-    char *token, **tokens_backup;
-
-    if (!tokens) {
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
-    }
-
-    token = strtok(line, LSH_TOK_DELIM);
-    while (token != NULL) {
-        tokens[position] = token;
-        position++;
-
-        if (position >= bufsize) {
-            bufsize += LSH_TOK_BUFSIZE;
-            tokens_backup = tokens;
-            tokens = realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
-                free(tokens_backup);
-                fprintf(stderr, "lsh: allocation error\n");
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        token = strtok(NULL, LSH_TOK_DELIM);
-    }
-    tokens[position] = NULL;
-    return tokens;
-}
-
-/**
-   @brief Loop getting input and executing it.
- */
-void lsh_loop(void) {
-    char *line;
-    char **args;
-    int status;
-
-    do {
-        printf("%s%s ", shellname, terminator); // Use both shellname and terminator
-        line = lsh_read_line();
-        args = lsh_split_line(line);
-        status = lsh_execute(args);
-
-        // free(line);
-        // free(args);
-    } while (status);
-}
-
-/**
-   @brief Main entry point.
-   @param argc Argument count.
-   @param argv Argument vector.
-   @return status code.
- */
-int main(int argc, char **argv) {
-    // Load config files, if any.
-
-    // Run command loop.
-    lsh_loop();
-
-    // Perform any shutdown/cleanup.
-
-    return EXIT_SUCCESS;
-}
+/***************************************************************************//**
+  @file         myshell.c
+  @author       Salvador Prieto
+  @date         09/25/2024
+  @brief        myshell - A custom shell implementation with built-in commands.
+
+  This program implements a simple shell that includes basic commands like
+  SETSHELLNAME, SETTERMINATOR, and alias management, as well as executing
+  standard Unix commands.
+
+  Build with: gcc -O2 -pthread myshell.c -o myshell -ldl
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <sys/random.h>
+#include <sys/prctl.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <time.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <linux/fs.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+#include "myshell_plugin.h"
+
+/*
+  Global Variables:
+*/
+char *shellname = "myshell"; // Default shell name
+char *terminator = ">";       // Default prompt terminator
+int shellname_owned = 0;      // shellname was allocated by setshellname
+int terminator_owned = 0;     // terminator was allocated by setterminator
+int lsh_status = 0;           // Exit status of the last command
+int lsh_expand_failed = 0;    // An expansion in the current command failed
+
+#define LSH_ALIAS_FILE ".myshell_aliases" // Per-directory alias file
+
+/*
+  Alias Structure
+*/
+struct Alias {
+    char *new_name; // Alias name
+    char *old_name; // Original command name
+};
+
+struct Alias *aliases = NULL; // Aliases defined with newname/readnewnames
+int alias_count = 0;
+int alias_cap = 0;
+int *alias_order = NULL; // Indices into aliases, sorted by name
+int alias_order_stale = 0; // alias_order needs sorting before use
+
+/*
+  Function Declarations for builtin shell commands:
+ */
+int lsh_cd(char **args);
+int lsh_help(char **args);
+int lsh_exit(char **args);
+int setshellname(char **args);
+int setterminator(char **args);
+int newname(char **args);
+int listnewnames(char **args);
+int savenewnames(char **args);
+int readnewnames(char **args);
+int lsh_stop(char **args);
+int lsh_match(char **args);
+int lsh_psort(char **args);
+int lsh_pfind(char **args);
+int lsh_jget(char **args);
+int lsh_csv(char **args);
+int lsh_spool(char **args);
+int lsh_cachedsource(char **args);
+int lsh_plugin(char **args);
+int lsh_subreaper(char **args);
+int lsh_partition(char **args);
+int lsh_checksum(char **args);
+int lsh_pcp(char **args);
+int lsh_prm(char **args);
+int lsh_waitfor(char **args);
+int lsh_let(char **args);
+int lsh_test(char **args);
+int lsh_dbracket(char **args);
+
+/*
+  List of builtin commands, followed by their corresponding functions.
+ */
+char *builtin_str[] = {
+  "cd",
+  "help",
+  "exit",
+  "setshellname",
+  "setterminator",
+  "newname",
+  "listnewnames",
+  "savenewnames",
+  "readnewnames",
+  "STOP",
+  "match",
+  "psort",
+  "pfind",
+  "jget",
+  "csv",
+  "spool",
+  "cachedsource",
+  "plugin",
+  "subreaper",
+  "partition",
+  "checksum",
+  "pcp",
+  "prm",
+  "waitfor",
+  "let",
+  "test",
+  "[",
+  "[["
+};
+
+int (*builtin_func[]) (char **) = {
+  &lsh_cd,
+  &lsh_help,
+  &lsh_exit,
+  &setshellname,
+  &setterminator,
+  &newname,
+  &listnewnames,
+  &savenewnames,
+  &readnewnames,
+  &lsh_stop,
+  &lsh_match,
+  &lsh_psort,
+  &lsh_pfind,
+  &lsh_jget,
+  &lsh_csv,
+  &lsh_spool,
+  &lsh_cachedsource,
+  &lsh_plugin,
+  &lsh_subreaper,
+  &lsh_partition,
+  &lsh_checksum,
+  &lsh_pcp,
+  &lsh_prm,
+  &lsh_waitfor,
+  &lsh_let,
+  &lsh_test,
+  &lsh_test,
+  &lsh_dbracket
+};
+
+/*
+  Builtins that can also run as record stages, passing rows to each other
+  when they are neighbours in a pipeline.
+ */
+struct lsh_stage;
+int lsh_match_open(struct lsh_stage *st, char **args);
+int lsh_jget_open(struct lsh_stage *st, char **args);
+int lsh_csv_open(struct lsh_stage *st, char **args);
+
+char *record_builtin_str[] = {
+  "match",
+  "jget",
+  "csv"
+};
+
+int (*record_builtin_open[]) (struct lsh_stage *, char **) = {
+  &lsh_match_open,
+  &lsh_jget_open,
+  &lsh_csv_open
+};
+
+/**
+   @brief Returns the number of built-in commands available in the shell.
+   @return The count of built-in commands.
+ */
+int lsh_num_builtins() {
+    return sizeof(builtin_str) / sizeof(char *);
+}
+
+/*
+  Buffered output shared by the builtins that stream data.
+*/
+#define LSH_OUT_BUFSIZE (1 << 16)
+char lsh_out_buf[LSH_OUT_BUFSIZE];
+size_t lsh_out_len = 0;
+
+/**
+   @brief Write everything in a buffer to a file descriptor.
+   @param fd Destination descriptor.
+   @param data Bytes to write.
+   @param len Number of bytes.
+   @return 0 on success, -1 on error (errno is set).
+ */
+int lsh_write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+   @brief Flush the builtin output buffer (and stdio before it) to stdout.
+ */
+void lsh_out_flush(void) {
+    fflush(stdout);
+    if (lsh_out_len > 0) {
+        if (lsh_write_all(STDOUT_FILENO, lsh_out_buf, lsh_out_len) != 0 && errno != EPIPE) {
+            perror("lsh");
+        }
+        lsh_out_len = 0;
+    }
+}
+
+/**
+   @brief Append bytes to the builtin output buffer.
+   @param data Bytes to output.
+   @param len Number of bytes.
+ */
+void lsh_out_write(const char *data, size_t len) {
+    if (lsh_out_len + len > LSH_OUT_BUFSIZE) {
+        lsh_out_flush();
+        // Large blocks go straight through instead of being copied.
+        if (len >= LSH_OUT_BUFSIZE) {
+            if (lsh_write_all(STDOUT_FILENO, data, len) != 0 && errno != EPIPE) {
+                perror("lsh");
+            }
+            return;
+        }
+    }
+    memcpy(lsh_out_buf + lsh_out_len, data, len);
+    lsh_out_len += len;
+}
+
+/*
+  Line-oriented input source: whole files are mapped, pipes and terminals
+  are read in large chunks. Each call to lsh_input_next hands out a block
+  of complete lines.
+*/
+#define LSH_IN_BUFSIZE (1 << 20)
+struct lsh_input {
+    int fd;
+    char *map;      // Mapping of a regular file, or NULL
+    size_t map_len;
+    char *buf;      // Read buffer for non-mappable input
+    size_t cap;
+    size_t len;     // Bytes held in buf
+    size_t used;    // Bytes of buf already handed out
+    int eof;
+};
+
+/**
+   @brief Open an input source.
+   @param in Input to initialise.
+   @param path File name, or NULL / "-" for standard input.
+   @return 0 on success, -1 on error (errno is set).
+ */
+int lsh_input_open(struct lsh_input *in, const char *path) {
+    struct stat st;
+
+    memset(in, 0, sizeof(*in));
+    if (path == NULL || strcmp(path, "-") == 0) {
+        in->fd = STDIN_FILENO;
+    } else {
+        in->fd = open(path, O_RDONLY);
+        if (in->fd < 0) {
+            return -1;
+        }
+    }
+
+    if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        in->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (in->map == MAP_FAILED) {
+            in->map = NULL;
+        } else {
+            in->map_len = st.st_size;
+            madvise(in->map, in->map_len, MADV_SEQUENTIAL);
+        }
+    }
+    return 0;
+}
+
+/**
+   @brief Get the next block of complete lines from an input source.
+   @param in Input source.
+   @param data Set to the start of the block.
+   @param len Set to the block length. Only the final block of the input may
+              lack a trailing newline.
+   @return 1 if a block was returned, 0 at end of input, -1 on read error.
+ */
+int lsh_input_next(struct lsh_input *in, const char **data, size_t *len) {
+    if (in->map) {
+        if (in->eof) {
+            return 0;
+        }
+        in->eof = 1;
+        *data = in->map;
+        *len = in->map_len;
+        return 1;
+    }
+
+    // Drop what the caller has consumed and keep the partial last line.
+    if (in->used > 0) {
+        memmove(in->buf, in->buf + in->used, in->len - in->used);
+        in->len -= in->used;
+        in->used = 0;
+    }
+
+    while (1) {
+        char *nl = in->len > 0 ? memrchr(in->buf, '\n', in->len) : NULL;
+        if (nl != NULL && (in->eof || in->len == in->cap)) {
+            in->used = nl + 1 - in->buf;
+            *data = in->buf;
+            *len = in->used;
+            return 1;
+        }
+        if (in->eof) {
+            if (in->len == 0) {
+                return 0;
+            }
+            in->used = in->len;
+            *data = in->buf;
+            *len = in->len;
+            return 1;
+        }
+        if (in->len == in->cap) {
+            // A single line longer than the buffer: grow geometrically.
+            in->cap = in->cap ? in->cap * 2 : LSH_IN_BUFSIZE;
+            in->buf = realloc(in->buf, in->cap);
+            if (!in->buf) {
+                fprintf(stderr, "lsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ssize_t n = read(in->fd, in->buf + in->len, in->cap - in->len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            in->eof = 1;
+        } else {
+            // Hand out complete lines as soon as a read delivers some, so
+            // slow producers still stream through.
+            nl = memrchr(in->buf + in->len, '\n', n);
+            in->len += n;
+            if (nl != NULL) {
+                in->used = nl + 1 - in->buf;
+                *data = in->buf;
+                *len = in->used;
+                return 1;
+            }
+        }
+    }
+}
+
+/**
+   @brief Release an input source.
+   @param in Input source.
+ */
+void lsh_input_close(struct lsh_input *in) {
+    if (in->map) {
+        munmap(in->map, in->map_len);
+    }
+    free(in->buf);
+    if (in->fd != STDIN_FILENO) {
+        close(in->fd);
+    }
+}
+
+/**
+   @brief Feed every block of lines from a list of inputs to a callback.
+   @param files Null terminated list of file names; standard input is used
+                when the list is empty.
+   @param fn Called with each block of complete lines.
+   @param ctx Passed through to fn.
+   @return Number of inputs that could not be read.
+ */
+int lsh_for_each_input(char **files, void (*fn)(void *, const char *, size_t), void *ctx) {
+    struct lsh_input in;
+    const char *data;
+    size_t len;
+    int i = 0, rc, errors = 0;
+
+    do {
+        if (lsh_input_open(&in, files[i]) != 0) {
+            perror(files[i]);
+            errors++;
+            continue;
+        }
+        while ((rc = lsh_input_next(&in, &data, &len)) > 0) {
+            fn(ctx, data, len);
+        }
+        if (rc < 0) {
+            perror(files[i] ? files[i] : "lsh");
+            errors++;
+        }
+        lsh_input_close(&in);
+    } while (files[i] != NULL && files[++i] != NULL);
+    return errors;
+}
+
+/*
+  Growable byte buffer.
+*/
+struct lsh_buf {
+    char *data;
+    size_t len, cap;
+};
+
+/**
+   @brief Append bytes to a growable buffer.
+   @param b Buffer.
+   @param data Bytes to append.
+   @param len Number of bytes.
+ */
+void lsh_buf_append(struct lsh_buf *b, const char *data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2 + 256;
+        b->data = realloc(b->data, b->cap);
+        if (!b->data) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/**
+   @brief 64-bit FNV-1a hash of a byte string.
+   @param data Bytes to hash.
+   @param len Number of bytes.
+   @return The hash.
+ */
+uint64_t lsh_hash(const char *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+  A field of a delimited line: a view into the input.
+*/
+struct lsh_field {
+    const char *ptr;
+    size_t len;
+};
+
+/*
+  Record streams. Builtins that can run as record stages hand rows of
+  field views to the next stage when they are neighbours in a pipeline,
+  instead of formatting text for it to parse again. Only the last stage
+  formats its rows as text.
+*/
+struct lsh_row {
+    const struct lsh_field *fields;
+    int nfields;
+    int structured;       // Fields are split; otherwise fields[0] is a text line
+    int quote;            // Quote fields holding the delimiter or '"' in text
+    char delim;           // Separator between fields in text
+};
+
+struct lsh_stage {
+    void *state;
+    // Consume a block of text lines (the first stage's input). Stages
+    // without one get a row per line.
+    void (*block)(struct lsh_stage *st, const char *data, size_t len);
+    void (*row)(struct lsh_stage *st, const struct lsh_row *row);
+    void (*finish)(struct lsh_stage *st);
+    void (*release)(struct lsh_stage *st);
+    char **files;         // Inputs named on the command line
+    struct lsh_stage *next; // NULL: rows are written out as text
+};
+
+/**
+   @brief Add text to a buffer, or to the builtin output if there is none.
+ */
+void lsh_row_put(struct lsh_buf *out, const char *data, size_t len) {
+    if (out) {
+        lsh_buf_append(out, data, len);
+    } else {
+        lsh_out_write(data, len);
+    }
+}
+
+/**
+   @brief Format a row as a line of text.
+   @param row Row.
+   @param out Buffer to append the line to, or NULL for the builtin output.
+ */
+void lsh_row_write(const struct lsh_row *row, struct lsh_buf *out) {
+    for (int i = 0; i < row->nfields; i++) {
+        const struct lsh_field *f = &row->fields[i];
+        int quote = row->quote && (memchr(f->ptr, row->delim, f->len) || memchr(f->ptr, '"', f->len));
+        if (i > 0) {
+            lsh_row_put(out, &row->delim, 1);
+        }
+        if (quote) {
+            // Quotes inside the field are doubled, as RFC 4180 has it.
+            const char *p = f->ptr, *end = f->ptr + f->len, *q;
+            lsh_row_put(out, "\"", 1);
+            while ((q = memchr(p, '"', end - p)) != NULL) {
+                lsh_row_put(out, p, q + 1 - p);
+                lsh_row_put(out, "\"", 1);
+                p = q + 1;
+            }
+            lsh_row_put(out, p, end - p);
+        } else {
+            lsh_row_put(out, f->ptr, f->len);
+        }
+        if (quote) {
+            lsh_row_put(out, "\"", 1);
+        }
+    }
+    lsh_row_put(out, "\n", 1);
+}
+
+/**
+   @brief Get a row as one piece of text, exactly as lsh_row_write would
+          write it (without the newline), formatting it if needed.
+   @param row Row.
+   @param scratch Buffer used when the row has to be formatted.
+   @param len Set to the text length.
+   @return The text (not NUL terminated).
+ */
+const char *lsh_row_text(const struct lsh_row *row, struct lsh_buf *scratch, size_t *len) {
+    const struct lsh_field *f = &row->fields[0];
+
+    if (row->nfields == 1 && !(row->quote && (memchr(f->ptr, row->delim, f->len) || memchr(f->ptr, '"', f->len)))) {
+        *len = f->len;
+        return f->ptr;
+    }
+    scratch->len = 0;
+    lsh_row_write(row, scratch);
+    *len = scratch->len - 1;
+    return scratch->data;
+}
+
+/**
+   @brief Pass a row to the next stage, or write it out if this is the last.
+   @param st Stage emitting the row.
+   @param row Row.
+ */
+void lsh_stage_emit(struct lsh_stage *st, const struct lsh_row *row) {
+    if (st->next) {
+        st->next->row(st->next, row);
+    } else {
+        lsh_row_write(row, NULL);
+    }
+}
+
+/**
+   @brief Pass on a run of text lines unchanged.
+   @param st Stage emitting the lines.
+   @param data Lines; the last one may lack its newline.
+   @param len Length of the run.
+ */
+void lsh_stage_emit_lines(struct lsh_stage *st, const char *data, size_t len) {
+    const char *end = data + len, *nl;
+    struct lsh_field f;
+    struct lsh_row row = { &f, 1, 0, 0, '\n' };
+
+    if (st->next == NULL) {
+        lsh_out_write(data, len);
+        if (len > 0 && end[-1] != '\n') {
+            lsh_out_write("\n", 1);
+        }
+        return;
+    }
+    for (; data < end; data = nl + 1) {
+        if ((nl = memchr(data, '\n', end - data)) == NULL) {
+            nl = end;
+        }
+        f.ptr = data;
+        f.len = nl - data;
+        st->next->row(st->next, &row);
+    }
+}
+
+/**
+   @brief Pass on a single text line unchanged.
+   @param st Stage emitting the line.
+   @param line Line, without its newline.
+   @param len Length of the line.
+ */
+void lsh_stage_emit_line(struct lsh_stage *st, const char *line, size_t len) {
+    struct lsh_field f = { line, len };
+    struct lsh_row row = { &f, 1, 0, 0, '\n' };
+
+    lsh_stage_emit(st, &row);
+}
+
+/**
+   @brief Emit text as the rows its lines would be in a text pipe.
+   @param st Stage emitting the text.
+   @param text Text; a trailing newline still ends one more (empty) line.
+   @param len Length of the text.
+ */
+void lsh_stage_emit_text(struct lsh_stage *st, const char *text, size_t len) {
+    const char *end = text + len, *nl;
+
+    for (;; text = nl + 1) {
+        if ((nl = memchr(text, '\n', end - text)) == NULL) {
+            nl = end;
+        }
+        lsh_stage_emit_line(st, text, nl - text);
+        if (nl == end) {
+            break;
+        }
+    }
+}
+
+/**
+   @brief Default text input of a stage: one row per line.
+   @param st Stage.
+   @param data Block of lines.
+   @param len Length of the block.
+ */
+void lsh_stage_block_lines(struct lsh_stage *st, const char *data, size_t len) {
+    const char *end = data + len, *nl;
+    struct lsh_field f;
+    struct lsh_row row = { &f, 1, 0, 0, '\n' };
+
+    for (; data < end; data = nl + 1) {
+        if ((nl = memchr(data, '\n', end - data)) == NULL) {
+            nl = end;
+        }
+        f.ptr = data;
+        f.len = nl - data;
+        st->row(st, &row);
+    }
+}
+
+/**
+   @brief Input callback feeding the first stage of a chain.
+ */
+void lsh_stages_input(void *arg, const char *data, size_t len) {
+    struct lsh_stage *st = arg;
+
+    if (st->block) {
+        st->block(st, data, len);
+    } else {
+        lsh_stage_block_lines(st, data, len);
+    }
+}
+
+/**
+   @brief Run a chain of opened record stages in this process. The first
+          stage reads its files (or standard input); the others receive
+          rows. Every stage is released afterwards. As in a pipe, the
+          status is the last stage's: what its finish sets, or 1 if it
+          read files and one could not be read.
+   @param stages Stages, in pipeline order.
+   @param n Number of stages.
+ */
+void lsh_stages_run(struct lsh_stage *stages, int n) {
+    int errors;
+
+    for (int i = 0; i < n; i++) {
+        stages[i].next = i + 1 < n ? &stages[i + 1] : NULL;
+    }
+    errors = lsh_for_each_input(stages[0].files, lsh_stages_input, &stages[0]);
+    for (int i = 0; i < n; i++) {
+        lsh_status = i == 0 && errors;
+        if (stages[i].finish) {
+            stages[i].finish(&stages[i]);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (stages[i].release) {
+            stages[i].release(&stages[i]);
+        }
+    }
+    lsh_out_flush();
+}
+
+/*
+  Worker pool used by the parallel builtins. Tasks are taken newest first,
+  which keeps recursive walks depth-first and their open descriptors few.
+*/
+struct lsh_task {
+    void (*fn)(void *);
+    void *arg;
+    struct lsh_task *next;
+};
+
+struct lsh_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // Signalled when a task is queued or on stop
+    pthread_cond_t idle;  // Signalled when the last pending task finishes
+    struct lsh_task *head;
+    long pending;         // Tasks queued or running
+    int stop;
+    int nthreads;
+    pthread_t *threads;
+};
+
+/**
+   @brief Number of processors available to run worker threads.
+   @return Processor count (at least 1).
+ */
+int lsh_num_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/**
+   @brief Worker thread body: run tasks until the pool is stopped.
+   @param arg The pool.
+   @return NULL.
+ */
+void *lsh_pool_worker(void *arg) {
+    struct lsh_pool *pool = arg;
+    struct lsh_task *task;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->head == NULL && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->head == NULL) {
+            break;
+        }
+        task = pool->head;
+        pool->head = task->next;
+        pthread_mutex_unlock(&pool->lock);
+
+        task->fn(task->arg);
+        free(task);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+   @brief Start a worker pool.
+   @param pool Pool to initialise.
+   @param nthreads Number of workers; 0 means one per processor.
+ */
+void lsh_pool_start(struct lsh_pool *pool, int nthreads) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->nthreads = nthreads > 0 ? nthreads : lsh_num_cpus();
+    pool->threads = malloc(pool->nthreads * sizeof(pthread_t));
+    if (!pool->threads) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < pool->nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, lsh_pool_worker, pool) != 0) {
+            fprintf(stderr, "lsh: cannot start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+   @brief Queue a task. Safe to call from inside a running task.
+   @param pool Pool.
+   @param fn Task function.
+   @param arg Passed to fn.
+ */
+void lsh_pool_submit(struct lsh_pool *pool, void (*fn)(void *), void *arg) {
+    struct lsh_task *task = malloc(sizeof(*task));
+
+    if (!task) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    task->fn = fn;
+    task->arg = arg;
+    pthread_mutex_lock(&pool->lock);
+    task->next = pool->head;
+    pool->head = task;
+    pool->pending++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+   @brief Wait until every queued task (and any task they queued) has run.
+   @param pool Pool.
+ */
+void lsh_pool_wait(struct lsh_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+   @brief Drain a pool and stop its workers.
+   @param pool Pool.
+ */
+void lsh_pool_stop(struct lsh_pool *pool) {
+    lsh_pool_wait(pool);
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+}
+
+/**
+   @brief Parse a size such as 4096, 64K, 512M or 2G.
+   @param s String to parse.
+   @param out Set to the size in bytes.
+   @return 0 on success, -1 if the string is not a size.
+ */
+int lsh_parse_size(const char *s, long long *out) {
+    char *end;
+    long long n;
+
+    errno = 0;
+    n = strtoll(s, &end, 10);
+    if (end == s || errno != 0 || n < 0) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+    case 't': case 'T': n <<= 40; end++; break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *out = n;
+    return 0;
+}
+
+/*
+  Vectorized substring search: compare the first and last byte of the
+  needle against 16 (SSE2) or 32 (AVX2) candidate positions at once and
+  only verify the middle bytes where both agree.
+*/
+#if defined(__SSE2__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+const char *lsh_find_avx2(const char *hay, size_t n, const char *needle, size_t k) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+    size_t i = 0;
+
+    for (; i + k - 1 + 32 <= n; i += 32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *)(hay + i + k - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, bf),
+                                                              _mm256_cmpeq_epi8(last, bl)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, k - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return memmem(hay + i, n - i, needle, k);
+}
+
+const char *lsh_find_sse2(const char *hay, size_t n, const char *needle, size_t k) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[k - 1]);
+    size_t i = 0;
+
+    for (; i + k - 1 + 16 <= n; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(hay + i + k - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf),
+                                                        _mm_cmpeq_epi8(last, bl)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, k - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return memmem(hay + i, n - i, needle, k);
+}
+#endif
+
+/**
+   @brief Find the first occurrence of a byte string.
+   @param hay Buffer to search.
+   @param n Length of the buffer.
+   @param needle String to look for.
+   @param k Length of the needle (must be at least 1).
+   @return Pointer to the first occurrence, or NULL.
+ */
+const char *lsh_find(const char *hay, size_t n, const char *needle, size_t k) {
+    if (k > n) {
+        return NULL;
+    }
+    if (k == 1) {
+        return memchr(hay, needle[0], n);
+    }
+#if defined(__SSE2__) && defined(__GNUC__)
+    return __builtin_cpu_supports("avx2") ? lsh_find_avx2(hay, n, needle, k) : lsh_find_sse2(hay, n, needle, k);
+#else
+    return memmem(hay, n, needle, k);
+#endif
+}
+
+/*
+  Aliases come in layers. The shell's own aliases (newname, readnewnames)
+  are the outermost layer; every directory from / down to the working
+  directory that holds an alias file adds a layer on top, and the
+  innermost definition of a name wins. All active layers are merged into
+  one open-addressing table, so resolving a command is a single probe.
+*/
+struct lsh_alias_slot {
+    const char *name;  // NULL if the slot is empty
+    const char *value;
+    int layer;         // 0 for the shell's own aliases
+    int index;         // Position in its layer's list
+};
+
+struct lsh_alias_table {
+    struct lsh_alias_slot *slots;
+    size_t cap, n;     // cap is a power of two
+} lsh_alias_index;
+
+/*
+  Aliases loaded from one directory's alias file. Layers stay cached after
+  the shell leaves their directory and are reused on return for as long as
+  the file keeps its inode, owner, mode and modification time. A file that
+  is not the user's own, or that others can write to, is not trusted: its
+  layer stays empty and inactive.
+*/
+struct lsh_alias_layer {
+    char *dir;
+    dev_t dev;
+    ino_t ino;
+    uid_t uid;
+    mode_t mode;
+    struct timespec mtime;
+    int trusted;
+    struct Alias *items;
+    int n, cap;
+    struct lsh_alias_layer *next; // Next cached layer
+};
+
+struct lsh_alias_layer *lsh_alias_cache = NULL;
+struct lsh_alias_layer **lsh_alias_active = NULL; // Outermost first
+int lsh_alias_nactive = 0;
+
+/**
+   @brief Find the slot for a name in the alias table.
+   @param t Table (with at least one free slot).
+   @param name Alias name.
+   @return The slot holding the name, or the empty slot where it belongs.
+ */
+struct lsh_alias_slot *lsh_alias_probe(struct lsh_alias_table *t, const char *name) {
+    size_t i = lsh_hash(name, strlen(name)) & (t->cap - 1);
+
+    while (t->slots[i].name != NULL && strcmp(t->slots[i].name, name) != 0) {
+        i = (i + 1) & (t->cap - 1);
+    }
+    return &t->slots[i];
+}
+
+/**
+   @brief Look up an alias in the merged table.
+   @param name Alias name.
+   @return Its slot, or NULL if no active layer defines it.
+ */
+struct lsh_alias_slot *lsh_alias_lookup(const char *name) {
+    struct lsh_alias_slot *slot;
+
+    if (lsh_alias_index.n == 0) {
+        return NULL;
+    }
+    slot = lsh_alias_probe(&lsh_alias_index, name);
+    return slot->name ? slot : NULL;
+}
+
+/**
+   @brief Enter a definition in the merged table, replacing any other.
+   @param name Alias name.
+   @param value Command it stands for.
+   @param layer Layer the definition comes from.
+   @param index Position of the definition in its layer.
+ */
+void lsh_alias_put(const char *name, const char *value, int layer, int index) {
+    struct lsh_alias_table *t = &lsh_alias_index;
+    struct lsh_alias_slot *slot;
+
+    if ((t->n + 1) * 2 > t->cap) {
+        struct lsh_alias_table grown = { NULL, t->cap ? t->cap * 2 : 64, 0 };
+        grown.slots = calloc(grown.cap, sizeof(struct lsh_alias_slot));
+        if (!grown.slots) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < t->cap; i++) {
+            if (t->slots[i].name) {
+                *lsh_alias_probe(&grown, t->slots[i].name) = t->slots[i];
+            }
+        }
+        grown.n = t->n;
+        free(t->slots);
+        *t = grown;
+    }
+    slot = lsh_alias_probe(t, name);
+    if (slot->name == NULL) {
+        t->n++;
+    }
+    slot->name = name;
+    slot->value = value;
+    slot->layer = layer;
+    slot->index = index;
+}
+
+/**
+   @brief Remove a name from the merged table.
+   @param name Alias name.
+ */
+void lsh_alias_remove(const char *name) {
+    struct lsh_alias_table *t = &lsh_alias_index;
+    struct lsh_alias_slot *slot = lsh_alias_lookup(name);
+    size_t hole, i, home;
+
+    if (slot == NULL) {
+        return;
+    }
+    // Shift later members of the probe run back so none is cut off.
+    hole = i = slot - t->slots;
+    while (1) {
+        i = (i + 1) & (t->cap - 1);
+        if (t->slots[i].name == NULL) {
+            break;
+        }
+        home = lsh_hash(t->slots[i].name, strlen(t->slots[i].name)) & (t->cap - 1);
+        if (((i - home) & (t->cap - 1)) >= ((i - hole) & (t->cap - 1))) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole].name = NULL;
+    t->n--;
+}
+
+/**
+   @brief Rebuild the merged table from the shell's aliases and the active
+          directory layers, innermost last so that it wins.
+ */
+void lsh_alias_reindex(void) {
+    if (lsh_alias_index.slots) {
+        memset(lsh_alias_index.slots, 0, lsh_alias_index.cap * sizeof(struct lsh_alias_slot));
+    }
+    lsh_alias_index.n = 0;
+    for (int i = 0; i < alias_count; i++) {
+        lsh_alias_put(aliases[i].new_name, aliases[i].old_name, 0, i);
+    }
+    for (int l = 0; l < lsh_alias_nactive; l++) {
+        for (int i = 0; i < lsh_alias_active[l]->n; i++) {
+            lsh_alias_put(lsh_alias_active[l]->items[i].new_name,
+                          lsh_alias_active[l]->items[i].old_name, l + 1, i);
+        }
+    }
+}
+
+/**
+   @brief Append an alias to a list, growing it geometrically.
+   @param items List.
+   @param n Number of entries.
+   @param cap Capacity.
+   @param new_name Alias name (copied).
+   @param old_name Command it stands for (copied).
+ */
+void lsh_alias_append(struct Alias **items, int *n, int *cap, const char *new_name, const char *old_name) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        *items = realloc(*items, *cap * sizeof(struct Alias));
+        if (!*items) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*items)[*n].new_name = strdup(new_name);
+    (*items)[*n].old_name = strdup(old_name);
+    if (!(*items)[*n].new_name || !(*items)[*n].old_name) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    (*n)++;
+}
+
+/**
+   @brief Read "name command" pairs, one per line, into an alias list.
+   @param file Open alias file.
+   @param items List.
+   @param n Number of entries.
+   @param cap Capacity.
+ */
+void lsh_alias_parse(FILE *file, struct Alias **items, int *n, int *cap) {
+    char *line = NULL, *new_name, *old_name, *save;
+    size_t size = 0;
+
+    while (getline(&line, &size, file) != -1) {
+        new_name = strtok_r(line, " \t\r\n", &save);
+        old_name = strtok_r(NULL, " \t\r\n", &save);
+        if (new_name && old_name && new_name[0] != '#') {
+            lsh_alias_append(items, n, cap, new_name, old_name);
+        }
+    }
+    free(line);
+}
+
+/**
+   @brief Get the alias layer of a directory, from the cache if the file
+          has not changed since it was read.
+   @param dir Directory path.
+   @param reloaded Set to 1 if the file had to be read.
+   @return The layer, or NULL if the directory has no trusted alias file.
+ */
+struct lsh_alias_layer *lsh_alias_layer_get(const char *dir, int *reloaded) {
+    char path[PATH_MAX];
+    struct lsh_alias_layer *layer, **link;
+    struct stat st, opened;
+    FILE *file = NULL;
+
+    snprintf(path, sizeof(path), "%s%s" LSH_ALIAS_FILE, dir, dir[strlen(dir) - 1] == '/' ? "" : "/");
+    // One layer per directory, so a replaced file reuses its old layer.
+    for (link = &lsh_alias_cache; (layer = *link) != NULL; link = &layer->next) {
+        if (strcmp(layer->dir, dir) == 0) {
+            break;
+        }
+    }
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (layer != NULL) {
+            // The file is gone: drop its layer (reindexed by the caller).
+            *link = layer->next;
+            for (int i = 0; i < layer->n; i++) {
+                free(layer->items[i].new_name);
+                free(layer->items[i].old_name);
+            }
+            free(layer->items);
+            free(layer->dir);
+            free(layer);
+            *reloaded = 1;
+        }
+        return NULL;
+    }
+    if (layer && layer->dev == st.st_dev && layer->ino == st.st_ino && layer->uid == st.st_uid &&
+        layer->mode == st.st_mode && layer->mtime.tv_sec == st.st_mtim.tv_sec &&
+        layer->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return layer->trusted ? layer : NULL;
+    }
+    if (layer == NULL) {
+        layer = calloc(1, sizeof(struct lsh_alias_layer));
+        if (!layer || !(layer->dir = strdup(dir))) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        layer->next = lsh_alias_cache;
+        lsh_alias_cache = layer;
+    }
+    // The file changed (or is new): read it again from scratch.
+    for (int i = 0; i < layer->n; i++) {
+        free(layer->items[i].new_name);
+        free(layer->items[i].old_name);
+    }
+    layer->n = 0;
+    layer->dev = st.st_dev;
+    layer->ino = st.st_ino;
+    layer->uid = st.st_uid;
+    layer->mode = st.st_mode;
+    layer->mtime = st.st_mtim;
+    layer->trusted = st.st_uid == getuid() && !(st.st_mode & (S_IWGRP | S_IWOTH));
+    *reloaded = 1;
+    if (!layer->trusted) {
+        fprintf(stderr, "lsh: ignoring %s: not owned by you or writable by others\n", path);
+        return NULL;
+    }
+    // Check again what was opened, in case the file was swapped meanwhile.
+    if ((file = fopen(path, "r")) == NULL || fstat(fileno(file), &opened) != 0 ||
+        opened.st_dev != st.st_dev || opened.st_ino != st.st_ino) {
+        if (file) {
+            fclose(file);
+        }
+        layer->trusted = 0;
+        return NULL;
+    }
+    lsh_alias_parse(file, &layer->items, &layer->n, &layer->cap);
+    fclose(file);
+    return layer;
+}
+
+/**
+   @brief Work out which directory layers apply to the working directory
+          and reindex if that set changed.
+ */
+void lsh_alias_enter_cwd(void) {
+    char cwd[PATH_MAX], *slash;
+    struct lsh_alias_layer *found[PATH_MAX / 2], *layer;
+    int nfound = 0, changed = 0;
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return;
+    }
+    // Walk from the working directory up to /, innermost first.
+    while (1) {
+        if ((layer = lsh_alias_layer_get(cwd, &changed)) != NULL) {
+            found[nfound++] = layer;
+        }
+        if ((slash = strrchr(cwd, '/')) == NULL || cwd[1] == '\0') {
+            break;
+        }
+        slash[slash == cwd ? 1 : 0] = '\0';
+    }
+
+    changed |= nfound != lsh_alias_nactive;
+    lsh_alias_active = realloc(lsh_alias_active, (nfound + 1) * sizeof(struct lsh_alias_layer *));
+    if (!lsh_alias_active) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nfound; i++) {
+        changed |= i >= lsh_alias_nactive || lsh_alias_active[i] != found[nfound - 1 - i];
+        lsh_alias_active[i] = found[nfound - 1 - i];
+    }
+    lsh_alias_nactive = nfound;
+    // Moving between directories under the same alias files costs nothing.
+    if (changed) {
+        lsh_alias_reindex();
+    }
+}
+
+/**
+   @brief Builtin command: change directory.
+   @param args List of args. args[0] is "cd". args[1] is the directory to change to.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_cd(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "lsh: expected argument to \"cd\"\n");
+    } else {
+        if (chdir(args[1]) != 0) {
+            perror("lsh");
+        } else {
+            lsh_alias_enter_cwd(); // Pick up the alias files of the new directory
+        }
+    }
+    return 1;
+}
+
+/**
+   @brief Builtin command: print help.
+   @param args List of args. Not examined.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_help(char **args) {
+    printf("myshell - Available commands:\n");
+    printf("HELP: Show this help message.\n");
+    printf("STOP: Terminate the shell session.\n");
+    printf("SETSHELLNAME <name>: Set the shell prompt name.\n");
+    printf("SETTERMINATOR <terminator>: Set the prompt terminator.\n");
+    printf("NEWNAME <new_name> <old_name>: Create an alias for a command.\n");
+    printf("LISTNEWNAMES [-s] [-p <prefix>] [-o <offset>] [-n <count>] [glob]: List aliases (sorted when filtered).\n");
+    printf("SAVENEWNAMES <file_name>: Save aliases to a file.\n");
+    printf("READNEWNAMES <file_name>: Read aliases from a file.\n");
+    printf("CD <dir>: Change directory; aliases in " LSH_ALIAS_FILE " of it and its parents apply there (files must be yours and not writable by others).\n");
+    printf("MATCH [-v] [-c] <string> [file...]: Print lines containing a fixed string (^ and $ anchor it).\n");
+    printf("PSORT [-n] [-r] [-k <field>] [-t <sep>] [-S <size>] [file...]: Sort lines in parallel (-k compares that field only).\n");
+    printf("PFIND [path...] [-name <glob>] [-type <c>] [-size [+-]N] [-mtime [+-]N] [-print0]: Find files in parallel.\n");
+    printf("JGET [-r] <path> [file...]: Print a field (e.g. .a.b[0]) of each JSON value.\n");
+    printf("CSV [-d <c>|-t] [-H] [-f <cols>] [-w <col>=<text>] [-g <col>] [-s <col>] [file...]: Select and summarise columns.\n");
+    printf("SPOOL [-j <slots>] [-M <budget>] [-m <size>] [command...]: Queue a command to run in the background, or list queued jobs.\n");
+    printf("CACHEDSOURCE [-f] <script>: Source a script with /bin/sh once, then replay its environment, cwd and alias changes.\n");
+    printf("PLUGIN [file.so...]: Load builtin plugins, or list the loaded ones.\n");
+    printf("SUBREAPER [on|off]: Reap orphaned descendants, or report CPU and peak memory per command tree.\n");
+    printf("PARTITION [-k <field>] [-t <sep>] [-o <template>] [file...]: Write each line to the file named by its key (%%s in template).\n");
+    printf("CHECKSUM [-a crc32c|xxh64|sha256] [-c] [file...]: Print or check file checksums, hashing files in parallel.\n");
+    printf("PCP <source>... <target>: Copy files and directory trees in parallel.\n");
+    printf("PRM [-f] <path>...: Remove files and directory trees in parallel.\n");
+    printf("WAITFOR [-t <seconds>] [-e|-g|-m <path>] [-p <pid>]...: Wait until a file exists, is gone or changes, or a process exits.\n");
+    printf("LET <expr>...: Evaluate arithmetic, e.g. let i+=1; also $((expr)) in words.\n");
+    printf("TEST <expr> | [ <expr> ]: Check strings, files or numbers; sets $? to 0 if true.\n");
+    printf("[[ <expr> ]]: As test, plus str =~ regex (groups in ${BASH_REMATCH[n]}) and glob ==, !=.\n");
+    printf("<command> | <command>: Connect commands with a pipe (neighbouring MATCH, JGET and CSV pass rows directly).\n");
+    printf("<UNIX_command>: Execute any valid UNIX command.\n");
+    return 1;
+}
+
+/**
+   @brief Builtin command: exit the shell.
+   @param args List of args. Not examined.
+   @return Always returns 0 to terminate execution.
+ */
+int lsh_exit(char **args) {
+    return 0;
+}
+
+/**
+   @brief Builtin command: terminate the shell session.
+   @param args List of args. Not examined.
+   @return Always returns 0 to terminate execution.
+ */
+int lsh_stop(char **args) {
+    return 0; // Returning 0 will stop the main loop
+}
+
+/**
+   @brief Sets the shell name for the prompt.
+   @param args List of args. args[1] is the new shell name.
+   @return Always returns 1 to continue executing.
+ */
+int setshellname(char **args) {
+    char *value = strdup(args[1] == NULL ? "myshell" : args[1]);
+
+    // The arguments only last for the current line, so keep a copy.
+    if (!value) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (shellname_owned) {
+        free(shellname);
+    }
+    shellname = value;
+    shellname_owned = 1;
+    return 1;
+}
+
+/**
+   @brief Sets the terminator for the prompt.
+   @param args List of args. args[1] is the new terminator.
+   @return Always returns 1 to continue executing.
+ */
+int setterminator(char **args) {
+    char *value = strdup(args[1] == NULL ? ">" : args[1]);
+
+    // The arguments only last for the current line, so keep a copy.
+    if (!value) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (terminator_owned) {
+        free(terminator);
+    }
+    terminator = value;
+    terminator_owned = 1;
+    return 1;
+}
+
+/**
+   @brief Find one of the shell's own aliases.
+   @param name Alias name.
+   @return Its index in aliases, or -1.
+ */
+int lsh_alias_base_find(const char *name) {
+    struct lsh_alias_slot *slot = lsh_alias_lookup(name);
+
+    if (slot == NULL) {
+        return -1;
+    }
+    if (slot->layer == 0) {
+        return slot->index;
+    }
+    // A directory layer hides it in the table; look behind it.
+    for (int i = 0; i < alias_count; i++) {
+        if (strcmp(aliases[i].new_name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+   @brief Compare two alias indices by name for qsort.
+ */
+int lsh_alias_order_cmp(const void *a, const void *b) {
+    return strcmp(aliases[*(const int *)a].new_name, aliases[*(const int *)b].new_name);
+}
+
+/**
+   @brief Binary search the sorted order of the shell's aliases, sorting
+          it first if a bulk load left it unsorted.
+   @param name Alias name (or any string).
+   @return Position of the first alias not less than name.
+ */
+int lsh_alias_order_find(const char *name) {
+    int lo = 0, hi = alias_count;
+
+    if (alias_order_stale) {
+        qsort(alias_order, alias_count, sizeof(int), lsh_alias_order_cmp);
+        alias_order_stale = 0;
+    }
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(aliases[alias_order[mid]].new_name, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+   @brief Define one of the shell's own aliases, or redefine it.
+   @param new_name Alias name.
+   @param old_name Command it stands for.
+   @param bulk Nonzero when many aliases are being loaded: the sorted
+               order is then rebuilt once, when next needed, instead of
+               being kept up to date with a memmove per alias.
+ */
+void lsh_alias_base_set(const char *new_name, const char *old_name, int bulk) {
+    int i = lsh_alias_base_find(new_name);
+    struct lsh_alias_slot *slot;
+    char *copy;
+
+    if (i < 0) {
+        int cap = alias_cap, at = bulk || alias_order_stale ? alias_count : lsh_alias_order_find(new_name);
+        lsh_alias_append(&aliases, &alias_count, &alias_cap, new_name, old_name);
+        if (alias_cap != cap && (alias_order = realloc(alias_order, alias_cap * sizeof(int))) == NULL) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memmove(alias_order + at + 1, alias_order + at, (alias_count - 1 - at) * sizeof(int));
+        alias_order[at] = alias_count - 1;
+        alias_order_stale |= bulk;
+        if (lsh_alias_lookup(new_name) == NULL) {
+            lsh_alias_put(aliases[alias_count - 1].new_name, aliases[alias_count - 1].old_name,
+                          0, alias_count - 1);
+        }
+        return;
+    }
+    if ((copy = strdup(old_name)) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    free(aliases[i].old_name);
+    aliases[i].old_name = copy;
+    if ((slot = lsh_alias_lookup(new_name))->layer == 0) {
+        slot->value = copy;
+    }
+}
+
+/**
+   @brief Delete one of the shell's own aliases, keeping the others in
+          the order they were defined.
+   @param i Index in aliases.
+ */
+void lsh_alias_base_delete(int i) {
+    struct lsh_alias_slot *slot = lsh_alias_lookup(aliases[i].new_name);
+
+    int at = lsh_alias_order_find(aliases[i].new_name), j;
+
+    if (slot && slot->layer == 0) {
+        lsh_alias_remove(aliases[i].new_name);
+    }
+    memmove(alias_order + at, alias_order + at + 1, (alias_count - at - 1) * sizeof(int));
+    for (j = 0; j < alias_count - 1; j++) {
+        alias_order[j] -= alias_order[j] > i;
+    }
+    free(aliases[i].new_name);
+    free(aliases[i].old_name);
+    memmove(aliases + i, aliases + i + 1, (alias_count - i - 1) * sizeof(struct Alias));
+    alias_count--;
+    for (; i < alias_count; i++) {
+        if ((slot = lsh_alias_lookup(aliases[i].new_name)) && slot->layer == 0) {
+            slot->index = i;
+        }
+    }
+}
+
+/**
+   @brief Manages alias creation and deletion.
+   @param args List of args. args[1] is the new alias, args[2] is the original command.
+   @return Always returns 1 to continue executing.
+ */
+int newname(char **args) {
+    int i;
+
+    // Check for correct argument count
+    if (args[1] == NULL) {
+        fprintf(stderr, "Error: expected 1 or 2 arguments to \"newname\"\n");
+        return 1;
+    }
+
+    i = lsh_alias_base_find(args[1]);
+
+    // Delete alias if only one argument is provided
+    if (args[2] == NULL) {
+        if (i < 0) {
+            fprintf(stderr, "Alias not found: %s\n", args[1]);
+            return 1;
+        }
+        lsh_alias_base_delete(i);
+    } else {
+        // Add or update alias
+        lsh_alias_base_set(args[1], args[2], 0);
+    }
+    return 1;
+}
+
+/**
+   @brief Write one alias as a listing line.
+   @param a Alias.
+ */
+void lsh_alias_list_one(const struct Alias *a) {
+    lsh_out_write(a->new_name, strlen(a->new_name));
+    lsh_out_write(" -> ", 4);
+    lsh_out_write(a->old_name, strlen(a->old_name));
+    lsh_out_write("\n", 1);
+}
+
+/**
+   @brief Lists all defined aliases, optionally sorted, filtered by a
+          prefix or a glob, and cut to a page.
+   @param args List of args: [-s] [-p <prefix>] [-o <offset>] [-n <count>] [glob].
+   @return Always returns 1 to continue executing.
+ */
+int listnewnames(char **args) {
+    const char *prefix = "", *glob = NULL;
+    long offset = 0, count = -1;
+    int sorted = 0, i, at;
+    size_t plen;
+    char *end;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "-s") == 0) {
+            sorted = 1;
+        } else if (strcmp(args[i], "-p") == 0 && args[i + 1] != NULL) {
+            prefix = args[++i];
+            sorted = 1;
+        } else if ((strcmp(args[i], "-o") == 0 || strcmp(args[i], "-n") == 0) && args[i + 1] != NULL &&
+                   strtol(args[i + 1], &end, 10) >= 0 && *end == '\0' && end != args[i + 1]) {
+            *(args[i][1] == 'o' ? &offset : &count) = strtol(args[i + 1], NULL, 10);
+            i++;
+        } else {
+            fprintf(stderr, "lsh: listnewnames: bad option %s\n", args[i]);
+            return 1;
+        }
+    }
+    if (args[i] != NULL) {
+        glob = args[i];
+        sorted = 1;
+    }
+
+    if (!sorted) {
+        for (i = offset; i < alias_count && count != 0; i++, count--) {
+            lsh_alias_list_one(&aliases[i]);
+        }
+        lsh_out_flush();
+        return 1;
+    }
+
+    // A glob's leading literal text narrows the range like a prefix does.
+    if (glob != NULL && prefix[0] == '\0') {
+        char *literal = strndup(glob, strcspn(glob, "*?[\\"));
+        if (!literal) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        at = lsh_alias_order_find(literal);
+        plen = strlen(literal);
+        prefix = glob; // Only its first plen bytes are compared
+        free(literal);
+    } else {
+        at = lsh_alias_order_find(prefix);
+        plen = strlen(prefix);
+    }
+
+    for (; at < alias_count && count != 0; at++) {
+        const struct Alias *a = &aliases[alias_order[at]];
+        if (strncmp(a->new_name, prefix, plen) != 0) {
+            break; // Past the last name with the prefix
+        }
+        if (glob != NULL && fnmatch(glob, a->new_name, 0) != 0) {
+            continue;
+        }
+        if (offset > 0) {
+            offset--;
+            continue;
+        }
+        lsh_alias_list_one(a);
+        count--;
+    }
+    lsh_out_flush();
+    return 1;
+}
+
+/**
+   @brief Saves all aliases to a specified file.
+   @param args List of args. args[1] is the file name.
+   @return Always returns 1 to continue executing.
+ */
+int savenewnames(char **args) {
+    // Check if the correct argument is provided
+    if (args[1] == NULL) {
+        fprintf(stderr, "Error: argument 1 expected to \"SAVENEWNAMES\"\n");
+        return 1;
+    }
+    
+    FILE *file = fopen(args[1], "w");
+    if (!file) {
+        perror("Error opening file");
+        return 1;
+    }
+    //iterates over all defined aliases and writes each alias pair (new name and original command name) to the specified file.
+    for (int i = 0; i < alias_count; i++) {
+        fprintf(file, "%s %s\n", aliases[i].new_name, aliases[i].old_name);
+    }
+    
+    fclose(file);
+    return 1;
+}
+
+/**
+   @brief Reads aliases from a specified file.
+   @param args List of args. args[1] is the file name.
+   @return Always returns 1 to continue executing.
+ */
+int readnewnames(char **args) {
+    // Check if the correct argument is provided
+    if (args[1] == NULL) {
+        fprintf(stderr, "Error: argument 1 expected to \"READNEWNAMES\"\n");
+        return 1;
+    }
+    
+    FILE *file = fopen(args[1], "r");
+    if (!file) {
+        perror("Error opening file");
+        return 1;
+    }
+    // reads pairs of alias and command names from a file and adds them to the shell's alias list, updating names that are already defined
+    struct Alias *read = NULL;
+    int nread = 0, cap = 0;
+    lsh_alias_parse(file, &read, &nread, &cap);
+    fclose(file);
+
+    for (int r = 0; r < nread; r++) {
+        lsh_alias_base_set(read[r].new_name, read[r].old_name, 1);
+        free(read[r].new_name);
+        free(read[r].old_name);
+    }
+    free(read);
+    return 1;
+}
+
+/*
+  State for one run of the match builtin.
+*/
+struct lsh_matcher {
+    const char *needle;
+    size_t len;
+    int anchor_start; // Pattern began with ^
+    int anchor_end;   // Pattern ended with $
+    int invert;
+    int count_only;
+    long count;
+    struct lsh_buf scratch; // Joined fields of a row
+};
+
+/**
+   @brief Find the next line of a block that satisfies a matcher.
+   @param m Matcher.
+   @param line Start of the search (always the start of a line).
+   @param end End of the last line of the block.
+   @param line_end Set to the end of the matching line (excluding newline).
+   @return Start of the matching line, or NULL if no line matches.
+ */
+const char *lsh_match_next(struct lsh_matcher *m, const char *line, const char *end,
+                           const char **line_end) {
+    const char *p = line, *hit, *nl, *eol;
+
+    while (p <= end) {
+        if (m->len == 0) {
+            hit = p;
+        } else if ((hit = lsh_find(p, end - p, m->needle, m->len)) == NULL) {
+            return NULL;
+        }
+        if ((nl = memrchr(line, '\n', hit - line)) != NULL) {
+            line = nl + 1;
+        }
+        if ((eol = memchr(hit + m->len, '\n', end - hit - m->len)) == NULL) {
+            eol = end;
+        }
+        // Each line is tested once: an end-anchored pattern can only be at
+        // its tail, and a start-anchored one is found first if it is there.
+        if (m->anchor_end) {
+            hit = (size_t)(eol - line) >= m->len && memcmp(eol - m->len, m->needle, m->len) == 0
+                      ? eol - m->len : NULL;
+        }
+        if (hit != NULL && (!m->anchor_start || hit == line)) {
+            *line_end = eol;
+            return line;
+        }
+        line = p = eol + 1;
+    }
+    return NULL;
+}
+
+/**
+   @brief Count the lines in a run of newline-terminated lines.
+   @param p Start of the run.
+   @param end End of the run.
+   @return Number of newlines in the run.
+ */
+long lsh_count_lines(const char *p, const char *end) {
+    long n = 0;
+
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+/**
+   @brief Stage text input for match: filter one block of complete lines.
+   @param st Stage whose state is the matcher.
+   @param data Block of lines.
+   @param len Length of the block.
+ */
+void lsh_match_block(struct lsh_stage *st, const char *data, size_t len) {
+    struct lsh_matcher *m = st->state;
+    const char *p = data, *end = data + len;
+    const char *start, *eol;
+    int terminated;
+
+    if (len == 0) {
+        return;
+    }
+    // A trailing newline terminates the last line rather than starting one.
+    terminated = end[-1] == '\n';
+    if (terminated) {
+        end--;
+    }
+
+    while (p <= end) {
+        start = lsh_match_next(m, p, end, &eol);
+        if (start == NULL) {
+            break;
+        }
+        if (m->invert) {
+            // The lines before the match are passed on in one piece.
+            if (m->count_only) {
+                m->count += lsh_count_lines(p, start);
+            } else if (start > p) {
+                lsh_stage_emit_lines(st, p, start - p);
+            }
+        } else {
+            m->count++;
+            if (!m->count_only) {
+                lsh_stage_emit_line(st, start, eol - start);
+            }
+        }
+        p = eol + 1;
+    }
+
+    if (m->invert && p <= end) {
+        m->count += lsh_count_lines(p, end) + 1;
+        if (!m->count_only) {
+            lsh_stage_emit_lines(st, p, end - p + terminated);
+        }
+    }
+}
+
+/**
+   @brief Stage row input for match. Fields are searched one by one unless
+          the string could span a delimiter, hold a quote the text would
+          double, or is anchored; then the row is searched as the text
+          line it would be in a pipe.
+   @param st Stage whose state is the matcher.
+   @param row Row.
+ */
+void lsh_match_row(struct lsh_stage *st, const struct lsh_row *row) {
+    struct lsh_matcher *m = st->state;
+    const char *text, *eol;
+    size_t len;
+    int hit = 0;
+
+    if (!m->anchor_start && !m->anchor_end && !memchr(m->needle, row->delim, m->len) &&
+        !(row->quote && memchr(m->needle, '"', m->len))) {
+        for (int i = 0; i < row->nfields && !hit; i++) {
+            hit = lsh_match_next(m, row->fields[i].ptr, row->fields[i].ptr + row->fields[i].len, &eol) != NULL;
+        }
+    } else {
+        text = lsh_row_text(row, &m->scratch, &len);
+        hit = lsh_match_next(m, text, text + len, &eol) != NULL;
+    }
+    if (hit != m->invert) {
+        m->count++;
+        if (!m->count_only) {
+            lsh_stage_emit(st, row);
+        }
+    }
+}
+
+/**
+   @brief Stage end for match: report the count in -c mode. The status
+          is 1 if no line was selected, as with grep.
+   @param st Stage whose state is the matcher.
+ */
+void lsh_match_finish(struct lsh_stage *st) {
+    struct lsh_matcher *m = st->state;
+    char num[32];
+    struct lsh_field f = { num, 0 };
+    struct lsh_row row = { &f, 1, 0, 0, '\n' };
+
+    if (m->count_only) {
+        f.len = snprintf(num, sizeof(num), "%ld", m->count);
+        lsh_stage_emit(st, &row);
+    }
+    if (m->count == 0) {
+        lsh_status = 1;
+    }
+}
+
+/**
+   @brief Stage release for match.
+   @param st Stage whose state is the matcher.
+ */
+void lsh_match_release(struct lsh_stage *st) {
+    struct lsh_matcher *m = st->state;
+
+    free(m->scratch.data);
+    free(m);
+}
+
+/**
+   @brief Open match as a record stage.
+   @param st Stage to fill in.
+   @param args List of args. Options -v (invert) and -c (count) come first,
+               then the string (-e protects one starting with '-'), then
+               optional files. A leading ^ or trailing $ anchors the string.
+   @return 0 on success, -1 on a usage error.
+ */
+int lsh_match_open(struct lsh_stage *st, char **args) {
+    struct lsh_matcher *m = calloc(1, sizeof(*m));
+    int i = 1;
+
+    if (!m) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "-v") == 0) {
+            m->invert = 1;
+        } else if (strcmp(args[i], "-c") == 0) {
+            m->count_only = 1;
+        } else if (strcmp(args[i], "-e") == 0 && args[i + 1] != NULL) {
+            i++;
+            break;
+        } else {
+            fprintf(stderr, "lsh: match: unknown option %s\n", args[i]);
+            free(m);
+            return -1;
+        }
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "lsh: expected string argument to \"match\"\n");
+        free(m);
+        return -1;
+    }
+
+    m->needle = args[i++];
+    m->len = strlen(m->needle);
+    if (m->len > 0 && m->needle[0] == '^') {
+        m->anchor_start = 1;
+        m->needle++;
+        m->len--;
+    }
+    if (m->len > 0 && m->needle[m->len - 1] == '$') {
+        m->anchor_end = 1;
+        m->len--;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->state = m;
+    st->block = lsh_match_block;
+    st->row = lsh_match_row;
+    st->finish = lsh_match_finish;
+    st->release = lsh_match_release;
+    st->files = args + i;
+    return 0;
+}
+
+/**
+   @brief Builtin command: print the lines that contain a fixed string.
+   @param args List of args, as for lsh_match_open.
+   @return Always returns 1 to continue executing. The status is 0 if a
+           line was selected, 1 if none was or on error.
+ */
+int lsh_match(char **args) {
+    struct lsh_stage st;
+
+    if (lsh_match_open(&st, args) == 0) {
+        lsh_stages_run(&st, 1);
+    } else {
+        lsh_status = 1;
+    }
+    return 1;
+}
+
+/*
+  psort: lines are indexed in place (mapped files) or copied into chunks
+  (pipes), sorted in parallel once the memory cap is reached, spilled to a
+  temporary run file, and the runs k-way merged at the end.
+*/
+#define LSH_SORT_FANIN 64 // Most runs merged at once
+
+struct lsh_sort_line {
+    const char *ptr;
+    size_t len;
+    const char *key;
+    size_t key_len;
+    double num;
+};
+
+struct lsh_sort_opts {
+    int field;        // 1-based key field, 0 for the whole line
+    int sep;          // Field separator, or -1 for runs of blanks
+    int numeric;
+    int reverse;
+};
+
+struct lsh_sort {
+    struct lsh_sort_opts opts;
+    long long budget;
+    struct lsh_sort_line *lines;
+    size_t count, cap;
+    size_t bytes;         // Memory charged against the budget
+    char **chunks;        // Copies of unmapped input
+    size_t nchunks, chunk_cap;
+    char *live_chunk;     // Chunk still being indexed, kept across spills
+    FILE **runs;
+    int nruns;
+    struct lsh_pool pool;
+};
+
+/**
+   @brief Read a sort key as sort -n does: blanks, an optional '-', digits
+          and an optional fraction. Hex, exponents, inf and nan are not
+          read, so every key gets an ordered value (0 if it has no number).
+   @param p Key.
+   @param len Key length.
+   @return Its value.
+ */
+double lsh_sort_number(const char *p, size_t len) {
+    const char *end = p + len;
+    char tmp[512];
+    size_t n = 0;
+    int neg = 0, digits = 0;
+
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p < end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    while (p < end && *p == '0') p++;
+    tmp[n++] = '0';
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+        if (n < sizeof(tmp) - 1) {
+            tmp[n++] = *p;
+        }
+    }
+    if (digits > 400) {
+        return neg ? -__builtin_huge_val() : __builtin_huge_val();
+    }
+    if (p < end && *p == '.') {
+        // Fraction digits past the buffer are below double precision.
+        for (tmp[n++] = *p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (n < sizeof(tmp) - 1) {
+                tmp[n++] = *p;
+            }
+        }
+    }
+    tmp[n] = '\0';
+    return neg ? -strtod(tmp, NULL) : strtod(tmp, NULL);
+}
+
+/**
+   @brief Locate the sort key of a line and parse it if numeric. A key
+          field is that field alone, as with sort -k N,N.
+   @param o Sort options.
+   @param l Line whose key fields are filled in.
+ */
+void lsh_sort_key(const struct lsh_sort_opts *o, struct lsh_sort_line *l) {
+    const char *p = l->ptr, *end = l->ptr + l->len, *q;
+
+    if (o->field > 0) {
+        for (int f = 1; f < o->field && p < end; f++) {
+            if (o->sep >= 0) {
+                q = memchr(p, o->sep, end - p);
+                p = q ? q + 1 : end;
+            } else {
+                while (p < end && (*p == ' ' || *p == '\t')) p++;
+                while (p < end && *p != ' ' && *p != '\t') p++;
+            }
+        }
+        if (o->sep >= 0) {
+            q = memchr(p, o->sep, end - p);
+        } else {
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            for (q = p; q < end && *q != ' ' && *q != '\t'; q++);
+        }
+        end = q ? q : end;
+    }
+    l->key = p;
+    l->key_len = end - p;
+    l->num = 0;
+    if (o->numeric) {
+        l->num = lsh_sort_number(l->key, l->key_len);
+    }
+}
+
+/**
+   @brief Compare two lines by key, then by the whole line.
+   @return Negative, zero or positive as with strcmp.
+ */
+int lsh_sort_cmp(const void *a, const void *b, void *arg) {
+    const struct lsh_sort_opts *o = arg;
+    const struct lsh_sort_line *x = a, *y = b;
+    int c = 0;
+
+    if (o->numeric) {
+        c = (x->num > y->num) - (x->num < y->num);
+    } else {
+        c = memcmp(x->key, y->key, x->key_len < y->key_len ? x->key_len : y->key_len);
+        if (c == 0) {
+            c = (x->key_len > y->key_len) - (x->key_len < y->key_len);
+        }
+    }
+    if (c == 0 && (o->field > 0 || o->numeric)) {
+        c = memcmp(x->ptr, y->ptr, x->len < y->len ? x->len : y->len);
+        if (c == 0) {
+            c = (x->len > y->len) - (x->len < y->len);
+        }
+    }
+    return o->reverse ? -c : c;
+}
+
+/*
+  One slice of the parallel sort: sort [lo, hi) or merge two sorted halves
+  [lo, mid) and [mid, hi) into the scratch array.
+*/
+struct lsh_sort_job {
+    struct lsh_sort *s;
+    struct lsh_sort_line *src, *dst;
+    size_t lo, mid, hi;
+};
+
+void lsh_sort_job_sort(void *arg) {
+    struct lsh_sort_job *j = arg;
+    qsort_r(j->src + j->lo, j->hi - j->lo, sizeof(struct lsh_sort_line), lsh_sort_cmp, &j->s->opts);
+}
+
+void lsh_sort_job_merge(void *arg) {
+    struct lsh_sort_job *j = arg;
+    size_t a = j->lo, b = j->mid, o = j->lo;
+
+    while (a < j->mid && b < j->hi) {
+        if (lsh_sort_cmp(&j->src[b], &j->src[a], &j->s->opts) < 0) {
+            j->dst[o++] = j->src[b++];
+        } else {
+            j->dst[o++] = j->src[a++];
+        }
+    }
+    memcpy(j->dst + o, j->src + a, (j->mid - a) * sizeof(*j->dst));
+    o += j->mid - a;
+    memcpy(j->dst + o, j->src + b, (j->hi - b) * sizeof(*j->dst));
+}
+
+/**
+   @brief Sort the collected lines using every worker of the pool.
+   @param s Sort state.
+ */
+void lsh_sort_batch(struct lsh_sort *s) {
+    size_t n = s->count, parts = s->pool.nthreads, width;
+    struct lsh_sort_line *src = s->lines, *dst, *tmp;
+    struct lsh_sort_job *jobs;
+
+    if (parts > 1 && n < parts * 4096) {
+        parts = 1;
+    }
+    jobs = malloc(parts * sizeof(*jobs));
+    dst = parts > 1 ? malloc(n * sizeof(*dst)) : NULL;
+    if (!jobs || (parts > 1 && !dst)) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    width = (n + parts - 1) / parts;
+    for (size_t i = 0; i < parts; i++) {
+        jobs[i] = (struct lsh_sort_job){ s, src, NULL, i * width, 0, (i + 1) * width };
+        if (jobs[i].lo > n) jobs[i].lo = n;
+        if (jobs[i].hi > n) jobs[i].hi = n;
+        lsh_pool_submit(&s->pool, lsh_sort_job_sort, &jobs[i]);
+    }
+    lsh_pool_wait(&s->pool);
+
+    // Merge neighbouring sorted slices pairwise until one remains.
+    for (; width < n; width *= 2) {
+        size_t k = 0;
+        for (size_t lo = 0; lo < n; lo += 2 * width, k++) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            jobs[k] = (struct lsh_sort_job){ s, src, dst, lo, mid, hi };
+            lsh_pool_submit(&s->pool, lsh_sort_job_merge, &jobs[k]);
+        }
+        lsh_pool_wait(&s->pool);
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != s->lines) {
+        memcpy(s->lines, src, n * sizeof(*src));
+    }
+    free(parts > 1 ? (src == s->lines ? dst : src) : NULL);
+    free(jobs);
+}
+
+/**
+   @brief Forget the collected lines and the memory holding them.
+   @param s Sort state.
+ */
+void lsh_sort_reset(struct lsh_sort *s) {
+    for (size_t i = 0; i < s->nchunks; i++) {
+        if (s->chunks[i] != s->live_chunk) {
+            free(s->chunks[i]);
+        }
+    }
+    s->nchunks = 0;
+    if (s->live_chunk) {
+        s->chunks[s->nchunks++] = s->live_chunk;
+    }
+    s->count = 0;
+    s->bytes = 0;
+}
+
+/*
+  Cursor over one run file while merging.
+*/
+struct lsh_sort_run {
+    FILE *file;
+    char *buf;
+    size_t cap;
+    struct lsh_sort_line line;
+};
+
+/**
+   @brief Advance a run to its next line.
+   @param o Sort options.
+   @param r Run cursor.
+   @return 1 if a line was read, 0 at the end of the run.
+ */
+int lsh_sort_run_next(const struct lsh_sort_opts *o, struct lsh_sort_run *r) {
+    ssize_t n = getline(&r->buf, &r->cap, r->file);
+
+    if (n <= 0) {
+        return 0;
+    }
+    r->line.ptr = r->buf;
+    r->line.len = n - (r->buf[n - 1] == '\n');
+    lsh_sort_key(o, &r->line);
+    return 1;
+}
+
+/**
+   @brief Restore the heap order below a position of the merge heap.
+   @param o Sort options.
+   @param heap Array of run cursors ordered as a min-heap.
+   @param n Heap size.
+   @param i Position to sift down from.
+ */
+void lsh_sort_sift(const struct lsh_sort_opts *o, struct lsh_sort_run **heap, int n, int i) {
+    while (1) {
+        int c = 2 * i + 1, m = i;
+        if (c < n && lsh_sort_cmp(&heap[c]->line, &heap[m]->line, (void *)o) < 0) m = c;
+        if (c + 1 < n && lsh_sort_cmp(&heap[c + 1]->line, &heap[m]->line, (void *)o) < 0) m = c + 1;
+        if (m == i) {
+            return;
+        }
+        struct lsh_sort_run *t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+/**
+   @brief Merge every run file into one stream.
+   @param s Sort state.
+   @param dest File to write to, or NULL for the builtin output.
+ */
+void lsh_sort_merge(struct lsh_sort *s, FILE *dest) {
+    struct lsh_sort_run *runs = calloc(s->nruns, sizeof(*runs));
+    struct lsh_sort_run **heap = malloc(s->nruns * sizeof(*heap));
+    int n = 0;
+
+    if (!runs || !heap) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < s->nruns; i++) {
+        runs[i].file = s->runs[i];
+        if (lsh_sort_run_next(&s->opts, &runs[i])) {
+            heap[n++] = &runs[i];
+        }
+    }
+    for (int i = n / 2 - 1; i >= 0; i--) {
+        lsh_sort_sift(&s->opts, heap, n, i);
+    }
+    while (n > 0) {
+        if (dest) {
+            fwrite(heap[0]->line.ptr, 1, heap[0]->line.len, dest);
+            putc('\n', dest);
+        } else {
+            lsh_out_write(heap[0]->line.ptr, heap[0]->line.len);
+            lsh_out_write("\n", 1);
+        }
+        if (!lsh_sort_run_next(&s->opts, heap[0])) {
+            heap[0] = heap[--n];
+        }
+        lsh_sort_sift(&s->opts, heap, n, 0);
+    }
+    for (int i = 0; i < s->nruns; i++) {
+        free(runs[i].buf);
+        fclose(s->runs[i]);
+    }
+    s->nruns = 0;
+    free(runs);
+    free(heap);
+}
+
+/**
+   @brief Sort the collected lines and write them to a temporary run file.
+   @param s Sort state.
+   @return 0 on success, -1 on error.
+ */
+int lsh_sort_spill(struct lsh_sort *s) {
+    FILE *run = tmpfile();
+
+    if (!run) {
+        perror("lsh: psort");
+        return -1;
+    }
+    lsh_sort_batch(s);
+    for (size_t i = 0; i < s->count; i++) {
+        fwrite(s->lines[i].ptr, 1, s->lines[i].len, run);
+        putc('\n', run);
+    }
+    if (fflush(run) != 0 || fseek(run, 0, SEEK_SET) != 0) {
+        perror("lsh: psort");
+        fclose(run);
+        return -1;
+    }
+    s->runs = realloc(s->runs, (s->nruns + 1) * sizeof(FILE *));
+    if (!s->runs) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    s->runs[s->nruns++] = run;
+    lsh_sort_reset(s);
+
+    // Bound the merge fan-in (and open files) by folding runs together.
+    if (s->nruns == LSH_SORT_FANIN) {
+        if (!(run = tmpfile())) {
+            perror("lsh: psort");
+            return -1;
+        }
+        lsh_sort_merge(s, run);
+        if (fflush(run) != 0 || fseek(run, 0, SEEK_SET) != 0) {
+            perror("lsh: psort");
+            fclose(run);
+            return -1;
+        }
+        s->runs[s->nruns++] = run;
+    }
+    return 0;
+}
+
+/**
+   @brief Index the lines of a block, spilling when over the memory cap.
+   @param s Sort state.
+   @param data Block of complete lines; must stay valid until it is spilled.
+   @param len Length of the block.
+   @return 0 on success, -1 if a spill failed.
+ */
+int lsh_sort_add(struct lsh_sort *s, const char *data, size_t len) {
+    const char *p = data, *end = data + len, *nl;
+
+    while (p < end) {
+        if (s->count == s->cap) {
+            s->cap = s->cap ? s->cap * 2 : 4096;
+            s->lines = realloc(s->lines, s->cap * sizeof(struct lsh_sort_line));
+            if (!s->lines) {
+                fprintf(stderr, "lsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        nl = memchr(p, '\n', end - p);
+        if (nl == NULL) {
+            nl = end;
+        }
+        struct lsh_sort_line *l = &s->lines[s->count++];
+        l->ptr = p;
+        l->len = nl - p;
+        lsh_sort_key(&s->opts, l);
+        s->bytes += sizeof(*l) + l->len + 1;
+        p = nl + 1;
+        if ((long long)s->bytes > s->budget && lsh_sort_spill(s) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+   @brief Keep a copy of a block of unmapped input and index its lines.
+   @param s Sort state.
+   @param data Block of complete lines.
+   @param len Length of the block.
+   @return 0 on success, -1 if a spill failed.
+ */
+int lsh_sort_add_copy(struct lsh_sort *s, const char *data, size_t len) {
+    char *copy = malloc(len);
+    int rc;
+
+    if (!copy || (s->nchunks == s->chunk_cap &&
+                  !(s->chunks = realloc(s->chunks, (s->chunk_cap = s->chunk_cap * 2 + 16) * sizeof(char *))))) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, data, len);
+    s->chunks[s->nchunks++] = copy;
+    s->live_chunk = copy;
+    rc = lsh_sort_add(s, copy, len);
+    s->live_chunk = NULL;
+    return rc;
+}
+
+/**
+   @brief Builtin command: sort lines in parallel.
+   @param args List of args. Options: -n numeric (as sort -n), -r reverse,
+               -k <field> (that field only, like sort -k N,N),
+               -t <separator>, -S <memory cap> (e.g. 512M). Then files;
+               standard input is sorted when none are given.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_psort(char **args) {
+    struct lsh_sort s;
+    struct lsh_input *inputs;
+    const char *data;
+    size_t len;
+    int i, nfiles, ninputs = 0, failed = 0, rc = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.opts.sep = -1;
+    s.budget = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "-n") == 0) {
+            s.opts.numeric = 1;
+        } else if (strcmp(args[i], "-r") == 0) {
+            s.opts.reverse = 1;
+        } else if (strcmp(args[i], "-k") == 0 && args[i + 1] != NULL && atoi(args[i + 1]) > 0) {
+            s.opts.field = atoi(args[++i]);
+        } else if (strcmp(args[i], "-t") == 0 && args[i + 1] != NULL && strlen(args[i + 1]) == 1) {
+            s.opts.sep = (unsigned char)args[++i][0];
+        } else if (strcmp(args[i], "-S") == 0 && args[i + 1] != NULL &&
+                   lsh_parse_size(args[i + 1], &s.budget) == 0) {
+            i++;
+        } else {
+            fprintf(stderr, "lsh: psort: bad option %s\n", args[i]);
+            return 1;
+        }
+    }
+
+    for (nfiles = 0; args[i + nfiles] != NULL; nfiles++);
+    inputs = calloc(nfiles > 0 ? nfiles : 1, sizeof(*inputs));
+    if (!inputs) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    lsh_pool_start(&s.pool, 0);
+
+    // Mapped files stay open so their lines can be sorted in place.
+    do {
+        struct lsh_input *in = &inputs[ninputs];
+        if (lsh_input_open(in, args[i]) != 0) {
+            perror(args[i]);
+            continue;
+        }
+        ninputs++;
+        while (!failed && (rc = lsh_input_next(in, &data, &len)) > 0) {
+            failed = in->map ? lsh_sort_add(&s, data, len) : lsh_sort_add_copy(&s, data, len);
+        }
+        if (rc < 0) {
+            perror(args[i] ? args[i] : "lsh");
+        }
+    } while (!failed && args[i] != NULL && args[++i] != NULL);
+
+    if (!failed && s.nruns == 0) {
+        lsh_sort_batch(&s);
+        for (size_t j = 0; j < s.count; j++) {
+            lsh_out_write(s.lines[j].ptr, s.lines[j].len);
+            lsh_out_write("\n", 1);
+        }
+    } else if (!failed && (s.count == 0 || lsh_sort_spill(&s) == 0)) {
+        lsh_sort_merge(&s, NULL);
+    }
+    lsh_out_flush();
+
+    lsh_pool_stop(&s.pool);
+    lsh_sort_reset(&s);
+    for (int j = 0; j < s.nruns; j++) {
+        fclose(s.runs[j]);
+    }
+    for (int j = 0; j < ninputs; j++) {
+        lsh_input_close(&inputs[j]);
+    }
+    free(s.runs);
+    free(s.chunks);
+    free(s.lines);
+    free(inputs);
+    return 1;
+}
+
+/*
+  Parallel directory walker. Every directory is a task on the worker pool;
+  it holds an open descriptor that its subdirectories are opened relative
+  to, and is closed once the last of them has been opened. Entries the
+  visitor hands back as files are passed to the file hook in batches, also
+  on the pool. A walk with a leave hook keeps each directory (and so its
+  parent) until everything below it is done, which gives the hook a
+  post-order view. Open directories are bounded below RLIMIT_NOFILE: at
+  the bound, subdirectories and file batches are done on the spot, depth
+  first, so that only the depth of the tree adds to what is open.
+*/
+enum { LSH_WALK_SKIP, LSH_WALK_DESCEND, LSH_WALK_FILE };
+
+#define LSH_WALK_BATCH 64   // Entries per file hook task
+
+struct lsh_dir {
+    int fd;
+    char *path;
+    char *name;           // Entry name in the parent (the path for a root)
+    int refs;
+    struct lsh_dir *parent; // Held only by walks with a leave hook
+    int aux;              // A descriptor of the walk's own, or -1
+};
+
+struct lsh_walk {
+    struct lsh_pool pool;
+    // Called for every entry; returns one of LSH_WALK_*.
+    int (*visit)(struct lsh_walk *w, struct lsh_dir *dir, const char *name, unsigned char type);
+    // Optional: called on an opened directory before it is read; returns 0
+    // to skip it.
+    int (*enter)(struct lsh_walk *w, struct lsh_dir *parent, struct lsh_dir *dir);
+    // Optional: called on entries the visitor returned LSH_WALK_FILE for.
+    void (*file)(struct lsh_walk *w, struct lsh_dir *dir, const char *name, unsigned char type);
+    // Optional: called once a directory and everything below it is done.
+    void (*leave)(struct lsh_walk *w, struct lsh_dir *dir);
+    void *ctx;
+    pthread_mutex_t out_lock;
+    int errors;
+    int nopen;            // Directories open now
+    int max_open;         // Bound on nopen, set by the first push
+};
+
+struct lsh_walk_task {
+    struct lsh_walk *w;
+    struct lsh_dir *parent;
+    char *name;
+};
+
+struct lsh_walk_batch {
+    struct lsh_walk *w;
+    struct lsh_dir *dir;
+    int n;
+    unsigned char types[LSH_WALK_BATCH];
+    struct lsh_buf names; // NUL-terminated names, one after another
+};
+
+struct lsh_dirent64 {
+    uint64_t d_ino;       // The kernel's layout, whatever the size of ino_t and off_t
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/**
+   @brief Drop a reference to a directory. With the last one the directory
+          is left and closed, and lets go of its parent in turn.
+   @param w Walk.
+   @param dir Directory.
+ */
+void lsh_dir_release(struct lsh_walk *w, struct lsh_dir *dir) {
+    while (dir && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct lsh_dir *parent = dir->parent;
+        if (w->leave) {
+            w->leave(w, dir);
+        }
+        close(dir->fd);
+        if (dir->aux >= 0) {
+            close(dir->aux);
+        }
+        __atomic_sub_fetch(&w->nopen, 1, __ATOMIC_RELAXED);
+        if (dir->name != dir->path) {
+            free(dir->name);
+        }
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+/**
+   @brief Join a directory path and an entry name.
+   @param dir Directory, or NULL for a name that is already a path.
+   @param name Entry name.
+   @return Newly allocated path.
+ */
+char *lsh_dir_join(struct lsh_dir *dir, const char *name) {
+    size_t dlen = dir ? strlen(dir->path) : 0, nlen = strlen(name);
+    char *path = malloc(dlen + nlen + 2);
+
+    if (!path) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (dir) {
+        memcpy(path, dir->path, dlen);
+        if (dlen == 0 || path[dlen - 1] != '/') {
+            path[dlen++] = '/';
+        }
+    }
+    memcpy(path + dlen, name, nlen + 1);
+    return path;
+}
+
+/**
+   @brief Note a failed file operation during a walk.
+   @param w Walk.
+   @param dir Directory containing the entry, or NULL.
+   @param name Entry name.
+ */
+void lsh_walk_error(struct lsh_walk *w, struct lsh_dir *dir, const char *name) {
+    int err = errno;
+    char *path = lsh_dir_join(dir, name);
+
+    pthread_mutex_lock(&w->out_lock);
+    fprintf(stderr, "lsh: %s: %s\n", path, strerror(err));
+    w->errors++;
+    pthread_mutex_unlock(&w->out_lock);
+    free(path);
+}
+
+void lsh_walk_dir(void *arg);
+
+/**
+   @brief Queue a subdirectory to be walked.
+   @param w Walk.
+   @param parent Directory containing it (NULL for a starting path).
+   @param name Entry name, or a path for a starting point.
+ */
+void lsh_walk_push(struct lsh_walk *w, struct lsh_dir *parent, const char *name) {
+    struct lsh_walk_task *t = malloc(sizeof(*t));
+    struct rlimit rl;
+
+    if (!t || !(t->name = strdup(name))) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (w->max_open == 0) {
+        // Each open directory may hold two descriptors (pcp's copy), and
+        // each worker two more while it copies a file.
+        long limit = getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY ||
+                     rl.rlim_cur > INT_MAX ? INT_MAX : (long)rl.rlim_cur;
+        limit = (limit - 64 - 2L * w->pool.nthreads) / 2;
+        w->max_open = limit < 8 ? 8 : (int)limit;
+    }
+    t->w = w;
+    t->parent = parent;
+    if (parent) {
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&w->nopen, __ATOMIC_RELAXED) >= w->max_open) {
+            lsh_walk_dir(t);
+            return;
+        }
+    }
+    lsh_pool_submit(&w->pool, lsh_walk_dir, t);
+}
+
+/**
+   @brief Task: run the file hook on a batch of entries.
+   @param arg A struct lsh_walk_batch.
+ */
+void lsh_walk_batch_run(void *arg) {
+    struct lsh_walk_batch *b = arg;
+    const char *name = b->names.data;
+
+    for (int i = 0; i < b->n; i++) {
+        b->w->file(b->w, b->dir, name, b->types[i]);
+        name += strlen(name) + 1;
+    }
+    lsh_dir_release(b->w, b->dir);
+    free(b->names.data);
+    free(b);
+}
+
+/**
+   @brief Queue a batch of entries for the file hook, or run it here if
+          too many directories are open (a queued batch keeps its
+          directory open).
+   @param w Walk.
+   @param b Batch.
+ */
+void lsh_walk_batch_submit(struct lsh_walk *w, struct lsh_walk_batch *b) {
+    if (__atomic_load_n(&w->nopen, __ATOMIC_RELAXED) >= w->max_open) {
+        lsh_walk_batch_run(b);
+    } else {
+        lsh_pool_submit(&w->pool, lsh_walk_batch_run, b);
+    }
+}
+
+/**
+   @brief Task: read one directory and visit its entries.
+   @param arg A struct lsh_walk_task.
+ */
+void lsh_walk_dir(void *arg) {
+    struct lsh_walk_task *t = arg;
+    struct lsh_walk *w = t->w;
+    struct lsh_dir *dir = malloc(sizeof(*dir));
+    struct lsh_walk_batch *batch = NULL;
+    char *buf = malloc(32768); // Not on the stack: walks may nest (see push)
+    long n;
+    int ok;
+
+    if (!dir || !buf) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    dir->fd = openat(t->parent ? t->parent->fd : AT_FDCWD, t->name,
+                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir->fd < 0) {
+        lsh_walk_error(w, t->parent, t->name);
+        free(dir);
+        goto done;
+    }
+    __atomic_add_fetch(&w->nopen, 1, __ATOMIC_RELAXED);
+    dir->name = t->name;
+    dir->path = t->parent ? lsh_dir_join(t->parent, t->name) : t->name;
+    dir->refs = 1;
+    dir->aux = -1;
+    t->name = NULL;
+    ok = !w->enter || w->enter(w, t->parent, dir);
+    // Without a leave hook the parent is only needed to open this one.
+    dir->parent = w->leave ? t->parent : NULL;
+    if (!w->leave && t->parent) {
+        lsh_dir_release(w, t->parent);
+    }
+    t->parent = NULL;
+
+    while (ok && (n = syscall(SYS_getdents64, dir->fd, buf, 32768)) > 0) {
+        for (long off = 0; off < n;) {
+            struct lsh_dirent64 *d = (struct lsh_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+                                        (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+            switch (w->visit(w, dir, d->d_name, d->d_type)) {
+            case LSH_WALK_DESCEND:
+                lsh_walk_push(w, dir, d->d_name);
+                break;
+            case LSH_WALK_FILE:
+                if (!batch) {
+                    if ((batch = calloc(1, sizeof(*batch))) == NULL) {
+                        fprintf(stderr, "lsh: allocation error\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    batch->w = w;
+                    batch->dir = dir;
+                    __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+                }
+                batch->types[batch->n++] = d->d_type;
+                lsh_buf_append(&batch->names, d->d_name, strlen(d->d_name) + 1);
+                if (batch->n == LSH_WALK_BATCH) {
+                    lsh_walk_batch_submit(w, batch);
+                    batch = NULL;
+                }
+                break;
+            }
+        }
+    }
+    if (ok && n < 0) {
+        lsh_walk_error(w, NULL, dir->path);
+    }
+    if (batch) {
+        lsh_walk_batch_submit(w, batch);
+    }
+    lsh_dir_release(w, dir);
+
+done:
+    if (t->parent) {
+        lsh_dir_release(w, t->parent);
+    }
+    free(buf);
+    free(t->name);
+    free(t);
+}
+
+/*
+  Predicates and output settings of the pfind builtin.
+*/
+struct lsh_find {
+    const char *name;    // -name glob
+    int type;            // -type as a DT_* value, or -1
+    int size_cmp;        // -size: -1 less than, 0 equal, 1 greater than
+    long long size;
+    int mtime_cmp;       // -mtime, compared in whole days
+    long long mtime_days;
+    int need_stat;
+    char sep;            // '\n', or '\0' for -print0
+    time_t now;
+};
+
+/**
+   @brief Compare a value against a find-style [+-]N bound.
+   @return Nonzero if the value satisfies the bound.
+ */
+int lsh_find_cmp(int cmp, long long value, long long bound) {
+    return cmp < 0 ? value < bound : cmp > 0 ? value > bound : value == bound;
+}
+
+/**
+   @brief Walk visitor for pfind: test an entry and print its path.
+ */
+int lsh_find_visit(struct lsh_walk *w, struct lsh_dir *dir, const char *name, unsigned char type) {
+    struct lsh_find *f = w->ctx;
+    struct stat st;
+
+    if (type == DT_UNKNOWN || f->need_stat) {
+        if (fstatat(dir ? dir->fd : AT_FDCWD, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            lsh_walk_error(w, dir, name);
+            return 0;
+        }
+        type = IFTODT(st.st_mode);
+    }
+
+    if ((f->type < 0 || type == f->type) &&
+        (!f->name || fnmatch(f->name, name, 0) == 0) &&
+        (f->size_cmp == 2 || lsh_find_cmp(f->size_cmp, st.st_size, f->size)) &&
+        (f->mtime_cmp == 2 || lsh_find_cmp(f->mtime_cmp, (f->now - st.st_mtime) / 86400, f->mtime_days))) {
+        char *path = lsh_dir_join(dir, name);
+        size_t len = strlen(path);
+        path[len] = f->sep; // The separator takes the place of the terminator
+        pthread_mutex_lock(&w->out_lock);
+        lsh_out_write(path, len + 1);
+        pthread_mutex_unlock(&w->out_lock);
+        free(path);
+    }
+    return type == DT_DIR;
+}
+
+/**
+   @brief Parse a find-style [+-]N argument.
+   @param s Argument.
+   @param cmp Set to -1, 0 or 1 for a leading '-', none or '+'.
+   @param value Set to N (size suffixes are accepted).
+   @return 0 on success, -1 on a malformed argument.
+ */
+int lsh_find_bound(const char *s, int *cmp, long long *value) {
+    *cmp = *s == '+' ? 1 : *s == '-' ? -1 : 0;
+    return lsh_parse_size(s + (*cmp != 0), value);
+}
+
+/**
+   @brief Builtin command: find files using a pool of threads.
+   @param args List of args: starting paths (default "."), then any of
+               -name <glob>, -type <f|d|l|p|s|b|c>, -size [+-]N[KMG],
+               -mtime [+-]days and -print0. Output order is not defined.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_pfind(char **args) {
+    static const char types[] = "fdlpsbc";
+    static const int dtypes[] = { DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_BLK, DT_CHR };
+    struct lsh_find f;
+    struct lsh_walk w;
+    char *dot[] = { ".", NULL };
+    char **roots = args + 1;
+    int i;
+
+    memset(&f, 0, sizeof(f));
+    f.type = -1;
+    f.size_cmp = f.mtime_cmp = 2;
+    f.sep = '\n';
+    f.now = time(NULL);
+
+    for (i = 1; args[i] != NULL && args[i][0] != '-'; i++);
+    if (i == 1) {
+        roots = dot;
+    }
+    for (; args[i] != NULL; i++) {
+        const char *v = args[i + 1];
+        if (strcmp(args[i], "-print0") == 0) {
+            f.sep = '\0';
+            continue;
+        } else if (v == NULL) {
+            fprintf(stderr, "lsh: pfind: missing argument to %s\n", args[i]);
+            return 1;
+        } else if (strcmp(args[i], "-name") == 0) {
+            f.name = v;
+        } else if (strcmp(args[i], "-type") == 0 && strlen(v) == 1 && strchr(types, v[0])) {
+            f.type = dtypes[strchr(types, v[0]) - types];
+        } else if (strcmp(args[i], "-size") == 0 && lsh_find_bound(v, &f.size_cmp, &f.size) == 0) {
+            f.need_stat = 1;
+        } else if (strcmp(args[i], "-mtime") == 0 && lsh_find_bound(v, &f.mtime_cmp, &f.mtime_days) == 0) {
+            f.need_stat = 1;
+        } else {
+            fprintf(stderr, "lsh: pfind: bad predicate %s %s\n", args[i], v);
+            return 1;
+        }
+        i++;
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.visit = lsh_find_visit;
+    w.ctx = &f;
+    pthread_mutex_init(&w.out_lock, NULL);
+    lsh_pool_start(&w.pool, 0);
+    for (i = 0; roots[i] != NULL && roots[i][0] != '-'; i++) {
+        if (lsh_find_visit(&w, NULL, roots[i], DT_UNKNOWN)) {
+            lsh_walk_push(&w, NULL, roots[i]);
+        }
+    }
+    lsh_pool_stop(&w.pool);
+    pthread_mutex_destroy(&w.out_lock);
+    lsh_out_flush();
+    return 1;
+}
+
+/**
+   @brief Last component of a path, ignoring trailing slashes.
+   @param path Path.
+   @return Newly allocated name ("/" for the root).
+ */
+char *lsh_path_base(const char *path) {
+    size_t len = strlen(path);
+    const char *base;
+    char *name;
+
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    base = memrchr(path, '/', len);
+    base = base && len > 1 ? base + 1 : path;
+    if ((name = strndup(base, len - (base - path))) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return name;
+}
+
+/**
+   @brief Tell whether a path is a directory or lies below it, following
+          ".." from the path's nearest existing ancestor up to the root.
+   @param dir Status of the directory.
+   @param path Path, which need not exist yet.
+   @return 1 if it does, 0 if not.
+ */
+int lsh_path_within(const struct stat *dir, const char *path) {
+    char *p = strdup(path), *slash;
+    struct stat st, up;
+    int fd, next, within = 0;
+
+    if (!p) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    while ((fd = open(p, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        if (strcmp(p, ".") == 0 || strcmp(p, "/") == 0) {
+            free(p);
+            return 0;
+        }
+        if ((slash = strrchr(p, '/')) == NULL) {
+            strcpy(p, ".");
+        } else {
+            slash[slash == p] = '\0';
+        }
+    }
+    free(p);
+    while (fstat(fd, &st) == 0) {
+        if (st.st_dev == dir->st_dev && st.st_ino == dir->st_ino) {
+            within = 1;
+            break;
+        }
+        // The root is its own parent.
+        if ((next = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+            (fstat(next, &up) == 0 && up.st_dev == st.st_dev && up.st_ino == st.st_ino)) {
+            if (next >= 0) {
+                close(next);
+            }
+            break;
+        }
+        close(fd);
+        fd = next;
+    }
+    close(fd);
+    return within;
+}
+
+/*
+  Settings of a pcp copy: one source tree at a time.
+*/
+struct lsh_copy {
+    const char *target;   // Where the source tree's root goes
+    mode_t umask;
+};
+
+/**
+   @brief Copy the contents of one open file into another: a reflink if
+          the filesystem can share the data, else copy_file_range, else
+          plain reads and writes.
+   @return 0 on success, -1 with errno set on failure.
+ */
+int lsh_copy_data(int in, int out) {
+    char *buf;
+    ssize_t n;
+
+    if (ioctl(out, FICLONE, in) == 0) {
+        return 0;
+    }
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0);
+    if (n == 0) {
+        return 0;
+    }
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+        return -1;
+    }
+    // Not supported between these files: fall back from where it stopped.
+    if ((buf = malloc(LSH_IN_BUFSIZE)) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    while ((n = read(in, buf, LSH_IN_BUFSIZE)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || lsh_write_all(out, buf, n) != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/**
+   @brief Copy one non-directory entry.
+   @param sfd Directory the source is relative to.
+   @param name Source name.
+   @param dfd Directory the copy is relative to.
+   @param dname Name of the copy.
+   @return 0 on success, -1 with errno set on failure.
+ */
+int lsh_copy_entry(int sfd, const char *name, int dfd, const char *dname) {
+    struct stat st;
+    char link[PATH_MAX];
+    ssize_t n;
+    int in, out, rc;
+
+    if (fstatat(sfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return -1;
+    }
+    if (S_ISLNK(st.st_mode)) {
+        if ((n = readlinkat(sfd, name, link, sizeof(link) - 1)) < 0) {
+            return -1;
+        }
+        link[n] = '\0';
+        return symlinkat(link, dfd, dname);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return mknodat(dfd, dname, st.st_mode & ~07000, st.st_rdev);
+    }
+    if ((in = openat(sfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    if ((out = openat(dfd, dname, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, st.st_mode & 0777)) < 0) {
+        close(in);
+        return -1;
+    }
+    rc = lsh_copy_data(in, out);
+    close(in);
+    if (close(out) != 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+/**
+   @brief Walk visitor for pcp: copy directories as they are reached, and
+          everything else on the pool.
+ */
+int lsh_copy_visit(struct lsh_walk *w, struct lsh_dir *dir, const char *name, unsigned char type) {
+    struct stat st;
+
+    if (type == DT_UNKNOWN) {
+        if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            lsh_walk_error(w, dir, name);
+            return LSH_WALK_SKIP;
+        }
+        type = IFTODT(st.st_mode);
+    }
+    return type == DT_DIR ? LSH_WALK_DESCEND : LSH_WALK_FILE;
+}
+
+/**
+   @brief Walk hook for pcp: create and open the copy of a directory.
+ */
+int lsh_copy_enter(struct lsh_walk *w, struct lsh_dir *parent, struct lsh_dir *dir) {
+    struct lsh_copy *c = w->ctx;
+    struct stat st;
+    int dfd = parent ? parent->aux : AT_FDCWD;
+    const char *dname = parent ? dir->name : c->target;
+
+    // Keep the copy writable until its contents are in (see lsh_copy_leave).
+    if (fstat(dir->fd, &st) != 0 ||
+        (mkdirat(dfd, dname, (st.st_mode & 07777) | S_IRWXU) != 0 && errno != EEXIST) ||
+        (dir->aux = openat(dfd, dname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        lsh_walk_error(w, parent, dname);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+   @brief Walk hook for pcp: copy one file.
+ */
+void lsh_copy_file(struct lsh_walk *w, struct lsh_dir *dir, const char *name, unsigned char type) {
+    if (lsh_copy_entry(dir->fd, name, dir->aux, name) != 0) {
+        lsh_walk_error(w, dir, name);
+    }
+}
+
+/**
+   @brief Walk hook for pcp: give a finished directory copy its mode.
+ */
+void lsh_copy_leave(struct lsh_walk *w, struct lsh_dir *dir) {
+    struct lsh_copy *c = w->ctx;
+    struct stat st;
+
+    if (dir->aux >= 0 && fstat(dir->fd, &st) == 0 && (st.st_mode & S_IRWXU) != S_IRWXU) {
+        fchmod(dir->aux, st.st_mode & 07777 & ~c->umask);
+    }
+}
+
+/**
+   @brief Builtin command: copy files and directory trees using a pool of
+          threads.
+   @param args List of args: sources, then the target. With one source the
+               target is created if it does not exist; otherwise each source
+               is copied into the target directory. Symbolic links are
+               copied as links. A directory is not copied into itself.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_pcp(char **args) {
+    struct lsh_copy c;
+    struct lsh_walk w;
+    struct stat st;
+    char *target;
+    int n, into;
+
+    for (n = 1; args[n] != NULL; n++);
+    if (n < 3) {
+        fprintf(stderr, "lsh: expected source and target to \"pcp\"\n");
+        return 1;
+    }
+    into = stat(args[n - 1], &st) == 0 && S_ISDIR(st.st_mode);
+    if (n > 3 && !into) {
+        fprintf(stderr, "lsh: pcp: %s: not a directory\n", args[n - 1]);
+        return 1;
+    }
+    c.umask = umask(0);
+    umask(c.umask);
+
+    memset(&w, 0, sizeof(w));
+    w.visit = lsh_copy_visit;
+    w.enter = lsh_copy_enter;
+    w.file = lsh_copy_file;
+    w.leave = lsh_copy_leave;
+    w.ctx = &c;
+    pthread_mutex_init(&w.out_lock, NULL);
+    lsh_pool_start(&w.pool, 0);
+    for (int i = 1; i < n - 1; i++) {
+        if (into) {
+            struct lsh_dir dst = { .path = args[n - 1] };
+            char *base = lsh_path_base(args[i]);
+            target = lsh_dir_join(&dst, base);
+            free(base);
+        } else if ((target = strdup(args[n - 1])) == NULL) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        if (lstat(args[i], &st) != 0) {
+            lsh_walk_error(&w, NULL, args[i]);
+        } else if (S_ISDIR(st.st_mode) && lsh_path_within(&st, target)) {
+            fprintf(stderr, "lsh: pcp: cannot copy %s into itself, %s\n", args[i], target);
+        } else if (S_ISDIR(st.st_mode)) {
+            c.target = target;
+            lsh_walk_push(&w, NULL, args[i]);
+            lsh_pool_wait(&w.pool);
+        } else if (lsh_copy_entry(AT_FDCWD, args[i], AT_FDCWD, target) != 0) {
+            lsh_walk_error(&w, NULL, target);
+        }
+        free(target);
+    }
+    lsh_pool_stop(&w.pool);
+    pthread_mutex_destroy(&w.out_lock);
+    return 1;
+}
+
+/**
+   @brief Walk visitor for prm: descend into directories, remove the rest
+          on the pool.
+ */
+int lsh_remove_visit(struct lsh_walk *w, struct lsh_dir *dir, const char *name, unsigned char type) {
+    struct stat st;
+
+    if (type == DT_UNKNOWN) {
+        if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            lsh_walk_error(w, dir, name);
+            return LSH_WALK_SKIP;
+        }
+        type = IFTODT(st.st_mode);
+    }
+    return type == DT_DIR ? LSH_WALK_DESCEND : LSH_WALK_FILE;
+}
+
+/**
+   @brief Walk hook for prm: remove one file.
+ */
+void lsh_remove_file(struct lsh_walk *w, struct lsh_dir *dir, const char *name, unsigned char type) {
+    if (unlinkat(dir->fd, name, 0) != 0 && errno != ENOENT) {
+        lsh_walk_error(w, dir, name);
+    }
+}
+
+/**
+   @brief Walk hook for prm: remove a directory once it has been emptied.
+ */
+void lsh_remove_leave(struct lsh_walk *w, struct lsh_dir *dir) {
+    if (unlinkat(dir->parent ? dir->parent->fd : AT_FDCWD, dir->name, AT_REMOVEDIR) != 0) {
+        lsh_walk_error(w, dir->parent, dir->name);
+    }
+}
+
+/**
+   @brief Builtin command: remove files and directory trees using a pool
+          of threads.
+   @param args List of args: [-f] paths. -f ignores paths that do not exist.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_prm(char **args) {
+    struct lsh_walk w;
+    struct stat st;
+    int i = 1, force = 0;
+
+    if (args[i] != NULL && strcmp(args[i], "-f") == 0) {
+        force = 1;
+        i++;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "lsh: expected argument to \"prm\"\n");
+        return 1;
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.visit = lsh_remove_visit;
+    w.file = lsh_remove_file;
+    w.leave = lsh_remove_leave;
+    pthread_mutex_init(&w.out_lock, NULL);
+    lsh_pool_start(&w.pool, 0);
+    for (; args[i] != NULL; i++) {
+        char *base = lsh_path_base(args[i]);
+        int refuse = *base == '\0' || strcmp(base, "/") == 0 || strcmp(base, ".") == 0 || strcmp(base, "..") == 0;
+        free(base);
+        if (refuse) {
+            fprintf(stderr, "lsh: prm: refusing to remove '%s'\n", args[i]);
+        } else if (lstat(args[i], &st) != 0) {
+            if (!force || errno != ENOENT) {
+                lsh_walk_error(&w, NULL, args[i]);
+            }
+        } else if (S_ISDIR(st.st_mode)) {
+            lsh_walk_push(&w, NULL, args[i]);
+        } else if (unlink(args[i]) != 0) {
+            lsh_walk_error(&w, NULL, args[i]);
+        }
+    }
+    lsh_pool_stop(&w.pool);
+    pthread_mutex_destroy(&w.out_lock);
+    return 1;
+}
+
+/*
+  waitfor: block until a file appears, disappears or changes, or a process
+  exits. Files are watched with inotify (on the file and on its directory,
+  or the nearest ancestor that exists yet) and processes with pidfds, so
+  the shell sleeps in one poll until something happens. Every wakeup
+  re-checks all conditions, which keeps renames, replaced files and
+  directories created later simple to follow.
+*/
+enum { LSH_WAIT_EXISTS, LSH_WAIT_GONE, LSH_WAIT_CHANGED, LSH_WAIT_PID };
+
+struct lsh_wait_cond {
+    int kind;
+    const char *path;
+    pid_t pid;
+    int pidfd;            // -1 if pidfds are not available
+    struct stat st;       // LSH_WAIT_CHANGED: the file as first seen
+    int existed;
+};
+
+/**
+   @brief Watch a path for changes, or its nearest existing ancestor
+          directory for the entries that lead to it.
+   @param ifd Inotify descriptor.
+   @param path Path to watch.
+   @param self Also watch the file itself for writes.
+ */
+void lsh_waitfor_watch(int ifd, const char *path, int self) {
+    const uint32_t dir_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                              IN_DELETE_SELF | IN_MOVE_SELF;
+    char *dir = strdup(path), *slash;
+
+    if (!dir) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (self) {
+        inotify_add_watch(ifd, path, IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+    }
+    // Climb until a directory that exists: creating a missing parent
+    // shows up there, and the next pass watches one level further down.
+    do {
+        slash = strrchr(dir, '/');
+        if (slash == dir) {
+            dir[1] = '\0';
+        } else if (slash != NULL) {
+            *slash = '\0';
+        } else {
+            strcpy(dir, ".");
+        }
+    } while (inotify_add_watch(ifd, dir, dir_mask | IN_ONLYDIR) < 0 && (errno == ENOENT || errno == ENOTDIR) &&
+             strcmp(dir, ".") != 0 && strcmp(dir, "/") != 0);
+    free(dir);
+}
+
+/**
+   @brief Check whether a condition has been met.
+   @return Nonzero if it has.
+ */
+int lsh_waitfor_met(struct lsh_wait_cond *c) {
+    struct stat st;
+    struct pollfd pfd;
+
+    switch (c->kind) {
+    case LSH_WAIT_EXISTS:
+        return stat(c->path, &st) == 0;
+    case LSH_WAIT_GONE:
+        // A parent that is now a file means the path is gone too.
+        return stat(c->path, &st) != 0 && (errno == ENOENT || errno == ENOTDIR);
+    case LSH_WAIT_CHANGED:
+        if (stat(c->path, &st) != 0) {
+            return c->existed;
+        }
+        return !c->existed || st.st_ino != c->st.st_ino || st.st_size != c->st.st_size ||
+               st.st_mtim.tv_sec != c->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != c->st.st_mtim.tv_nsec ||
+               st.st_ctim.tv_sec != c->st.st_ctim.tv_sec || st.st_ctim.tv_nsec != c->st.st_ctim.tv_nsec;
+    default:
+        if (c->pidfd < 0) {
+            return kill(c->pid, 0) != 0 && errno == ESRCH;
+        }
+        pfd.fd = c->pidfd;
+        pfd.events = POLLIN;
+        return poll(&pfd, 1, 0) > 0;
+    }
+}
+
+/**
+   @brief Builtin command: wait for a file or process event.
+   @param args List of args: [-t seconds] then any of -e <path> (exists),
+               -g <path> (gone), -m <path> (modified) and -p <pid>
+               (exited). Returns as soon as one of them happens. The status
+               is 0 for an event, 1 on timeout and 2 on a usage error.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_waitfor(char **args) {
+    static const char kinds[] = "egmp";
+    struct lsh_wait_cond *conds;
+    struct pollfd *pfds;
+    struct timespec now, deadline = { 0, 0 };
+    double timeout = -1;
+    char *end, buf[4096];
+    int n = 0, npfd, ifd, ms, met = 0, i;
+
+    for (i = 1; args[i] != NULL; i++);
+    conds = calloc(i, sizeof(*conds));
+    pfds = calloc(i + 1, sizeof(*pfds));
+    if (!conds || !pfds) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    lsh_status = 2;
+    for (i = 1; args[i] != NULL; i += 2) {
+        const char *v = args[i + 1];
+        if (args[i][0] != '-' || args[i][1] == '\0' || args[i][2] != '\0' || v == NULL) {
+            fprintf(stderr, "lsh: waitfor: bad option %s\n", args[i]);
+            goto out;
+        } else if (args[i][1] == 't') {
+            timeout = strtod(v, &end);
+            if (end == v || *end != '\0' || timeout < 0) {
+                fprintf(stderr, "lsh: waitfor: bad timeout %s\n", v);
+                goto out;
+            }
+        } else if (args[i][1] != '\0' && strchr(kinds, args[i][1]) != NULL) {
+            struct lsh_wait_cond *c = &conds[n++];
+            c->kind = strchr(kinds, args[i][1]) - kinds;
+            c->path = v;
+            c->pidfd = -1;
+            if (c->kind == LSH_WAIT_PID) {
+                c->pid = strtol(v, &end, 10);
+                if (end == v || *end != '\0' || c->pid <= 0) {
+                    fprintf(stderr, "lsh: waitfor: bad pid %s\n", v);
+                    goto out;
+                }
+#ifdef SYS_pidfd_open
+                c->pidfd = syscall(SYS_pidfd_open, c->pid, 0);
+#endif
+            } else if (c->kind == LSH_WAIT_CHANGED) {
+                c->existed = stat(v, &c->st) == 0;
+            }
+        } else {
+            fprintf(stderr, "lsh: waitfor: bad option %s\n", args[i]);
+            goto out;
+        }
+    }
+    if (n == 0) {
+        fprintf(stderr, "lsh: expected condition to \"waitfor\"\n");
+        goto out;
+    }
+    if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        perror("lsh: waitfor");
+        goto out;
+    }
+    if (timeout >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (time_t)timeout;
+        deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    while (1) {
+        // Watch first, then look: nothing can slip in between.
+        npfd = 0;
+        pfds[npfd].fd = ifd;
+        pfds[npfd++].events = POLLIN;
+        ms = -1;
+        for (i = 0; i < n; i++) {
+            if (conds[i].kind != LSH_WAIT_PID) {
+                lsh_waitfor_watch(ifd, conds[i].path, conds[i].kind == LSH_WAIT_CHANGED);
+            } else if (conds[i].pidfd >= 0) {
+                pfds[npfd].fd = conds[i].pidfd;
+                pfds[npfd++].events = POLLIN;
+            } else {
+                ms = 100; // Not one of our descriptors: check now and then
+            }
+        }
+        for (i = 0; i < n && !met; i++) {
+            met = lsh_waitfor_met(&conds[i]);
+        }
+        if (met) {
+            break;
+        }
+        if (timeout >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long left = (deadline.tv_sec - now.tv_sec) * 1000LL + (deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+            if (left <= 0) {
+                break;
+            }
+            ms = ms < 0 || left < ms ? (int)(left < INT_MAX ? left : INT_MAX) : ms;
+        }
+        if (poll(pfds, npfd, ms) < 0 && errno != EINTR) {
+            perror("lsh: waitfor");
+            break;
+        }
+        while (read(ifd, buf, sizeof(buf)) > 0);
+    }
+    lsh_status = met ? 0 : 1;
+    close(ifd);
+
+out:
+    for (i = 0; i < n; i++) {
+        if (conds[i].pidfd >= 0) {
+            close(conds[i].pidfd);
+        }
+    }
+    free(conds);
+    free(pfds);
+    return 1;
+}
+
+/*
+  jget: JSON values are located through a structural index built 64 bytes
+  at a time. Each block is classified into quote, backslash and
+  {}[]:, bitmasks; escaped quotes are removed, string interiors are
+  masked out with a prefix XOR, and the positions of what remains are
+  recorded. Path lookups then hop between index entries instead of
+  scanning bytes.
+*/
+struct lsh_jindex {
+    size_t *pos;
+    size_t n, cap;
+    size_t committed;     // Entries from whole blocks (tail entries follow)
+    size_t scanned;       // Bytes covered by whole blocks
+    uint64_t in_string;   // All ones if the last whole block ended in a string
+    uint64_t odd_escape;  // 1 if it ended in an odd run of backslashes
+};
+
+struct lsh_json_step {
+    const char *key;      // Object member name, or NULL for an array index
+    size_t key_len;
+    long index;
+};
+
+struct lsh_json {
+    struct lsh_json_step *steps;
+    int nsteps;
+    int raw;              // -r: print strings without quotes or escapes
+    char *carry;          // Incomplete value carried into the next block
+    size_t carry_len, carry_cap;
+    const char *data;     // Buffer being parsed (a block or the carry)
+    size_t len;
+    struct lsh_jindex ix;
+    size_t next;          // First index entry not yet consumed
+    struct lsh_buf scratch; // Unescaped strings
+    struct lsh_buf line;    // Text of the row being parsed
+    struct lsh_stage *st;
+};
+
+#define LSH_JSON_NONE ((size_t)-1)
+
+/**
+   @brief Classify 64 bytes of JSON.
+   @param p Block start.
+   @param quotes Set to the mask of '"' bytes.
+   @param escapes Set to the mask of '\' bytes.
+   @return Mask of {}[]:, bytes.
+ */
+uint64_t lsh_json_classify(const char *p, uint64_t *quotes, uint64_t *escapes) {
+    uint64_t q = 0, b = 0, s = 0;
+#ifdef __SSE2__
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20)); // folds [ ] onto { }
+        __m128i st = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                                               _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                                               _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        q |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << (16 * i);
+        b |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << (16 * i);
+        s |= (uint64_t)(unsigned)_mm_movemask_epi8(st) << (16 * i);
+    }
+#else
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        switch (p[i]) {
+        case '"': q |= bit; break;
+        case '\\': b |= bit; break;
+        case '{': case '}': case '[': case ']': case ':': case ',': s |= bit; break;
+        }
+    }
+#endif
+    *quotes = q;
+    *escapes = b;
+    return s;
+}
+
+/**
+   @brief Find the bytes escaped by an odd-length run of backslashes.
+   @param bs Backslash mask of the block.
+   @param carry In: 1 if the previous block ended in an odd run. Out: the
+                same for this block.
+   @return Mask of escaped bytes.
+ */
+uint64_t lsh_json_escaped(uint64_t bs, uint64_t *carry) {
+    const uint64_t even = 0x5555555555555555ULL, odd = ~even;
+    uint64_t starts = bs & ~(bs << 1);
+    uint64_t even_start_mask = even ^ *carry;
+    uint64_t even_starts = starts & even_start_mask;
+    uint64_t odd_starts = starts & ~even_start_mask;
+    uint64_t even_carries = bs + even_starts;
+    uint64_t odd_carries;
+    int overflow = __builtin_add_overflow(bs, odd_starts, &odd_carries);
+
+    odd_carries |= *carry;
+    *carry = overflow ? 1 : 0;
+    return ((even_carries & ~bs) & odd) | ((odd_carries & ~bs) & even);
+}
+
+/**
+   @brief Empty an index, keeping its storage.
+   @param ix Index.
+ */
+void lsh_jindex_reset(struct lsh_jindex *ix) {
+    ix->n = ix->committed = ix->scanned = 0;
+    ix->in_string = ix->odd_escape = 0;
+}
+
+/**
+   @brief Index one 64-byte block.
+   @param ix Index to append to.
+   @param p Block start.
+   @param base Offset of the block in the buffer.
+   @param in_string String state, updated.
+   @param odd_escape Backslash state, updated.
+ */
+void lsh_jindex_block(struct lsh_jindex *ix, const char *p, size_t base,
+                      uint64_t *in_string, uint64_t *odd_escape) {
+    uint64_t quotes, escapes, structural, inside;
+
+    structural = lsh_json_classify(p, &quotes, &escapes);
+    quotes &= ~lsh_json_escaped(escapes, odd_escape);
+    // Prefix XOR: ones from an opening quote up to its closing quote.
+    inside = quotes;
+    inside ^= inside << 1;
+    inside ^= inside << 2;
+    inside ^= inside << 4;
+    inside ^= inside << 8;
+    inside ^= inside << 16;
+    inside ^= inside << 32;
+    inside ^= *in_string;
+    *in_string = (uint64_t)((int64_t)inside >> 63);
+    structural = (structural & ~inside) | quotes;
+
+    if (ix->n + 64 > ix->cap) {
+        ix->cap = ix->cap ? ix->cap * 2 : 4096;
+        ix->pos = realloc(ix->pos, ix->cap * sizeof(size_t));
+        if (!ix->pos) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while (structural) {
+        ix->pos[ix->n++] = base + __builtin_ctzll(structural);
+        structural &= structural - 1;
+    }
+}
+
+/**
+   @brief Extend the index over a buffer that may have grown since the
+          last call. The partial block at the end is indexed provisionally
+          and redone once more data arrives.
+   @param ix Index.
+   @param data Buffer.
+   @param len Buffer length.
+ */
+void lsh_jindex_scan(struct lsh_jindex *ix, const char *data, size_t len) {
+    char tail[64];
+    uint64_t in_string, odd_escape;
+
+    ix->n = ix->committed;
+    for (; ix->scanned + 64 <= len; ix->scanned += 64) {
+        lsh_jindex_block(ix, data + ix->scanned, ix->scanned, &ix->in_string, &ix->odd_escape);
+    }
+    ix->committed = ix->n;
+    if (ix->scanned < len) {
+        memset(tail, ' ', sizeof(tail));
+        memcpy(tail, data + ix->scanned, len - ix->scanned);
+        in_string = ix->in_string;
+        odd_escape = ix->odd_escape;
+        lsh_jindex_block(ix, tail, ix->scanned, &in_string, &odd_escape);
+    }
+}
+
+/**
+   @brief Skip JSON whitespace.
+   @return Offset of the next non-whitespace byte (or the buffer length).
+ */
+size_t lsh_json_ws(struct lsh_json *j, size_t p) {
+    while (p < j->len && (j->data[p] == ' ' || j->data[p] == '\n' ||
+                          j->data[p] == '\t' || j->data[p] == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+/**
+   @brief Skip over one value.
+   @param j Parser.
+   @param p Offset of the value.
+   @param k First index entry at or after p.
+   @param end Set to the offset just past the value.
+   @return First index entry after the value, or LSH_JSON_NONE if the
+           value is not complete in the buffer.
+ */
+size_t lsh_json_skip(struct lsh_json *j, size_t p, size_t k, size_t *end) {
+    const size_t *pos = j->ix.pos;
+    size_t n = j->ix.n;
+    int depth = 0;
+    char c = j->data[p];
+
+    if (c == '"') {
+        if (k + 1 >= n) {
+            return LSH_JSON_NONE;
+        }
+        *end = pos[k + 1] + 1;
+        return k + 2;
+    }
+    if (c == '{' || c == '[') {
+        for (; k < n; k++) {
+            c = j->data[pos[k]];
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if ((c == '}' || c == ']') && --depth == 0) {
+                *end = pos[k] + 1;
+                return k + 1;
+            }
+        }
+        return LSH_JSON_NONE;
+    }
+    // Numbers, true, false and null run up to the next delimiter.
+    while (p < j->len && !strchr(" \t\r\n,:{}[]\"", j->data[p])) {
+        p++;
+    }
+    *end = p;
+    return k;
+}
+
+/**
+   @brief Step from a value to one of its members or elements.
+   @param j Parser.
+   @param step Member name or element index.
+   @param pp In: offset of the container. Out: offset of the child.
+   @param pk In/out: first index entry at or after the offset.
+   @return 1 if found, 0 if absent, -1 if the JSON is malformed.
+ */
+int lsh_json_child(struct lsh_json *j, const struct lsh_json_step *step, size_t *pp, size_t *pk) {
+    const size_t *pos = j->ix.pos;
+    size_t n = j->ix.n, k = *pk, p, end;
+    char open = step->key ? '{' : '[', close = step->key ? '}' : ']';
+
+    if (j->data[*pp] != open) {
+        return 0;
+    }
+    p = lsh_json_ws(j, *pp + 1);
+    if (j->data[p] == close) {
+        return 0;
+    }
+    k++;
+    for (long i = 0;; i++) {
+        if (step->key) {
+            // Member: "name" then ':' then the value.
+            if (k + 2 >= n || j->data[pos[k]] != '"' || j->data[pos[k + 2]] != ':') {
+                return -1;
+            }
+            size_t name = pos[k] + 1, name_len = pos[k + 1] - name;
+            p = lsh_json_ws(j, pos[k + 2] + 1);
+            k += 3;
+            if (name_len == step->key_len && memcmp(j->data + name, step->key, name_len) == 0) {
+                *pp = p;
+                *pk = k;
+                return 1;
+            }
+        } else if (i == step->index) {
+            *pp = p;
+            *pk = k;
+            return 1;
+        }
+        if ((k = lsh_json_skip(j, p, k, &end)) == LSH_JSON_NONE || k >= n) {
+            return -1;
+        }
+        if (j->data[pos[k]] == close) {
+            return 0;
+        }
+        if (j->data[pos[k]] != ',') {
+            return -1;
+        }
+        p = lsh_json_ws(j, pos[k] + 1);
+        k++;
+    }
+}
+
+/**
+   @brief Decode the escapes of a JSON string.
+   @param s String contents (between the quotes).
+   @param len Length of the contents.
+   @param out Buffer the decoded string is appended to.
+ */
+void lsh_json_unescape(const char *s, size_t len, struct lsh_buf *out) {
+    const char *end = s + len, *bs;
+    char utf8[4];
+
+    while ((bs = memchr(s, '\\', end - s)) != NULL && bs + 1 < end) {
+        lsh_buf_append(out, s, bs - s);
+        s = bs + 2;
+        switch (bs[1]) {
+        case 'n': lsh_buf_append(out, "\n", 1); break;
+        case 't': lsh_buf_append(out, "\t", 1); break;
+        case 'r': lsh_buf_append(out, "\r", 1); break;
+        case 'b': lsh_buf_append(out, "\b", 1); break;
+        case 'f': lsh_buf_append(out, "\f", 1); break;
+        case 'u': {
+            unsigned cp = 0;
+            if (end - s < 4 || sscanf(s, "%4x", &cp) != 1) {
+                lsh_buf_append(out, bs, 2);
+                break;
+            }
+            s += 4;
+            // A high surrogate pairs with the \uXXXX that follows it.
+            if (cp >= 0xd800 && cp < 0xdc00 && end - s >= 6 && s[0] == '\\' && s[1] == 'u') {
+                unsigned lo = 0;
+                if (sscanf(s + 2, "%4x", &lo) == 1 && lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    s += 6;
+                }
+            }
+            if (cp < 0x80) {
+                utf8[0] = cp;
+                lsh_buf_append(out, utf8, 1);
+            } else if (cp < 0x800) {
+                utf8[0] = 0xc0 | (cp >> 6);
+                utf8[1] = 0x80 | (cp & 0x3f);
+                lsh_buf_append(out, utf8, 2);
+            } else if (cp < 0x10000) {
+                utf8[0] = 0xe0 | (cp >> 12);
+                utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+                utf8[2] = 0x80 | (cp & 0x3f);
+                lsh_buf_append(out, utf8, 3);
+            } else {
+                utf8[0] = 0xf0 | (cp >> 18);
+                utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+                utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+                utf8[3] = 0x80 | (cp & 0x3f);
+                lsh_buf_append(out, utf8, 4);
+            }
+            break;
+        }
+        default: lsh_buf_append(out, bs + 1, 1); break; // \" \\ \/
+        }
+    }
+    lsh_buf_append(out, s, end - s);
+}
+
+/**
+   @brief Extract the path from every complete top-level value in the
+          current buffer.
+   @param j Parser.
+   @return Offset of the first byte not consumed.
+ */
+size_t lsh_json_run(struct lsh_json *j) {
+    size_t done = 0, p, k, after, end, vp, vk;
+    struct lsh_field f;
+    int found;
+
+    while ((p = lsh_json_ws(j, done)) < j->len) {
+        for (k = j->next; k < j->ix.n && j->ix.pos[k] < p; k++);
+        if (strchr("}]:,", j->data[p])) {
+            fprintf(stderr, "lsh: jget: unexpected '%c' in input\n", j->data[p]);
+            const char *nl = memchr(j->data + p, '\n', j->len - p);
+            done = nl ? (size_t)(nl - j->data) + 1 : j->len;
+            continue;
+        }
+        if ((after = lsh_json_skip(j, p, k, &end)) == LSH_JSON_NONE) {
+            return p;
+        }
+
+        vp = p;
+        vk = k;
+        found = 1;
+        for (int i = 0; i < j->nsteps && found == 1; i++) {
+            found = lsh_json_child(j, &j->steps[i], &vp, &vk);
+        }
+        if (found < 0) {
+            fprintf(stderr, "lsh: jget: malformed JSON value\n");
+        } else if (found == 0) {
+            lsh_stage_emit_line(j->st, "null", 4);
+        } else {
+            size_t vend;
+            lsh_json_skip(j, vp, vk, &vend);
+            f.ptr = j->data + vp;
+            f.len = vend - vp;
+            if (j->raw && j->data[vp] == '"' && vend - vp >= 2) {
+                // Strings without escapes are passed on straight from the input.
+                f.ptr++;
+                f.len -= 2;
+                if (memchr(f.ptr, '\\', f.len)) {
+                    j->scratch.len = 0;
+                    lsh_json_unescape(f.ptr, f.len, &j->scratch);
+                    f.ptr = j->scratch.data;
+                    f.len = j->scratch.len;
+                }
+            }
+            // Plain text rows: a value spread over lines (or a raw string
+            // holding newlines) is as many rows as it is lines in a pipe.
+            lsh_stage_emit_text(j->st, f.ptr, f.len);
+        }
+        done = end;
+        j->next = after;
+    }
+    return j->len;
+}
+
+#define LSH_JSON_WINDOW (1 << 20)
+
+/**
+   @brief Stage text input for jget: parse in place, carrying any value
+          that continues into the next block.
+   @param st Stage whose state is the parser.
+   @param data Block of lines.
+   @param len Length of the block.
+ */
+void lsh_jget_block(struct lsh_stage *st, const char *data, size_t len) {
+    struct lsh_json *j = st->state;
+    size_t done, window = LSH_JSON_WINDOW, cut;
+    const char *nl;
+
+    // A mapped file arrives as one block: parse it a window of whole lines
+    // at a time, as piped input is, so the index stays bounded. Only a
+    // value too big for the window widens it.
+    while (j->carry_len == 0 && len > window) {
+        if ((nl = memrchr(data, '\n', window)) == NULL &&
+            (nl = memchr(data + window, '\n', len - window)) == NULL) {
+            break;
+        }
+        cut = nl - data + 1;
+        j->data = data;
+        j->len = cut;
+        lsh_jindex_scan(&j->ix, data, cut);
+        done = lsh_json_run(j);
+        lsh_jindex_reset(&j->ix);
+        j->next = 0;
+        if (done == 0) {
+            window *= 2;
+            continue;
+        }
+        data += done;
+        len -= done;
+        window = LSH_JSON_WINDOW;
+    }
+
+    if (j->carry_len == 0) {
+        j->data = data;
+        j->len = len;
+    } else {
+        if (j->carry_len + len > j->carry_cap) {
+            j->carry_cap = (j->carry_len + len) * 2;
+            j->carry = realloc(j->carry, j->carry_cap);
+            if (!j->carry) {
+                fprintf(stderr, "lsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(j->carry + j->carry_len, data, len);
+        j->carry_len += len;
+        j->data = j->carry;
+        j->len = j->carry_len;
+    }
+
+    lsh_jindex_scan(&j->ix, j->data, j->len);
+    done = lsh_json_run(j);
+    if (done == 0 && j->data == j->carry) {
+        return; // Still inside the same value; the index carries on from here
+    }
+
+    // Keep the unfinished value and index it afresh with the next block.
+    if (done < j->len) {
+        if (j->data != j->carry && j->len - done > j->carry_cap) {
+            j->carry_cap = (j->len - done) * 2;
+            free(j->carry);
+            j->carry = malloc(j->carry_cap);
+            if (!j->carry) {
+                fprintf(stderr, "lsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memmove(j->carry, j->data + done, j->len - done);
+    }
+    j->carry_len = j->len - done;
+    lsh_jindex_reset(&j->ix);
+    j->next = 0;
+}
+
+/**
+   @brief Stage row input for jget: each row is a line of text, parsed as
+          it would be from a pipe, so a value may span rows.
+   @param st Stage whose state is the parser.
+   @param row Row.
+ */
+void lsh_jget_row(struct lsh_stage *st, const struct lsh_row *row) {
+    struct lsh_json *j = st->state;
+
+    // Copied: the row may point into the scratch buffer of an upstream jget.
+    j->line.len = 0;
+    lsh_row_write(row, &j->line);
+    lsh_jget_block(st, j->line.data, j->line.len);
+}
+
+/**
+   @brief Stage end for jget: complain about an unfinished value.
+   @param st Stage whose state is the parser.
+ */
+void lsh_jget_finish(struct lsh_stage *st) {
+    struct lsh_json *j = st->state;
+
+    j->data = j->carry;
+    j->len = j->carry_len;
+    if (lsh_json_ws(j, 0) < j->len) {
+        fprintf(stderr, "lsh: jget: truncated JSON at end of input\n");
+    }
+}
+
+/**
+   @brief Stage release for jget.
+   @param st Stage whose state is the parser.
+ */
+void lsh_jget_release(struct lsh_stage *st) {
+    struct lsh_json *j = st->state;
+
+    free(j->steps);
+    free(j->carry);
+    free(j->ix.pos);
+    free(j->scratch.data);
+    free(j->line.data);
+    free(j);
+}
+
+/**
+   @brief Open jget as a record stage.
+   @param st Stage to fill in.
+   @param args List of args. args[1] may be -r to print strings raw, then
+               comes a path such as .user.name or .items[0], then optional
+               files of JSON or NDJSON (standard input by default).
+   @return 0 on success, -1 on a usage error.
+ */
+int lsh_jget_open(struct lsh_stage *st, char **args) {
+    struct lsh_json *j = calloc(1, sizeof(*j));
+    const char *p;
+    int i = 1;
+
+    if (!j) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (args[i] != NULL && strcmp(args[i], "-r") == 0) {
+        j->raw = 1;
+        i++;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "lsh: expected path argument to \"jget\"\n");
+        free(j);
+        return -1;
+    }
+
+    j->steps = malloc((strlen(args[i]) + 1) * sizeof(struct lsh_json_step));
+    if (!j->steps) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (p = args[i]; *p != '\0';) {
+        struct lsh_json_step *s = &j->steps[j->nsteps];
+        if (*p == '.') {
+            p++;
+        } else if (*p == '[') {
+            char *end;
+            s->key = NULL;
+            s->index = strtol(p + 1, &end, 10);
+            if (end == p + 1 || *end != ']' || s->index < 0) {
+                fprintf(stderr, "lsh: jget: bad path %s\n", args[i]);
+                free(j->steps);
+                free(j);
+                return -1;
+            }
+            j->nsteps++;
+            p = end + 1;
+        } else {
+            s->key = p;
+            s->key_len = strcspn(p, ".[");
+            j->nsteps++;
+            p += s->key_len;
+        }
+    }
+
+    memset(st, 0, sizeof(*st));
+    j->st = st;
+    st->state = j;
+    st->block = lsh_jget_block;
+    st->row = lsh_jget_row;
+    st->finish = lsh_jget_finish;
+    st->release = lsh_jget_release;
+    st->files = args + i + 1;
+    return 0;
+}
+
+/**
+   @brief Builtin command: print a field of each JSON value.
+   @param args List of args, as for lsh_jget_open.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_jget(char **args) {
+    struct lsh_stage st;
+
+    if (lsh_jget_open(&st, args) == 0) {
+        lsh_stages_run(&st, 1);
+    }
+    return 1;
+}
+
+/**
+   @brief Split a line into fields. Delimiters are located 16 bytes at a
+          time; lines containing quotes take the RFC 4180 path, where a
+          quoted field may hold delimiters and "" stands for a quote.
+   @param line Line, without its newline.
+   @param len Line length.
+   @param delim Field delimiter.
+   @param fields Array to fill, grown as needed.
+   @param cap Capacity of the array, updated when it grows.
+   @param unq Holds the text of quoted fields with "" in them, which is
+              unescaped so that every view is the field's plain text.
+   @return Number of fields.
+ */
+int lsh_csv_split(const char *line, size_t len, char delim, struct lsh_field **fields, int *cap,
+                  struct lsh_buf *unq) {
+    const char *p = line, *end = line + len, *start = line;
+    int n = 0;
+
+#define LSH_CSV_PUSH(s, l) do {                                              \
+        if (n == *cap) {                                                     \
+            *cap = *cap ? *cap * 2 : 16;                                     \
+            *fields = realloc(*fields, *cap * sizeof(struct lsh_field));     \
+            if (!*fields) {                                                  \
+                fprintf(stderr, "lsh: allocation error\n");                  \
+                exit(EXIT_FAILURE);                                          \
+            }                                                                \
+        }                                                                    \
+        (*fields)[n].ptr = (s);                                              \
+        (*fields)[n].len = (l);                                              \
+        n++;                                                                 \
+    } while (0)
+
+    if (memchr(line, '"', len) == NULL) {
+#ifdef __SSE2__
+        const __m128i d = _mm_set1_epi8(delim);
+        for (; p + 16 <= end; p += 16) {
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), d));
+            while (mask) {
+                const char *at = p + __builtin_ctz(mask);
+                LSH_CSV_PUSH(start, at - start);
+                start = at + 1;
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; p < end; p++) {
+            if (*p == delim) {
+                LSH_CSV_PUSH(start, p - start);
+                start = p + 1;
+            }
+        }
+        LSH_CSV_PUSH(start, end - start);
+        return n;
+    }
+
+    // Unescaped text is never longer than the line, so with this much room
+    // the views already taken into unq do not move.
+    unq->len = 0;
+    if (unq->cap < len) {
+        lsh_buf_append(unq, line, len);
+        unq->len = 0;
+    }
+    while (1) {
+        if (p < end && *p == '"') {
+            // Quoted field: the view covers the text between the quotes.
+            const char *q = ++p;
+            int escaped = 0;
+            while (q < end && !(*q == '"' && (q + 1 == end || q[1] != '"'))) {
+                escaped |= *q == '"';
+                q += *q == '"' ? 2 : 1;
+            }
+            if (q > end) {
+                q = end;
+            }
+            if (escaped) {
+                size_t at = unq->len;
+                for (const char *r = p; r < q; r += *r == '"' ? 2 : 1) {
+                    unq->data[unq->len++] = *r;
+                }
+                LSH_CSV_PUSH(unq->data + at, unq->len - at);
+            } else {
+                LSH_CSV_PUSH(p, q - p);
+            }
+            p = q < end ? q + 1 : end;
+            p = memchr(p, delim, end - p);
+        } else {
+            const char *q = memchr(p, delim, end - p);
+            LSH_CSV_PUSH(p, (q ? q : end) - p);
+            p = q;
+        }
+        if (p == NULL) {
+            return n;
+        }
+        p++;
+    }
+#undef LSH_CSV_PUSH
+}
+
+/*
+  One group-by bucket. Groups are kept in first-seen order; the hash
+  table holds indices into that list.
+*/
+struct lsh_csv_group {
+    char *key;
+    size_t len;
+    uint64_t hash;
+    long count;
+    double sum;
+};
+
+struct lsh_csv_groups {
+    struct lsh_csv_group *list;
+    size_t n, cap;
+    size_t *table;        // Index + 1 into list, 0 for an empty slot
+    size_t mask;
+};
+
+/**
+   @brief Find or create the group for a key.
+   @param g Group set.
+   @param key Key bytes (copied when a group is created).
+   @param len Key length.
+   @param hash Hash of the key.
+   @return The group.
+ */
+struct lsh_csv_group *lsh_csv_group(struct lsh_csv_groups *g, const char *key, size_t len, uint64_t hash) {
+    size_t i;
+
+    if (2 * (g->n + 1) > g->mask + 1) {
+        size_t size = g->table ? 2 * (g->mask + 1) : 64;
+        free(g->table);
+        g->table = calloc(size, sizeof(size_t));
+        if (!g->table) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        g->mask = size - 1;
+        for (size_t e = 0; e < g->n; e++) {
+            for (i = g->list[e].hash & g->mask; g->table[i]; i = (i + 1) & g->mask);
+            g->table[i] = e + 1;
+        }
+    }
+    for (i = hash & g->mask; g->table[i]; i = (i + 1) & g->mask) {
+        struct lsh_csv_group *e = &g->list[g->table[i] - 1];
+        if (e->hash == hash && e->len == len && memcmp(e->key, key, len) == 0) {
+            return e;
+        }
+    }
+    if (g->n == g->cap) {
+        g->cap = g->cap ? g->cap * 2 : 64;
+        g->list = realloc(g->list, g->cap * sizeof(*g->list));
+        if (!g->list) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct lsh_csv_group *e = &g->list[g->n];
+    if (!(e->key = malloc(len + 1))) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(e->key, key, len);
+    e->len = len;
+    e->hash = hash;
+    e->count = 0;
+    e->sum = 0;
+    g->table[i] = ++g->n;
+    return e;
+}
+
+/**
+   @brief Release a group set.
+   @param g Group set.
+ */
+void lsh_csv_groups_free(struct lsh_csv_groups *g) {
+    for (size_t i = 0; i < g->n; i++) {
+        free(g->list[i].key);
+    }
+    free(g->list);
+    free(g->table);
+    memset(g, 0, sizeof(*g));
+}
+
+/*
+  Settings of the csv builtin.
+*/
+struct lsh_csv {
+    char delim;
+    int *cols;            // -f: 0-based columns to output
+    int ncols;
+    int where_col;        // -w column, or -1
+    int where_contains;   // -w col~text rather than col=text
+    const char *where;
+    size_t where_len;
+    int group_col;        // -g column, or -1
+    int sum_col;          // -s column, or -1
+    int skip_header;      // Lines still to skip
+    struct lsh_csv_groups groups;
+    double total;         // -s without -g
+    long rows;
+    struct lsh_stage *st;
+    struct lsh_pool pool;
+    int pool_started;
+    struct lsh_field *split; // Fields of the row being processed
+    struct lsh_buf unq;      // Unescaped quoted fields of that row
+    struct lsh_buf text;     // Text of a row from another delimiter
+    int split_cap;
+    struct lsh_field *proj;  // Projected fields of an emitted row
+};
+
+/*
+  A share of the lines processed by one worker. Workers on a large block
+  buffer their text output; the serial part emits rows as it goes.
+*/
+struct lsh_csv_part {
+    struct lsh_csv *c;
+    const char *data;
+    size_t len;
+    int buffered;
+    struct lsh_buf out;
+    struct lsh_field *proj;  // Projected fields, when buffered
+    struct lsh_csv_groups own_groups;
+    struct lsh_csv_groups *groups;
+    double total;
+    long rows;
+};
+
+/**
+   @brief Read a field as a number.
+   @param f Field.
+   @return Its value, or 0 if it is not numeric.
+ */
+double lsh_csv_number(const struct lsh_field *f) {
+    char tmp[64];
+    size_t n = f->len < sizeof(tmp) - 1 ? f->len : sizeof(tmp) - 1;
+
+    memcpy(tmp, f->ptr, n);
+    tmp[n] = '\0';
+    return strtod(tmp, NULL);
+}
+
+/**
+   @brief Filter, project or aggregate one row.
+   @param part Part doing the work.
+   @param f Fields of the row.
+   @param n Number of fields.
+ */
+void lsh_csv_fields(struct lsh_csv_part *part, const struct lsh_field *f, int n) {
+    struct lsh_csv *c = part->c;
+    static const struct lsh_field empty = { "", 0 };
+    struct lsh_row row = { f, n, 1, 1, c->delim };
+
+    if (c->where_col >= 0) {
+        const struct lsh_field *w = c->where_col < n ? &f[c->where_col] : &empty;
+        if (c->where_contains ? (c->where_len > 0 && !lsh_find(w->ptr, w->len, c->where, c->where_len))
+                              : (w->len != c->where_len || memcmp(w->ptr, c->where, w->len) != 0)) {
+            return;
+        }
+    }
+    part->rows++;
+
+    if (c->group_col >= 0) {
+        const struct lsh_field *k = c->group_col < n ? &f[c->group_col] : &empty;
+        struct lsh_csv_group *g = lsh_csv_group(part->groups, k->ptr, k->len, lsh_hash(k->ptr, k->len));
+        g->count++;
+        if (c->sum_col >= 0 && c->sum_col < n) {
+            g->sum += lsh_csv_number(&f[c->sum_col]);
+        }
+        return;
+    }
+    if (c->sum_col >= 0) {
+        if (c->sum_col < n) {
+            part->total += lsh_csv_number(&f[c->sum_col]);
+        }
+        return;
+    }
+
+    if (c->ncols > 0) {
+        struct lsh_field *proj = part->buffered ? part->proj : c->proj;
+        for (int i = 0; i < c->ncols; i++) {
+            proj[i] = c->cols[i] < n ? f[c->cols[i]] : empty;
+        }
+        row.fields = proj;
+        row.nfields = c->ncols;
+    }
+    // Buffered parts format their rows just as the last stage would.
+    if (part->buffered) {
+        lsh_row_write(&row, &part->out);
+    } else {
+        lsh_stage_emit(c->st, &row);
+    }
+}
+
+/**
+   @brief Task: process the lines of one part.
+   @param arg A struct lsh_csv_part.
+ */
+void lsh_csv_part_run(void *arg) {
+    struct lsh_csv_part *part = arg;
+    struct lsh_field *f = NULL;
+    struct lsh_buf unq = { 0 };
+    const char *p = part->data, *end = part->data + part->len, *nl;
+    int cap = 0, n;
+    size_t len;
+
+    if (part->buffered && part->c->ncols > 0 &&
+        !(part->proj = malloc(part->c->ncols * sizeof(struct lsh_field)))) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (; p < end; p = nl + 1) {
+        if ((nl = memchr(p, '\n', end - p)) == NULL) {
+            nl = end;
+        }
+        len = nl - p - (nl > p && nl[-1] == '\r');
+        n = lsh_csv_split(p, len, part->c->delim, &f, &cap, &unq);
+        lsh_csv_fields(part, f, n);
+    }
+    free(f);
+    free(unq.data);
+    free(part->proj);
+}
+
+/**
+   @brief Stage text input for csv. A large block written straight out is
+          split across the workers and their output joined in input
+          order; otherwise lines are processed here, emitting rows.
+   @param st Stage whose state is the csv settings.
+   @param data Block of lines.
+   @param len Length of the block.
+ */
+void lsh_csv_block(struct lsh_stage *st, const char *data, size_t len) {
+    struct lsh_csv *c = st->state;
+    size_t nparts = 1, off = 0;
+    struct lsh_csv_part *parts;
+
+    while (c->skip_header > 0 && len > 0) {
+        const char *nl = memchr(data, '\n', len);
+        size_t skip = nl ? (size_t)(nl - data) + 1 : len;
+        data += skip;
+        len -= skip;
+        c->skip_header--;
+    }
+
+    if (st->next == NULL && len >= (1 << 20)) {
+        if (!c->pool_started) {
+            lsh_pool_start(&c->pool, 0);
+            c->pool_started = 1;
+        }
+        nparts = c->pool.nthreads;
+    }
+    parts = calloc(nparts, sizeof(*parts));
+    if (!parts) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (nparts == 1) {
+        parts[0] = (struct lsh_csv_part){ .c = c, .data = data, .len = len, .groups = &c->groups };
+        lsh_csv_part_run(&parts[0]);
+        c->total += parts[0].total;
+        c->rows += parts[0].rows;
+        free(parts);
+        return;
+    }
+
+    for (size_t i = 0; i < nparts; i++) {
+        // Parts end on a line boundary.
+        size_t stop = i == nparts - 1 ? len : len / nparts * (i + 1);
+        const char *nl = stop < len ? memchr(data + stop, '\n', len - stop) : NULL;
+        stop = nl ? (size_t)(nl - data) + 1 : len;
+        if (stop < off) {
+            stop = off;
+        }
+        parts[i].c = c;
+        parts[i].data = data + off;
+        parts[i].len = stop - off;
+        parts[i].buffered = 1;
+        parts[i].groups = &parts[i].own_groups;
+        off = stop;
+        lsh_pool_submit(&c->pool, lsh_csv_part_run, &parts[i]);
+    }
+    lsh_pool_wait(&c->pool);
+
+    for (size_t i = 0; i < nparts; i++) {
+        lsh_out_write(parts[i].out.data, parts[i].out.len);
+        for (size_t j = 0; j < parts[i].own_groups.n; j++) {
+            struct lsh_csv_group *src = &parts[i].own_groups.list[j];
+            struct lsh_csv_group *dst = lsh_csv_group(&c->groups, src->key, src->len, src->hash);
+            dst->count += src->count;
+            dst->sum += src->sum;
+        }
+        c->total += parts[i].total;
+        c->rows += parts[i].rows;
+        free(parts[i].out.data);
+        lsh_csv_groups_free(&parts[i].own_groups);
+    }
+    free(parts);
+}
+
+/**
+   @brief Stage row input for csv: rows that are already split are used as
+          they are, text lines are split first.
+   @param st Stage whose state is the csv settings.
+   @param row Row.
+ */
+void lsh_csv_row(struct lsh_stage *st, const struct lsh_row *row) {
+    struct lsh_csv *c = st->state;
+    struct lsh_csv_part part = { .c = c, .groups = &c->groups };
+    const char *line;
+    size_t len;
+    int n;
+
+    if (c->skip_header > 0) {
+        c->skip_header--;
+        return;
+    }
+    // Fields split on this delimiter are what splitting their text would
+    // give; anything else is split again from the text line.
+    if (row->structured && row->quote && row->delim == c->delim) {
+        lsh_csv_fields(&part, row->fields, row->nfields);
+    } else {
+        line = lsh_row_text(row, &c->text, &len);
+        n = lsh_csv_split(line, len - (len > 0 && line[len - 1] == '\r'),
+                          c->delim, &c->split, &c->split_cap, &c->unq);
+        lsh_csv_fields(&part, c->split, n);
+    }
+    c->total += part.total;
+    c->rows += part.rows;
+}
+
+/**
+   @brief Stage end for csv: emit the groups or the total.
+   @param st Stage whose state is the csv settings.
+ */
+void lsh_csv_finish(struct lsh_stage *st) {
+    struct lsh_csv *c = st->state;
+    char count[32], sum[32];
+    struct lsh_field f[3] = { { NULL, 0 }, { count, 0 }, { sum, 0 } };
+    struct lsh_row row = { f, c->sum_col >= 0 ? 3 : 2, 1, 1, c->delim };
+
+    if (c->group_col >= 0) {
+        for (size_t j = 0; j < c->groups.n; j++) {
+            struct lsh_csv_group *g = &c->groups.list[j];
+            f[0].ptr = g->key;
+            f[0].len = g->len;
+            f[1].len = snprintf(count, sizeof(count), "%ld", g->count);
+            f[2].len = snprintf(sum, sizeof(sum), "%.15g", g->sum);
+            lsh_stage_emit(st, &row);
+        }
+    } else if (c->sum_col >= 0) {
+        f[2].len = snprintf(sum, sizeof(sum), "%.15g", c->total);
+        row.fields = &f[2];
+        row.nfields = 1;
+        lsh_stage_emit(st, &row);
+    }
+}
+
+/**
+   @brief Stage release for csv.
+   @param st Stage whose state is the csv settings.
+ */
+void lsh_csv_release(struct lsh_stage *st) {
+    struct lsh_csv *c = st->state;
+
+    if (c->pool_started) {
+        lsh_pool_stop(&c->pool);
+    }
+    lsh_csv_groups_free(&c->groups);
+    free(c->cols);
+    free(c->split);
+    free(c->unq.data);
+    free(c->text.data);
+    free(c->proj);
+    free(c);
+}
+
+/**
+   @brief Parse a column list such as 1,3,5-7 into 0-based indices.
+   @param s List to parse.
+   @param c Settings receiving the columns.
+   @return 0 on success, -1 if the list is malformed.
+ */
+int lsh_csv_cols(const char *s, struct lsh_csv *c) {
+    char *end;
+
+    while (*s != '\0') {
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 1) {
+            return -1;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo) {
+                return -1;
+            }
+        }
+        for (long i = lo; i <= hi; i++) {
+            c->cols = realloc(c->cols, (c->ncols + 1) * sizeof(int));
+            if (!c->cols) {
+                fprintf(stderr, "lsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            c->cols[c->ncols++] = i - 1;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        s = end;
+    }
+    return c->ncols > 0 ? 0 : -1;
+}
+
+/**
+   @brief Open csv as a record stage.
+   @param st Stage to fill in.
+   @param args List of args. Options: -d <char> delimiter (default ','),
+               -t for tabs, -H to skip a header line, -f <cols> to output
+               only some columns, -w <col>=<text> or -w <col>~<text> to keep
+               matching rows, -g <col> to count rows per distinct value,
+               -s <col> to sum a column (per group with -g). Columns are
+               numbered from 1. Files follow; standard input by default.
+   @return 0 on success, -1 on a usage error.
+ */
+int lsh_csv_open(struct lsh_stage *st, char **args) {
+    struct lsh_csv *c = calloc(1, sizeof(*c));
+    char *end;
+    int i;
+
+    if (!c) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    c->delim = ',';
+    c->where_col = c->group_col = c->sum_col = -1;
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        const char *v = args[i + 1];
+        if (strcmp(args[i], "-t") == 0) {
+            c->delim = '\t';
+        } else if (strcmp(args[i], "-H") == 0) {
+            c->skip_header = 1;
+        } else if (strcmp(args[i], "-d") == 0 && v && strlen(v) == 1) {
+            c->delim = v[0];
+            i++;
+        } else if (strcmp(args[i], "-f") == 0 && v && lsh_csv_cols(v, c) == 0) {
+            i++;
+        } else if (strcmp(args[i], "-g") == 0 && v && atoi(v) > 0) {
+            c->group_col = atoi(v) - 1;
+            i++;
+        } else if (strcmp(args[i], "-s") == 0 && v && atoi(v) > 0) {
+            c->sum_col = atoi(v) - 1;
+            i++;
+        } else if (strcmp(args[i], "-w") == 0 && v && strtol(v, &end, 10) > 0 &&
+                   (*end == '=' || *end == '~')) {
+            c->where_col = strtol(v, NULL, 10) - 1;
+            c->where_contains = *end == '~';
+            c->where = end + 1;
+            c->where_len = strlen(c->where);
+            i++;
+        } else {
+            fprintf(stderr, "lsh: csv: bad option %s\n", args[i]);
+            free(c->cols);
+            free(c);
+            return -1;
+        }
+    }
+    if (c->ncols > 0 && !(c->proj = malloc(c->ncols * sizeof(struct lsh_field)))) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(st, 0, sizeof(*st));
+    c->st = st;
+    st->state = c;
+    st->block = lsh_csv_block;
+    st->row = lsh_csv_row;
+    st->finish = lsh_csv_finish;
+    st->release = lsh_csv_release;
+    st->files = args + i;
+    return 0;
+}
+
+/**
+   @brief Builtin command: select, filter and summarise delimited data.
+   @param args List of args, as for lsh_csv_open.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_csv(char **args) {
+    struct lsh_stage st;
+
+    if (lsh_csv_open(&st, args) == 0) {
+        lsh_stages_run(&st, 1);
+    }
+    return 1;
+}
+
+/*
+  partition: route each input line to an output file named after its key
+  field. Workers split chunks of input into per-key buckets in parallel;
+  the buckets are then committed in input order, so each output file gets
+  its lines in the order they came. Output files have their own write
+  buffers, and only a bounded number of them are kept open (least
+  recently used ones are closed and later reopened for appending).
+*/
+#define LSH_PART_CHUNK (4 << 20)      // Input handed to one worker at a time
+#define LSH_PART_FILEBUF 65536        // Write buffer per output file
+#define LSH_PART_BUFFERED (64 << 20)  // All write buffers together
+
+/*
+  Lines of one key within one chunk.
+*/
+struct lsh_part_bucket {
+    const char *key;      // NULL if the slot is empty
+    size_t key_len;
+    uint64_t hash;
+    struct lsh_buf lines;
+};
+
+struct lsh_part_chunk {
+    const char *data;
+    size_t len;
+    char *copy;           // Owned copy of unmapped input, or NULL
+    struct lsh_partition *p;
+    struct lsh_part_bucket *buckets;
+    size_t cap, n;        // cap is a power of two
+};
+
+struct lsh_part_file {
+    char *key;
+    size_t key_len;
+    uint64_t hash;
+    int fd;               // -1 while closed
+    int created;          // Opened (and truncated) once already
+    int failed;
+    struct lsh_buf buf;
+    struct lsh_part_file *newer, *older; // Open files, by last use
+};
+
+struct lsh_partition {
+    struct lsh_sort_opts opts;
+    const char *template; // Output path, "%s" standing for the key
+    struct lsh_part_file **files;
+    size_t cap, n;
+    struct lsh_part_file *newest, *oldest;
+    int nopen, max_open;
+    size_t buffered;
+    struct lsh_part_chunk *window; // Chunks waiting to be run
+    int nwindow, window_cap;
+    struct lsh_pool pool;
+    int errors;
+};
+
+/**
+   @brief Find the bucket of a key in a chunk, adding it if new.
+   @return The bucket.
+ */
+struct lsh_part_bucket *lsh_part_bucket(struct lsh_part_chunk *c, const char *key, size_t len, uint64_t hash) {
+    size_t i;
+
+    if ((c->n + 1) * 2 > c->cap) {
+        struct lsh_part_bucket *old = c->buckets;
+        size_t old_cap = c->cap;
+        c->cap = c->cap ? c->cap * 2 : 64;
+        if ((c->buckets = calloc(c->cap, sizeof(struct lsh_part_bucket))) == NULL) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < old_cap; j++) {
+            if (old[j].key != NULL) {
+                for (i = old[j].hash & (c->cap - 1); c->buckets[i].key; i = (i + 1) & (c->cap - 1));
+                c->buckets[i] = old[j];
+            }
+        }
+        free(old);
+    }
+    for (i = hash & (c->cap - 1); c->buckets[i].key != NULL; i = (i + 1) & (c->cap - 1)) {
+        if (c->buckets[i].hash == hash && c->buckets[i].key_len == len && memcmp(c->buckets[i].key, key, len) == 0) {
+            return &c->buckets[i];
+        }
+    }
+    c->buckets[i].key = key;
+    c->buckets[i].key_len = len;
+    c->buckets[i].hash = hash;
+    c->n++;
+    return &c->buckets[i];
+}
+
+/**
+   @brief Worker: sort the lines of a chunk into buckets by key.
+   @param arg The chunk.
+ */
+void lsh_part_chunk_run(void *arg) {
+    struct lsh_part_chunk *c = arg;
+    const char *p = c->data, *end = c->data + c->len, *nl;
+    struct lsh_sort_line l;
+    struct lsh_part_bucket *b;
+
+    while (p < end) {
+        nl = memchr(p, '\n', end - p);
+        l.ptr = p;
+        l.len = (nl ? nl : end) - p;
+        lsh_sort_key(&c->p->opts, &l);
+        b = lsh_part_bucket(c, l.key, l.key_len, lsh_hash(l.key, l.key_len));
+        lsh_buf_append(&b->lines, p, l.len);
+        lsh_buf_append(&b->lines, "\n", 1);
+        p = nl ? nl + 1 : end;
+    }
+}
+
+/**
+   @brief Find the output file of a key, adding it if new.
+   @return The file.
+ */
+struct lsh_part_file *lsh_part_file(struct lsh_partition *p, const char *key, size_t len, uint64_t hash) {
+    struct lsh_part_file *f;
+    size_t i;
+
+    if ((p->n + 1) * 2 > p->cap) {
+        struct lsh_part_file **old = p->files;
+        size_t old_cap = p->cap;
+        p->cap = p->cap ? p->cap * 2 : 256;
+        if ((p->files = calloc(p->cap, sizeof(struct lsh_part_file *))) == NULL) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < old_cap; j++) {
+            if (old[j] != NULL) {
+                for (i = old[j]->hash & (p->cap - 1); p->files[i]; i = (i + 1) & (p->cap - 1));
+                p->files[i] = old[j];
+            }
+        }
+        free(old);
+    }
+    for (i = hash & (p->cap - 1); p->files[i] != NULL; i = (i + 1) & (p->cap - 1)) {
+        f = p->files[i];
+        if (f->hash == hash && f->key_len == len && memcmp(f->key, key, len) == 0) {
+            return f;
+        }
+    }
+    if ((f = calloc(1, sizeof(*f))) == NULL || (f->key = malloc(len + 1)) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(f->key, key, len);
+    f->key[len] = '\0';
+    f->key_len = len;
+    f->hash = hash;
+    f->fd = -1;
+    p->files[i] = f;
+    p->n++;
+    return f;
+}
+
+/**
+   @brief Make sure an output file is open, closing the least recently
+          used one if too many are.
+   @return 0 on success, -1 if the file cannot be opened.
+ */
+int lsh_part_open(struct lsh_partition *p, struct lsh_part_file *f) {
+    char path[PATH_MAX], key[NAME_MAX + 1];
+    const char *mark;
+    size_t n;
+
+    if (f->fd >= 0) {
+        // Move to the front of the list.
+        if (p->newest != f) {
+            f->newer->older = f->older;
+            if (f->older) {
+                f->older->newer = f->newer;
+            } else {
+                p->oldest = f->newer;
+            }
+            f->newer = NULL;
+            f->older = p->newest;
+            p->newest->newer = f;
+            p->newest = f;
+        }
+        return 0;
+    }
+    if (f->failed) {
+        return -1;
+    }
+    if (p->nopen >= p->max_open) {
+        struct lsh_part_file *victim = p->oldest;
+        close(victim->fd);
+        victim->fd = -1;
+        p->oldest = victim->newer;
+        if (p->oldest) {
+            p->oldest->older = NULL;
+        } else {
+            p->newest = NULL;
+        }
+        p->nopen--;
+    }
+
+    // Keys become one path component, escaped so that distinct keys get
+    // distinct names: '/', '%', NUL and a leading '.' become %XX, and the
+    // empty key is a lone "%". Names too long for NAME_MAX are cut and end
+    // in "%%" and the key's hash, which no escaped key contains.
+    n = 0;
+    for (size_t i = 0; i < f->key_len && n <= NAME_MAX; i++) {
+        unsigned char c = f->key[i];
+        if (c == '/' || c == '%' || c == '\0' || (c == '.' && i == 0)) {
+            n += snprintf(key + n, sizeof(key) - n, "%%%02X", c);
+        } else {
+            key[n++] = c;
+        }
+    }
+    if (n > NAME_MAX) {
+        n = NAME_MAX - 18;
+        snprintf(key + n, sizeof(key) - n, "%%%%%016llx", (unsigned long long)f->hash);
+    } else if (n == 0) {
+        strcpy(key, "%");
+    } else {
+        key[n] = '\0';
+    }
+    if ((mark = strstr(p->template, "%s")) != NULL) {
+        snprintf(path, sizeof(path), "%.*s%s%s", (int)(mark - p->template), p->template, key, mark + 2);
+    } else {
+        snprintf(path, sizeof(path), "%s%s", p->template, key);
+    }
+
+    f->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (f->created ? O_APPEND : O_TRUNC), 0644);
+    if (f->fd < 0) {
+        fprintf(stderr, "lsh: partition: %s: %s\n", path, strerror(errno));
+        f->failed = 1;
+        p->errors = 1;
+        return -1;
+    }
+    f->created = 1;
+    f->newer = NULL;
+    f->older = p->newest;
+    if (p->newest) {
+        p->newest->newer = f;
+    } else {
+        p->oldest = f;
+    }
+    p->newest = f;
+    p->nopen++;
+    return 0;
+}
+
+/**
+   @brief Write out an output file's buffer.
+ */
+void lsh_part_flush(struct lsh_partition *p, struct lsh_part_file *f) {
+    if (f->buf.len > 0 && lsh_part_open(p, f) == 0 && lsh_write_all(f->fd, f->buf.data, f->buf.len) != 0) {
+        fprintf(stderr, "lsh: partition: %s: %s\n", f->key, strerror(errno));
+        p->errors = 1;
+    }
+    p->buffered -= f->buf.len;
+    f->buf.len = 0;
+}
+
+/**
+   @brief Run the chunks gathered so far on the pool, then hand their
+          buckets to the output files in input order.
+ */
+void lsh_part_run_window(struct lsh_partition *p) {
+    for (int i = 0; i < p->nwindow; i++) {
+        lsh_pool_submit(&p->pool, lsh_part_chunk_run, &p->window[i]);
+    }
+    lsh_pool_wait(&p->pool);
+
+    for (int w = 0; w < p->nwindow; w++) {
+        struct lsh_part_chunk *c = &p->window[w];
+        for (size_t i = 0; i < c->cap; i++) {
+            struct lsh_part_bucket *b = &c->buckets[i];
+            struct lsh_part_file *f;
+            if (b->key == NULL) {
+                continue;
+            }
+            f = lsh_part_file(p, b->key, b->key_len, b->hash);
+            if (f->buf.len + b->lines.len > LSH_PART_FILEBUF) {
+                lsh_part_flush(p, f);
+            }
+            if (b->lines.len >= LSH_PART_FILEBUF) {
+                // Too big to be worth buffering: write it straight out.
+                struct lsh_buf direct = f->buf;
+                f->buf = b->lines;
+                p->buffered += f->buf.len;
+                lsh_part_flush(p, f);
+                f->buf = direct;
+            } else {
+                lsh_buf_append(&f->buf, b->lines.data, b->lines.len);
+                p->buffered += b->lines.len;
+            }
+            free(b->lines.data);
+        }
+        free(c->buckets);
+        free(c->copy);
+    }
+    p->nwindow = 0;
+
+    // Keep the buffers of many small files from adding up without bound.
+    if (p->buffered > LSH_PART_BUFFERED) {
+        for (size_t i = 0; i < p->cap; i++) {
+            if (p->files[i] != NULL) {
+                lsh_part_flush(p, p->files[i]);
+            }
+        }
+    }
+}
+
+/**
+   @brief Queue a piece of input (whole lines) as a chunk.
+   @param p Partition state.
+   @param data Start of the lines.
+   @param len Length.
+   @param copy Owned copy to free after the chunk, or NULL.
+ */
+void lsh_part_add(struct lsh_partition *p, const char *data, size_t len, char *copy) {
+    struct lsh_part_chunk *c;
+
+    if (p->nwindow == p->window_cap) {
+        lsh_part_run_window(p);
+    }
+    c = &p->window[p->nwindow++];
+    memset(c, 0, sizeof(*c));
+    c->data = data;
+    c->len = len;
+    c->copy = copy;
+    c->p = p;
+}
+
+/**
+   @brief Builtin command: write each input line to a file chosen by a key
+          field.
+   @param args List of args: [-k <field>] [-t <sep>] [-o <template>] [file...].
+               The template names the output files, with %s for the key
+               (default "%s"); the key is the whole line without -k.
+               Keys are escaped as in lsh_part_open.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_partition(char **args) {
+    struct lsh_partition p;
+    struct lsh_input in;
+    struct rlimit rl;
+    const char *data, *nl;
+    size_t len, off, take;
+    char **files, *stdin_only[] = { NULL, NULL };
+    int i, rc;
+
+    memset(&p, 0, sizeof(p));
+    p.opts.sep = -1;
+    p.template = "%s";
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "-k") == 0 && args[i + 1] != NULL && atoi(args[i + 1]) > 0) {
+            p.opts.field = atoi(args[++i]);
+        } else if (strcmp(args[i], "-t") == 0 && args[i + 1] != NULL && strlen(args[i + 1]) == 1) {
+            p.opts.sep = (unsigned char)args[++i][0];
+        } else if (strcmp(args[i], "-o") == 0 && args[i + 1] != NULL) {
+            p.template = args[++i];
+        } else {
+            fprintf(stderr, "lsh: partition: bad option %s\n", args[i]);
+            return 1;
+        }
+    }
+    files = args[i] != NULL ? &args[i] : stdin_only;
+
+    // Stay well under the descriptor limit: inputs and the shell need some.
+    p.max_open = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (int)rl.rlim_cur - 32 : 1024;
+    p.max_open = p.max_open < 8 ? 8 : p.max_open;
+    lsh_pool_start(&p.pool, 0);
+    p.window_cap = p.pool.nthreads * 2;
+    if ((p.window = calloc(p.window_cap, sizeof(struct lsh_part_chunk))) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i == 0 || files[i] != NULL; i++) {
+        if (lsh_input_open(&in, files[i]) != 0) {
+            fprintf(stderr, "lsh: partition: %s: %s\n", files[i], strerror(errno));
+            p.errors = 1;
+            continue;
+        }
+        while ((rc = lsh_input_next(&in, &data, &len)) == 1) {
+            if (!in.map) {
+                // The block is only valid until the next read: keep a copy.
+                char *copy = malloc(len);
+                if (!copy) {
+                    fprintf(stderr, "lsh: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+                memcpy(copy, data, len);
+                lsh_part_add(&p, copy, len, copy);
+                continue;
+            }
+            // Cut mapped input into chunks at line ends.
+            for (off = 0; off < len; off += take) {
+                take = len - off;
+                if (take > LSH_PART_CHUNK) {
+                    nl = memchr(data + off + LSH_PART_CHUNK, '\n', len - off - LSH_PART_CHUNK);
+                    take = nl ? (size_t)(nl + 1 - (data + off)) : len - off;
+                }
+                lsh_part_add(&p, data + off, take, NULL);
+            }
+        }
+        if (rc < 0) {
+            fprintf(stderr, "lsh: partition: %s: %s\n", files[i] ? files[i] : "-", strerror(errno));
+            p.errors = 1;
+        }
+        // Mapped chunks point into the input: finish them before closing it.
+        lsh_part_run_window(&p);
+        lsh_input_close(&in);
+        if (files[i] == NULL) {
+            break;
+        }
+    }
+
+    // Flushing may reopen files and reorder the LRU list: free only after.
+    for (size_t f = 0; f < p.cap; f++) {
+        if (p.files[f] != NULL) {
+            lsh_part_flush(&p, p.files[f]);
+        }
+    }
+    for (size_t f = 0; f < p.cap; f++) {
+        if (p.files[f] != NULL) {
+            if (p.files[f]->fd >= 0) {
+                close(p.files[f]->fd);
+            }
+            free(p.files[f]->buf.data);
+            free(p.files[f]->key);
+            free(p.files[f]);
+        }
+    }
+    free(p.files);
+    free(p.window);
+    lsh_pool_stop(&p.pool);
+    return 1;
+}
+
+/*
+  Checksums: CRC32C, xxHash64 and SHA-256. CRC32C uses the SSE4.2 crc32
+  instruction and SHA-256 the SHA extensions when the CPU has them; each
+  falls back to portable code. All three hash a stream block by block.
+*/
+enum { LSH_SUM_CRC32C, LSH_SUM_XXH64, LSH_SUM_SHA256 };
+
+const char *lsh_sum_names[] = { "crc32c", "xxh64", "sha256" };
+const int lsh_sum_hex_len[] = { 8, 16, 64 };
+
+struct lsh_sum {
+    int algo;
+    uint64_t total;       // Bytes hashed so far
+    union {
+        uint32_t crc;
+        struct {
+            uint64_t v[4];
+            unsigned char mem[32];
+        } xxh;
+        struct {
+            uint32_t h[8];
+            unsigned char block[64];
+        } sha;
+    } u;
+};
+
+uint32_t lsh_crc32c_table[256];
+void (*lsh_sha256_blocks)(uint32_t h[8], const unsigned char *data, size_t n);
+uint32_t (*lsh_crc32c_update)(uint32_t crc, const unsigned char *data, size_t len);
+pthread_once_t lsh_sum_once = PTHREAD_ONCE_INIT;
+
+const uint32_t lsh_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+uint32_t lsh_crc32c_soft(uint32_t crc, const unsigned char *data, size_t len) {
+    while (len--) {
+        crc = lsh_crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#define LSH_ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void lsh_sha256_soft(uint32_t h[8], const unsigned char *data, size_t n) {
+    uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+
+    for (; n > 0; n--, data += 64) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+                   (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = LSH_ROR32(w[i - 15], 7) ^ LSH_ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = LSH_ROR32(w[i - 2], 17) ^ LSH_ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; k = h[7];
+        for (int i = 0; i < 64; i++) {
+            t1 = k + (LSH_ROR32(e, 6) ^ LSH_ROR32(e, 11) ^ LSH_ROR32(e, 25)) + ((e & f) ^ (~e & g)) +
+                 lsh_sha256_k[i] + w[i];
+            t2 = (LSH_ROR32(a, 2) ^ LSH_ROR32(a, 13) ^ LSH_ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            k = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+    }
+}
+
+#if defined(__SSE2__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+uint32_t lsh_crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t c = crc, word;
+
+    for (; len >= 8; len -= 8, data += 8) {
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (uint32_t)c;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void lsh_sha256_shani(uint32_t h[8], const unsigned char *data, size_t n) {
+    const __m128i order = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, tmp, msg, m[4], abef, cdgh;
+
+    // The instructions want the state as ABEF / CDGH.
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; n > 0; n--, data += 64) {
+        abef = state0;
+        cdgh = state1;
+        for (int g = 0; g < 16; g++) {
+            if (g < 4) {
+                m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * g)), order);
+            } else {
+                m[g & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(m[g & 3], m[(g + 1) & 3]),
+                                  _mm_alignr_epi8(m[(g + 3) & 3], m[(g + 2) & 3], 4)),
+                    m[(g + 3) & 3]);
+            }
+            msg = _mm_add_epi32(m[g & 3], _mm_loadu_si128((const __m128i *)&lsh_sha256_k[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+/**
+   @brief Build the CRC table and pick the fastest code this CPU can run.
+ */
+void lsh_sum_setup(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) {
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        }
+        lsh_crc32c_table[i] = c;
+    }
+    lsh_crc32c_update = lsh_crc32c_soft;
+    lsh_sha256_blocks = lsh_sha256_soft;
+#if defined(__SSE2__) && defined(__GNUC__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__builtin_cpu_supports("sse4.2")) {
+        lsh_crc32c_update = lsh_crc32c_sse42;
+    }
+    if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3") &&
+        __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29))) {
+        lsh_sha256_blocks = lsh_sha256_shani;
+    }
+#endif
+}
+
+#define LSH_XXH_P1 11400714785074694791ULL
+#define LSH_XXH_P2 14029467366897019727ULL
+#define LSH_XXH_P3 1609587929392839161ULL
+#define LSH_XXH_P4 9650029242287828579ULL
+#define LSH_XXH_P5 2870177450012600261ULL
+#define LSH_ROL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+uint64_t lsh_xxh_round(uint64_t acc, const unsigned char *p) {
+    uint64_t in;
+
+    memcpy(&in, p, 8);
+    acc += le64toh(in) * LSH_XXH_P2;
+    return LSH_ROL64(acc, 31) * LSH_XXH_P1;
+}
+
+/**
+   @brief Start a checksum.
+   @param s Checksum state.
+   @param algo One of LSH_SUM_*.
+ */
+void lsh_sum_init(struct lsh_sum *s, int algo) {
+    static const uint32_t sha_init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    pthread_once(&lsh_sum_once, lsh_sum_setup);
+    memset(s, 0, sizeof(*s));
+    s->algo = algo;
+    if (algo == LSH_SUM_CRC32C) {
+        s->u.crc = 0xffffffff;
+    } else if (algo == LSH_SUM_XXH64) {
+        s->u.xxh.v[0] = LSH_XXH_P1 + LSH_XXH_P2;
+        s->u.xxh.v[1] = LSH_XXH_P2;
+        s->u.xxh.v[3] = -LSH_XXH_P1;
+    } else {
+        memcpy(s->u.sha.h, sha_init, sizeof(sha_init));
+    }
+}
+
+/**
+   @brief Add data to a checksum.
+ */
+void lsh_sum_update(struct lsh_sum *s, const unsigned char *data, size_t len) {
+    size_t held, take;
+
+    if (s->algo == LSH_SUM_CRC32C) {
+        s->u.crc = lsh_crc32c_update(s->u.crc, data, len);
+        s->total += len;
+        return;
+    }
+
+    // Both block hashes: top up a partial block, run whole blocks in
+    // place, keep the tail.
+    size_t block = s->algo == LSH_SUM_XXH64 ? 32 : 64;
+    unsigned char *buf = s->algo == LSH_SUM_XXH64 ? s->u.xxh.mem : s->u.sha.block;
+    held = s->total % block;
+    s->total += len;
+    if (held > 0) {
+        take = block - held < len ? block - held : len;
+        memcpy(buf + held, data, take);
+        data += take;
+        len -= take;
+        if (held + take < block) {
+            return;
+        }
+        if (s->algo == LSH_SUM_XXH64) {
+            for (int i = 0; i < 4; i++) {
+                s->u.xxh.v[i] = lsh_xxh_round(s->u.xxh.v[i], buf + 8 * i);
+            }
+        } else {
+            lsh_sha256_blocks(s->u.sha.h, buf, 1);
+        }
+    }
+    if (s->algo == LSH_SUM_XXH64) {
+        uint64_t v0 = s->u.xxh.v[0], v1 = s->u.xxh.v[1], v2 = s->u.xxh.v[2], v3 = s->u.xxh.v[3];
+        for (; len >= 32; len -= 32, data += 32) {
+            v0 = lsh_xxh_round(v0, data);
+            v1 = lsh_xxh_round(v1, data + 8);
+            v2 = lsh_xxh_round(v2, data + 16);
+            v3 = lsh_xxh_round(v3, data + 24);
+        }
+        s->u.xxh.v[0] = v0; s->u.xxh.v[1] = v1; s->u.xxh.v[2] = v2; s->u.xxh.v[3] = v3;
+    } else {
+        lsh_sha256_blocks(s->u.sha.h, data, len / 64);
+        data += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(buf, data, len);
+}
+
+/**
+   @brief Finish a checksum.
+   @param s Checksum state.
+   @param hex Set to the checksum in lowercase hex, NUL-terminated (65 bytes).
+ */
+void lsh_sum_final(struct lsh_sum *s, char *hex) {
+    if (s->algo == LSH_SUM_CRC32C) {
+        sprintf(hex, "%08x", ~s->u.crc);
+    } else if (s->algo == LSH_SUM_XXH64) {
+        uint64_t *v = s->u.xxh.v, h, k;
+        const unsigned char *p = s->u.xxh.mem;
+        size_t rest = s->total % 32;
+        uint32_t w;
+
+        if (s->total >= 32) {
+            h = LSH_ROL64(v[0], 1) + LSH_ROL64(v[1], 7) + LSH_ROL64(v[2], 12) + LSH_ROL64(v[3], 18);
+            for (int i = 0; i < 4; i++) {
+                k = LSH_ROL64(v[i] * LSH_XXH_P2, 31) * LSH_XXH_P1;
+                h = (h ^ k) * LSH_XXH_P1 + LSH_XXH_P4;
+            }
+        } else {
+            h = LSH_XXH_P5;
+        }
+        h += s->total;
+        for (; rest >= 8; rest -= 8, p += 8) {
+            h ^= lsh_xxh_round(0, p);
+            h = LSH_ROL64(h, 27) * LSH_XXH_P1 + LSH_XXH_P4;
+        }
+        if (rest >= 4) {
+            memcpy(&w, p, 4);
+            h ^= (uint64_t)le32toh(w) * LSH_XXH_P1;
+            h = LSH_ROL64(h, 23) * LSH_XXH_P2 + LSH_XXH_P3;
+            rest -= 4;
+            p += 4;
+        }
+        for (; rest > 0; rest--, p++) {
+            h ^= *p * LSH_XXH_P5;
+            h = LSH_ROL64(h, 11) * LSH_XXH_P1;
+        }
+        h ^= h >> 33;
+        h *= LSH_XXH_P2;
+        h ^= h >> 29;
+        h *= LSH_XXH_P3;
+        h ^= h >> 32;
+        sprintf(hex, "%016llx", (unsigned long long)h);
+    } else {
+        unsigned char pad[72] = { 0x80 };
+        uint64_t bits = s->total * 8;
+        size_t padlen = (s->total % 64 < 56 ? 56 : 120) - s->total % 64;
+
+        for (int i = 0; i < 8; i++) {
+            pad[padlen + i] = bits >> (56 - 8 * i);
+        }
+        lsh_sum_update(s, pad, padlen + 8);
+        for (int i = 0; i < 8; i++) {
+            sprintf(hex + 8 * i, "%08x", s->u.sha.h[i]);
+        }
+    }
+}
+
+/*
+  One file to checksum, hashed on the worker pool.
+*/
+struct lsh_sum_job {
+    const char *path;     // NULL for standard input
+    int algo;
+    char hex[65];
+    int err;              // errno if the file could not be read
+    const char *expect;   // Checksum to compare with (-c), or NULL
+    size_t at;            // Offset of the -c line in the check text
+};
+
+/**
+   @brief Worker: checksum one file, mapped if possible.
+   @param arg The job.
+ */
+void lsh_sum_run(void *arg) {
+    struct lsh_sum_job *job = arg;
+    struct lsh_input in;
+    struct lsh_sum s;
+    char *buf;
+    ssize_t n;
+
+    if (lsh_input_open(&in, job->path) != 0) {
+        job->err = errno;
+        return;
+    }
+    lsh_sum_init(&s, job->algo);
+    if (in.map) {
+        lsh_sum_update(&s, (unsigned char *)in.map, in.map_len);
+    } else if ((buf = malloc(LSH_IN_BUFSIZE)) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    } else {
+        // Not mappable (a pipe, or empty): plain large reads.
+        while ((n = read(in.fd, buf, LSH_IN_BUFSIZE)) != 0) {
+            if (n < 0 && errno != EINTR) {
+                job->err = errno;
+                break;
+            }
+            if (n > 0) {
+                lsh_sum_update(&s, (unsigned char *)buf, n);
+            }
+        }
+        free(buf);
+    }
+    lsh_input_close(&in);
+    lsh_sum_final(&s, job->hex);
+}
+
+/**
+   @brief Read "checksum  file" lines (as written by checksum, sha256sum or
+          xxhsum) into jobs.
+   @param path Check file, or NULL for standard input.
+   @param algo Algorithm, or -1 to tell it from the checksum length.
+   @param jobs Job list to extend.
+   @param text Check file text to extend. The new jobs hold offsets into
+               it; their pointers are set once all files are read.
+   @return Number of lines that could not be parsed, or -1 if the file
+           cannot be read.
+ */
+int lsh_sum_read_checks(const char *path, int algo, struct lsh_buf *jobs, struct lsh_buf *text) {
+    struct lsh_input in;
+    const char *data;
+    size_t len;
+    char *line, *end, *next, *name;
+    size_t start = text->len;
+    int bad = 0;
+
+    if (lsh_input_open(&in, path) != 0) {
+        return -1;
+    }
+    while (lsh_input_next(&in, &data, &len) == 1) {
+        lsh_buf_append(text, data, len);
+    }
+    lsh_input_close(&in);
+    lsh_buf_append(text, "", 1);
+
+    for (line = text->data + start; *line != '\0'; line = next) {
+        struct lsh_sum_job job = { 0 };
+        end = strchr(line, '\n');
+        next = end ? end + 1 : line + strlen(line);
+        if (end) {
+            *end = '\0';
+        }
+        if (*line == '\0' || *line == '#') {
+            continue;
+        }
+        len = strspn(line, "0123456789abcdefABCDEF");
+        name = line + len;
+        job.algo = algo;
+        for (int a = 0; algo < 0 && a < 3; a++) {
+            if ((int)len == lsh_sum_hex_len[a]) {
+                job.algo = a;
+            }
+        }
+        // Two spaces, or a space and '*' for sha256sum's binary mode.
+        if (job.algo < 0 || (int)len != lsh_sum_hex_len[job.algo] || name[0] != ' ' ||
+            (name[1] != ' ' && name[1] != '*') || name[2] == '\0') {
+            bad++;
+            continue;
+        }
+        for (size_t i = 0; i < len; i++) {
+            line[i] |= 0x20;  // Lowercase; digits already have this bit
+        }
+        name[0] = '\0';
+        job.at = line - text->data;
+        lsh_buf_append(jobs, (char *)&job, sizeof(job));
+    }
+    return bad;
+}
+
+/**
+   @brief Builtin command: print or check file checksums.
+   @param args List of args: [-a crc32c|xxh64|sha256] [-c] [file...].
+               Files are hashed concurrently; the output is "checksum  file"
+               as from sha256sum. With -c the files hold such lines and
+               each listed file is checked against them.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_checksum(char **args) {
+    struct lsh_buf jobs = { 0 }, text = { 0 };
+    struct lsh_sum_job *job;
+    struct lsh_pool pool;
+    char **files, *stdin_only[] = { NULL, NULL };
+    int algo = -1, check = 0, i, failed = 0, unreadable = 0, bad = 0;
+    size_t n;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "-c") == 0) {
+            check = 1;
+        } else if (strcmp(args[i], "-a") == 0 && args[i + 1] != NULL) {
+            for (algo = 2; algo >= 0 && strcmp(args[i + 1], lsh_sum_names[algo]) != 0; algo--);
+            if (algo < 0) {
+                fprintf(stderr, "lsh: checksum: unknown algorithm %s\n", args[i + 1]);
+                lsh_status = 1;
+                return 1;
+            }
+            i++;
+        } else {
+            fprintf(stderr, "lsh: checksum: bad option %s\n", args[i]);
+            lsh_status = 1;
+            return 1;
+        }
+    }
+    files = args[i] != NULL ? &args[i] : stdin_only;
+
+    for (i = 0; i == 0 || files[i] != NULL; i++) {
+        if (check) {
+            int r = lsh_sum_read_checks(files[i], algo, &jobs, &text);
+            if (r < 0) {
+                fprintf(stderr, "lsh: checksum: %s: %s\n", files[i], strerror(errno));
+                lsh_status = 1;
+            } else {
+                bad += r;
+            }
+        } else {
+            struct lsh_sum_job one = { files[i], algo < 0 ? LSH_SUM_SHA256 : algo };
+            lsh_buf_append(&jobs, (char *)&one, sizeof(one));
+        }
+        if (files[i] == NULL) {
+            break;
+        }
+    }
+    job = (struct lsh_sum_job *)jobs.data;
+    n = jobs.len / sizeof(struct lsh_sum_job);
+    for (size_t j = 0; check && j < n; j++) {
+        // The text may have moved while later check files were appended.
+        job[j].expect = text.data + job[j].at;
+        job[j].path = job[j].expect + lsh_sum_hex_len[job[j].algo] + 2;
+    }
+
+    lsh_pool_start(&pool, 0);
+    for (size_t j = 0; j < n; j++) {
+        lsh_pool_submit(&pool, lsh_sum_run, &job[j]);
+    }
+    lsh_pool_wait(&pool);
+    lsh_pool_stop(&pool);
+
+    for (size_t j = 0; j < n; j++) {
+        const char *name = job[j].path ? job[j].path : "-";
+        if (job[j].err) {
+            if (check) {
+                lsh_out_write(name, strlen(name));
+                lsh_out_write(": FAILED open or read\n", 22);
+            }
+            lsh_out_flush();
+            fprintf(stderr, "lsh: checksum: %s: %s\n", name, strerror(job[j].err));
+            unreadable++;
+        } else if (check) {
+            int ok = strcmp(job[j].hex, job[j].expect) == 0;
+            lsh_out_write(name, strlen(name));
+            lsh_out_write(ok ? ": OK\n" : ": FAILED\n", ok ? 5 : 9);
+            failed += !ok;
+        } else {
+            lsh_out_write(job[j].hex, strlen(job[j].hex));
+            lsh_out_write("  ", 2);
+            lsh_out_write(name, strlen(name));
+            lsh_out_write("\n", 1);
+        }
+    }
+    lsh_out_flush();
+    if (bad) {
+        fprintf(stderr, "lsh: checksum: WARNING: %d line%s improperly formatted\n", bad, bad == 1 ? " is" : "s are");
+    }
+    if (unreadable && check) {
+        fprintf(stderr, "lsh: checksum: WARNING: %d listed file%s could not be read\n", unreadable, unreadable == 1 ? "" : "s");
+    }
+    if (failed) {
+        fprintf(stderr, "lsh: checksum: WARNING: %d computed checksum%s did NOT match\n", failed, failed == 1 ? "" : "s");
+    }
+    if (failed || unreadable) {
+        lsh_status = 1;
+    }
+    free(jobs.data);
+    free(text.data);
+    return 1;
+}
+
+/*
+  Tracing. When $MYSHELL_TRACE_FILE names a file, the shell records a span
+  for its whole run and one for every command, appending each as a line
+  of OTLP-JSON (an ExportTraceServiceRequest) for a collector to pick up.
+  Child processes get a W3C TRACEPARENT naming their command's span, so
+  their own spans join the same trace. A TRACEPARENT the shell itself was
+  started with makes its run a child of that span.
+*/
+struct lsh_trace {
+    int fd;                 // Span file, or -1 when tracing is off
+    pid_t owner;            // Process that writes the run span
+    char trace_id[33];
+    char parent_id[17];     // Inherited parent of the run span, or ""
+    char run_id[17];
+    char current_id[17];    // Span of the command being run
+    uint64_t run_start;
+} lsh_trace = { -1 };
+
+/**
+   @brief Fill a buffer with random lowercase hex digits.
+   @param hex Buffer of n + 1 bytes.
+   @param n Number of digits (even).
+ */
+void lsh_trace_random_id(char *hex, int n) {
+    unsigned char bytes[16];
+
+    if (getrandom(bytes, n / 2, 0) != n / 2) {
+        // No entropy source: fall back to time and pid, still unique enough.
+        uint64_t seed = lsh_hash((const char *)&hex, sizeof(hex)) ^ (uint64_t)time(NULL) ^ getpid();
+        for (int i = 0; i < n / 2; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            bytes[i] = seed >> 56;
+        }
+    }
+    for (int i = 0; i < n / 2; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", bytes[i]);
+    }
+}
+
+/**
+   @brief Current wall-clock time in nanoseconds since the epoch.
+ */
+uint64_t lsh_trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+   @brief Append a string to a buffer as a JSON string literal.
+   @param b Buffer.
+   @param s String.
+ */
+void lsh_trace_json_string(struct lsh_buf *b, const char *s) {
+    char esc[8];
+
+    lsh_buf_append(b, "\"", 1);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            esc[0] = '\\';
+            esc[1] = *s;
+            lsh_buf_append(b, esc, 2);
+        } else if ((unsigned char)*s < 0x20) {
+            lsh_buf_append(b, esc, snprintf(esc, sizeof(esc), "\\u%04x", *s));
+        } else {
+            lsh_buf_append(b, s, 1);
+        }
+    }
+    lsh_buf_append(b, "\"", 1);
+}
+
+/**
+   @brief Write one finished span to the span file.
+   @param name Span name.
+   @param span_id Its id.
+   @param parent_id Parent span id, or "" for a root span.
+   @param start Start time (ns).
+   @param end End time (ns).
+   @param command Command line for the process.command_line attribute,
+                  or NULL.
+ */
+void lsh_trace_emit(const char *name, const char *span_id, const char *parent_id,
+                    uint64_t start, uint64_t end, const char *command) {
+    const char *head = "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\","
+                       "\"value\":{\"stringValue\":\"myshell\"}}]},\"scopeSpans\":[{\"scope\":{\"name\":\"myshell\"},"
+                       "\"spans\":[{\"traceId\":\"";
+    const char *attr = ",\"attributes\":[{\"key\":\"process.command_line\",\"value\":{\"stringValue\":";
+    struct lsh_buf b = { NULL, 0, 0 };
+    char num[64];
+
+    lsh_buf_append(&b, head, strlen(head));
+    lsh_buf_append(&b, lsh_trace.trace_id, 32);
+    lsh_buf_append(&b, "\",\"spanId\":\"", 12);
+    lsh_buf_append(&b, span_id, 16);
+    if (parent_id[0] != '\0') {
+        lsh_buf_append(&b, "\",\"parentSpanId\":\"", 18);
+        lsh_buf_append(&b, parent_id, 16);
+    }
+    lsh_buf_append(&b, "\",\"name\":", 9);
+    lsh_trace_json_string(&b, name);
+    lsh_buf_append(&b, num, snprintf(num, sizeof(num), ",\"kind\":1,\"startTimeUnixNano\":\"%llu\"",
+                                     (unsigned long long)start));
+    lsh_buf_append(&b, num, snprintf(num, sizeof(num), ",\"endTimeUnixNano\":\"%llu\"",
+                                     (unsigned long long)end));
+    if (command != NULL) {
+        lsh_buf_append(&b, attr, strlen(attr));
+        lsh_trace_json_string(&b, command);
+        lsh_buf_append(&b, "}}]", 3);
+    }
+    lsh_buf_append(&b, "}]}]}]}\n", 8);
+    // One write per line with O_APPEND keeps lines from different shells whole.
+    lsh_write_all(lsh_trace.fd, b.data, b.len);
+    free(b.data);
+}
+
+/**
+   @brief Close the run span when the shell exits.
+ */
+void lsh_trace_end(void) {
+    if (lsh_trace.fd >= 0 && getpid() == lsh_trace.owner) {
+        lsh_trace_emit("myshell", lsh_trace.run_id, lsh_trace.parent_id, lsh_trace.run_start,
+                       lsh_trace_now(), NULL);
+        close(lsh_trace.fd);
+        lsh_trace.fd = -1;
+    }
+}
+
+/**
+   @brief Turn tracing on if $MYSHELL_TRACE_FILE is set, joining the trace
+          of an inherited TRACEPARENT.
+ */
+void lsh_trace_start(void) {
+    const char *file = getenv("MYSHELL_TRACE_FILE"), *parent = getenv("TRACEPARENT");
+
+    if (file == NULL || (lsh_trace.fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        return;
+    }
+    // traceparent: 00-<32 hex trace id>-<16 hex parent id>-<2 hex flags>
+    if (parent != NULL && strlen(parent) == 55 && strncmp(parent, "00-", 3) == 0 &&
+        parent[35] == '-' && parent[52] == '-' &&
+        strspn(parent + 3, "0123456789abcdef") == 32 && strspn(parent + 36, "0123456789abcdef") == 16) {
+        memcpy(lsh_trace.trace_id, parent + 3, 32);
+        memcpy(lsh_trace.parent_id, parent + 36, 16);
+    } else {
+        lsh_trace_random_id(lsh_trace.trace_id, 32);
+    }
+    lsh_trace_random_id(lsh_trace.run_id, 16);
+    memcpy(lsh_trace.current_id, lsh_trace.run_id, 17);
+    lsh_trace.run_start = lsh_trace_now();
+    lsh_trace.owner = getpid();
+    atexit(lsh_trace_end);
+}
+
+/**
+   @brief In a child about to exec, point TRACEPARENT at the span of the
+          command it belongs to.
+ */
+void lsh_trace_child_env(void) {
+    char value[64];
+
+    if (lsh_trace.fd >= 0) {
+        snprintf(value, sizeof(value), "00-%s-%s-01", lsh_trace.trace_id, lsh_trace.current_id);
+        setenv("TRACEPARENT", value, 1);
+    }
+}
+
+/*
+  Shell variables. A value lives in a buffer that grows geometrically, so
+  "s=$s..." appends in amortized constant time: such an assignment is
+  recognised before expansion and only the new part is expanded and copied
+  onto the end. Names the shell has not set fall back to the environment;
+  variables that came from it are handed back to commands with their
+  current values.
+
+  A variable also caches its value as an integer once arithmetic has read
+  it, and arithmetic writes only the integer: the string is formatted when
+  something asks for it. Counter loops then never parse or print numbers.
+
+  Arrays are slices of one value: a list of (offset, length) pairs into
+  the string. BASH_REMATCH keeps the subject of the last match once and
+  its groups as slices of it.
+*/
+struct lsh_var {
+    char *name;           // NULL if the slot is empty
+    uint64_t hash;
+    struct lsh_buf value; // Kept NUL-terminated past len, unless str_stale
+    long long num;        // The value as an integer, if num_ok
+    int num_ok;           // num is current (string writes clear it)
+    int str_stale;        // value must be formatted from num before use
+    struct lsh_buf elems; // Array elements as size_t offset, length pairs
+    int array;            // Elements are in elems (possibly none)
+    int exported;         // Taken from the environment
+};
+
+struct lsh_var *lsh_vars = NULL; // Open addressing; cap is a power of two
+size_t lsh_var_count = 0;
+size_t lsh_var_cap = 0;
+
+/**
+   @brief Length of the variable name at the start of a string.
+   @return Length, or 0 if it does not start with a name.
+ */
+size_t lsh_var_name_len(const char *s) {
+    size_t n = 0;
+
+    if ((s[0] >= 'a' && s[0] <= 'z') || (s[0] >= 'A' && s[0] <= 'Z') || s[0] == '_') {
+        for (n = 1; (s[n] >= 'a' && s[n] <= 'z') || (s[n] >= 'A' && s[n] <= 'Z') ||
+                    (s[n] >= '0' && s[n] <= '9') || s[n] == '_'; n++);
+    }
+    return n;
+}
+
+/**
+   @brief Find a shell variable.
+   @param name Name (need not be NUL-terminated).
+   @param len Length of the name.
+   @param create Add the variable if it does not exist, starting from its
+                 environment value if there is one.
+   @return The variable, or NULL if it does not exist and create is 0.
+ */
+struct lsh_var *lsh_var_find(const char *name, size_t len, int create) {
+    uint64_t hash = lsh_hash(name, len);
+    struct lsh_var *v;
+    const char *env;
+    size_t i;
+
+    for (i = lsh_var_cap ? hash & (lsh_var_cap - 1) : 0; lsh_var_cap && lsh_vars[i].name; i = (i + 1) & (lsh_var_cap - 1)) {
+        v = &lsh_vars[i];
+        if (v->hash == hash && strncmp(v->name, name, len) == 0 && v->name[len] == '\0') {
+            return v;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if ((lsh_var_count + 1) * 2 > lsh_var_cap) {
+        struct lsh_var *old = lsh_vars;
+        size_t old_cap = lsh_var_cap;
+        lsh_var_cap = lsh_var_cap ? lsh_var_cap * 2 : 64;
+        if ((lsh_vars = calloc(lsh_var_cap, sizeof(struct lsh_var))) == NULL) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < old_cap; j++) {
+            if (old[j].name) {
+                for (i = old[j].hash & (lsh_var_cap - 1); lsh_vars[i].name; i = (i + 1) & (lsh_var_cap - 1));
+                lsh_vars[i] = old[j];
+            }
+        }
+        free(old);
+        for (i = hash & (lsh_var_cap - 1); lsh_vars[i].name; i = (i + 1) & (lsh_var_cap - 1));
+    }
+    v = &lsh_vars[i];
+    if ((v->name = strndup(name, len)) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    v->hash = hash;
+    env = getenv(v->name);
+    v->exported = env != NULL;
+    lsh_buf_append(&v->value, env ? env : "", env ? strlen(env) + 1 : 1);
+    v->value.len--;
+    lsh_var_count++;
+    return v;
+}
+
+/**
+   @brief Remove a variable, so that its name falls back to the environment.
+   @param v Variable.
+ */
+void lsh_var_remove(struct lsh_var *v) {
+    size_t i = v - lsh_vars, j = i, home;
+
+    free(v->name);
+    free(v->value.data);
+    free(v->elems.data);
+    memset(v, 0, sizeof(struct lsh_var));
+    // Move later entries of the probe run back over the hole.
+    for (;;) {
+        do {
+            j = (j + 1) & (lsh_var_cap - 1);
+            if (lsh_vars[j].name == NULL) {
+                lsh_var_count--;
+                return;
+            }
+            home = lsh_vars[j].hash & (lsh_var_cap - 1);
+        } while (((j - home) & (lsh_var_cap - 1)) < ((j - i) & (lsh_var_cap - 1)));
+        lsh_vars[i] = lsh_vars[j];
+        memset(&lsh_vars[j], 0, sizeof(struct lsh_var));
+        i = j;
+    }
+}
+
+/**
+   @brief Bring a variable's string up to date with its integer.
+   @param v Variable.
+ */
+void lsh_var_sync(struct lsh_var *v) {
+    char num[32];
+
+    if (v->str_stale) {
+        v->value.len = 0;
+        lsh_buf_append(&v->value, num, snprintf(num, sizeof(num), "%lld", v->num) + 1);
+        v->value.len--;
+        v->str_stale = 0;
+    }
+}
+
+/**
+   @brief Set a variable to an integer.
+   @param v Variable.
+   @param n Value.
+ */
+void lsh_var_set_num(struct lsh_var *v, long long n) {
+    v->num = n;
+    v->num_ok = 1;
+    v->str_stale = 1;
+    v->array = 0;
+}
+
+/**
+   @brief Get a variable's value as an integer, parsing its string only if
+          the cached integer is not current.
+   @param v Variable.
+   @param out Set to the value.
+   @return 0 on success, -1 if the value is not an integer.
+ */
+int lsh_var_num(struct lsh_var *v, long long *out) {
+    char *end;
+
+    if (!v->num_ok) {
+        errno = 0;
+        v->num = strtoll(v->value.data, &end, 10);
+        if (end == v->value.data || *end != '\0' || errno != 0) {
+            return -1;
+        }
+        v->num_ok = 1;
+    }
+    *out = v->num;
+    return 0;
+}
+
+/**
+   @brief Look up an element of a variable. A variable that is not an
+          array is its own element 0.
+   @param name Name (need not be NUL-terminated).
+   @param len Length of the name.
+   @param index Element number.
+   @param value_len Set to the length of the element.
+   @return The element, or NULL if it is not set.
+ */
+const char *lsh_var_elem(const char *name, size_t len, size_t index, size_t *value_len) {
+    struct lsh_var *v = lsh_var_find(name, len, 0);
+    const size_t *slice;
+    char key[256];
+    const char *env;
+
+    if (v && v->array) {
+        if (index >= v->elems.len / (2 * sizeof(size_t))) {
+            return NULL;
+        }
+        slice = (const size_t *)v->elems.data + 2 * index;
+        if (slice[0] == (size_t)-1) {
+            return NULL;
+        }
+        *value_len = slice[1];
+        return v->value.data + slice[0];
+    }
+    if (index != 0) {
+        return NULL;
+    }
+    if (v) {
+        lsh_var_sync(v);
+        *value_len = v->value.len;
+        return v->value.data;
+    }
+    if (len >= sizeof(key)) {
+        return NULL;
+    }
+    memcpy(key, name, len);
+    key[len] = '\0';
+    if ((env = getenv(key)) != NULL) {
+        *value_len = strlen(env);
+    }
+    return env;
+}
+
+/**
+   @brief Look up the value of a variable (element 0 of an array).
+   @param name Name (need not be NUL-terminated).
+   @param len Length of the name.
+   @param value_len Set to the length of the value.
+   @return The value, or NULL if the variable is not set.
+ */
+const char *lsh_var_get(const char *name, size_t len, size_t *value_len) {
+    return lsh_var_elem(name, len, 0, value_len);
+}
+
+/**
+   @brief Count the elements of a variable.
+   @return Number of elements: 1 for a set variable that is not an array.
+ */
+size_t lsh_var_elem_count(const char *name, size_t len) {
+    struct lsh_var *v = lsh_var_find(name, len, 0);
+    size_t vlen;
+
+    if (v && v->array) {
+        return v->elems.len / (2 * sizeof(size_t));
+    }
+    return lsh_var_get(name, len, &vlen) != NULL;
+}
+
+/*
+  Integer arithmetic as in $((...)) and let: C operators from || down to
+  unary and postfix ++/--, exponentiation (**, right-associative, binding
+  tighter than * but looser than unary minus, as in bash) and assignment
+  (=, +=, -=, *=, /=, %=). Names
+  stand for variables, read through their cached integers; unset ones
+  are 0.
+*/
+struct lsh_arith {
+    const char *p, *end;
+    const char *err;      // First error, or NULL
+};
+
+long long lsh_arith_assign(struct lsh_arith *a);
+
+/**
+   @brief Skip blanks and look at the next character.
+   @return The character, or '\0' at the end.
+ */
+char lsh_arith_peek(struct lsh_arith *a) {
+    while (a->p < a->end && (*a->p == ' ' || *a->p == '\t' || *a->p == '\n')) {
+        a->p++;
+    }
+    return a->p < a->end ? *a->p : '\0';
+}
+
+/**
+   @brief Consume an operator if it comes next.
+   @return 1 if it did.
+ */
+int lsh_arith_accept(struct lsh_arith *a, const char *op) {
+    size_t n = strlen(op);
+
+    lsh_arith_peek(a);
+    if ((size_t)(a->end - a->p) < n || memcmp(a->p, op, n) != 0) {
+        return 0;
+    }
+    // Assignment is not the start of a comparison.
+    if (strcmp(op, "=") == 0 && a->p + 1 < a->end && a->p[1] == '=') {
+        return 0;
+    }
+    a->p += n;
+    return 1;
+}
+
+/**
+   @brief Read the integer value of a variable for arithmetic.
+   @return The value (0 if unset or empty).
+ */
+long long lsh_arith_var(struct lsh_arith *a, const char *name, size_t len) {
+    struct lsh_var *v = lsh_var_find(name, len, 0);
+    size_t vlen;
+    long long n = 0;
+
+    if (!v) {
+        if (lsh_var_get(name, len, &vlen) == NULL) {
+            return 0;
+        }
+        v = lsh_var_find(name, len, 1); // Keep the environment value's integer too
+    }
+    if (lsh_var_num(v, &n) != 0 && v->value.len > 0 && !a->err) {
+        a->err = "value is not an integer";
+    }
+    return n;
+}
+
+/**
+   @brief Parse a number, a variable (with ++ or --) or a parenthesised
+          expression.
+ */
+long long lsh_arith_primary(struct lsh_arith *a) {
+    const char *name;
+    size_t len;
+    long long n;
+    char *end, buf[64];
+
+    if (lsh_arith_accept(a, "(")) {
+        n = lsh_arith_assign(a);
+        if (!lsh_arith_accept(a, ")") && !a->err) {
+            a->err = "missing ')'";
+        }
+        return n;
+    }
+    if (a->p < a->end && *a->p >= '0' && *a->p <= '9') {
+        len = a->end - a->p < (long)sizeof(buf) - 1 ? (size_t)(a->end - a->p) : sizeof(buf) - 1;
+        memcpy(buf, a->p, len);
+        buf[len] = '\0';
+        errno = 0;
+        n = strtoll(buf, &end, 0);
+        if (errno != 0 && !a->err) {
+            a->err = "number out of range";
+        }
+        a->p += end - buf;
+        return n;
+    }
+    if (a->p < a->end && (len = lsh_var_name_len(a->p)) > 0) {
+        // Names end at the expression's end even without a terminator.
+        name = a->p;
+        len = len < (size_t)(a->end - a->p) ? len : (size_t)(a->end - a->p);
+        a->p += len;
+        n = lsh_arith_var(a, name, len);
+        if (lsh_arith_accept(a, "++") || lsh_arith_accept(a, "--")) {
+            lsh_var_set_num(lsh_var_find(name, len, 1), a->p[-1] == '+' ? n + 1 : n - 1);
+        }
+        return n;
+    }
+    if (!a->err) {
+        a->err = a->p < a->end ? "syntax error" : "operand expected";
+    }
+    return 0;
+}
+
+/**
+   @brief Parse unary operators: - + ! ~ and prefix ++ / --.
+ */
+long long lsh_arith_unary(struct lsh_arith *a) {
+    size_t len;
+    long long n;
+
+    lsh_arith_peek(a);
+    if (a->end - a->p >= 2 && (memcmp(a->p, "++", 2) == 0 || memcmp(a->p, "--", 2) == 0)) {
+        int step = a->p[0] == '+' ? 1 : -1;
+        a->p += 2;
+        lsh_arith_peek(a);
+        if ((len = lsh_var_name_len(a->p)) == 0 || len > (size_t)(a->end - a->p)) {
+            a->err = a->err ? a->err : "variable expected";
+            return 0;
+        }
+        n = lsh_arith_var(a, a->p, len) + step;
+        lsh_var_set_num(lsh_var_find(a->p, len, 1), n);
+        a->p += len;
+        return n;
+    }
+    if (lsh_arith_accept(a, "-")) {
+        return -lsh_arith_unary(a);
+    }
+    if (lsh_arith_accept(a, "+")) {
+        return lsh_arith_unary(a);
+    }
+    if (lsh_arith_accept(a, "!")) {
+        return !lsh_arith_unary(a);
+    }
+    if (lsh_arith_accept(a, "~")) {
+        return ~lsh_arith_unary(a);
+    }
+    return lsh_arith_primary(a);
+}
+
+/**
+   @brief Parse one level of left-associative binary operators.
+   @param a Parser.
+   @param level 0 for ||, then &&, equality, relational, additive,
+                multiplicative and exponentiation.
+ */
+long long lsh_arith_binary(struct lsh_arith *a, int level) {
+    unsigned long long base, power;
+    long long l, r;
+
+    if (level == 6) {
+        l = lsh_arith_unary(a);
+        if (!lsh_arith_accept(a, "**")) {
+            return l;
+        }
+        r = lsh_arith_binary(a, 6);
+        if (r < 0) {
+            a->err = a->err ? a->err : "exponent less than 0";
+            return 0;
+        }
+        for (base = l, power = 1; r > 0; r >>= 1, base *= base) {
+            if (r & 1) {
+                power *= base;
+            }
+        }
+        return (long long)power;
+    }
+    l = lsh_arith_binary(a, level + 1);
+    while (1) {
+        if (level == 0 && lsh_arith_accept(a, "||")) {
+            r = lsh_arith_binary(a, level + 1);
+            l = l || r;
+        } else if (level == 1 && lsh_arith_accept(a, "&&")) {
+            r = lsh_arith_binary(a, level + 1);
+            l = l && r;
+        } else if (level == 2 && lsh_arith_accept(a, "==")) {
+            l = l == lsh_arith_binary(a, level + 1);
+        } else if (level == 2 && lsh_arith_accept(a, "!=")) {
+            l = l != lsh_arith_binary(a, level + 1);
+        } else if (level == 3 && lsh_arith_accept(a, "<=")) {
+            l = l <= lsh_arith_binary(a, level + 1);
+        } else if (level == 3 && lsh_arith_accept(a, ">=")) {
+            l = l >= lsh_arith_binary(a, level + 1);
+        } else if (level == 3 && lsh_arith_accept(a, "<")) {
+            l = l < lsh_arith_binary(a, level + 1);
+        } else if (level == 3 && lsh_arith_accept(a, ">")) {
+            l = l > lsh_arith_binary(a, level + 1);
+        } else if (level == 4 && lsh_arith_accept(a, "+")) {
+            l = (long long)((unsigned long long)l + (unsigned long long)lsh_arith_binary(a, level + 1));
+        } else if (level == 4 && lsh_arith_accept(a, "-")) {
+            l = (long long)((unsigned long long)l - (unsigned long long)lsh_arith_binary(a, level + 1));
+        } else if (level == 5 && lsh_arith_accept(a, "*")) {
+            l = (long long)((unsigned long long)l * (unsigned long long)lsh_arith_binary(a, level + 1));
+        } else if (level == 5 && (lsh_arith_accept(a, "/") || lsh_arith_accept(a, "%"))) {
+            char op = a->p[-1];
+            r = lsh_arith_binary(a, level + 1);
+            if (r == 0) {
+                a->err = a->err ? a->err : "division by zero";
+                return 0;
+            }
+            l = r == -1 ? (op == '/' ? (long long)(0 - (unsigned long long)l) : 0) : op == '/' ? l / r : l % r;
+        } else {
+            return l;
+        }
+    }
+}
+
+/**
+   @brief Parse an assignment (right-associative) or any lower expression.
+ */
+long long lsh_arith_assign(struct lsh_arith *a) {
+    static const char *ops[] = { "=", "+=", "-=", "*=", "/=", "%=" };
+    const char *start, *name;
+    size_t len;
+    long long n, r;
+
+    lsh_arith_peek(a);
+    start = a->p;
+    if ((len = lsh_var_name_len(a->p)) > 0 && len <= (size_t)(a->end - a->p)) {
+        name = a->p;
+        a->p += len;
+        for (int i = 0; i < 6; i++) {
+            if (lsh_arith_accept(a, ops[i])) {
+                r = lsh_arith_assign(a);
+                n = i == 0 ? r : lsh_arith_var(a, name, len);
+                switch (ops[i][0]) {
+                case '+': n = (long long)((unsigned long long)n + (unsigned long long)r); break;
+                case '-': n = (long long)((unsigned long long)n - (unsigned long long)r); break;
+                case '*': n = (long long)((unsigned long long)n * (unsigned long long)r); break;
+                case '/':
+                case '%':
+                    if (r == 0) {
+                        a->err = a->err ? a->err : "division by zero";
+                        return 0;
+                    }
+                    n = r == -1 ? (ops[i][0] == '/' ? (long long)(0 - (unsigned long long)n) : 0)
+                                : ops[i][0] == '/' ? n / r : n % r;
+                    break;
+                }
+                if (!a->err) {
+                    lsh_var_set_num(lsh_var_find(name, len, 1), n);
+                }
+                return n;
+            }
+        }
+        a->p = start;
+    }
+    return lsh_arith_binary(a, 0);
+}
+
+/**
+   @brief Evaluate an arithmetic expression.
+   @param s Expression (need not be NUL-terminated).
+   @param len Its length.
+   @param out Set to the value.
+   @return NULL on success, or a description of the error.
+ */
+const char *lsh_arith_eval(const char *s, size_t len, long long *out) {
+    struct lsh_arith a = { s, s + len, NULL };
+
+    *out = lsh_arith_assign(&a);
+    if (!a.err && lsh_arith_peek(&a) != '\0') {
+        a.err = "syntax error";
+    }
+    return a.err;
+}
+
+/**
+   @brief Find the end of $((...)).
+   @param p Points at the '$'.
+   @return Pointer to the first ')' of the closing "))", or NULL.
+ */
+const char *lsh_arith_close(const char *p) {
+    int depth = 0;
+
+    for (p += 3; *p; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            if (depth == 0) {
+                return p[1] == ')' ? p : NULL;
+            }
+            depth--;
+        }
+    }
+    return NULL;
+}
+
+int lsh_expand_word(const char *p, int dq, struct lsh_buf *out);
+
+/**
+   @brief Expand a variable reference: $name, ${name}, ${name:offset} or
+          ${name:offset:length}, ${name[i]}, ${name[@]}, ${#name},
+          ${#name[@]}, $? or $$, or arithmetic: $((expr)).
+   @param p Points at the '$'.
+   @param out Buffer to append the value to.
+   @return Position after the reference.
+ */
+const char *lsh_expand_ref(const char *p, struct lsh_buf *out) {
+    char num[32];
+    const char *name, *value, *close, *err;
+    size_t len, vlen = 0;
+    long long off = 0, count = -1, index = 0;
+    int all = 0;
+    char *end;
+
+    if (p[1] == '(' && p[2] == '(' && (close = lsh_arith_close(p)) != NULL) {
+        // Variables inside are expanded first, as text.
+        struct lsh_buf expr = { NULL, 0, 0 };
+        char *inner = strndup(p + 3, close - (p + 3));
+        long long n = 0;
+        if (!inner) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        lsh_expand_word(inner, 1, &expr);
+        if ((err = lsh_arith_eval(expr.data ? expr.data : "", expr.len, &n)) != NULL) {
+            fprintf(stderr, "lsh: %s: %s\n", inner, err);
+            lsh_status = 1;
+            lsh_expand_failed = 1;
+        }
+        free(inner);
+        free(expr.data);
+        lsh_buf_append(out, num, snprintf(num, sizeof(num), "%lld", n));
+        return close + 2;
+    }
+    if (p[1] == '?' || p[1] == '$') {
+        len = snprintf(num, sizeof(num), "%d", p[1] == '?' ? lsh_status : (int)getpid());
+        lsh_buf_append(out, num, len);
+        return p + 2;
+    }
+    if (p[1] != '{') {
+        if ((len = lsh_var_name_len(p + 1)) == 0) {
+            lsh_buf_append(out, "$", 1);
+            return p + 1;
+        }
+        if ((value = lsh_var_get(p + 1, len, &vlen)) != NULL) {
+            lsh_buf_append(out, value, vlen);
+        }
+        return p + 1 + len;
+    }
+
+    // ${#name} is a length and ${name[i]} an element; ${name[@]} joins all.
+    name = p + 2 + (p[2] == '#');
+    len = lsh_var_name_len(name);
+    end = (char *)name + len;
+    if (len > 0 && *end == '[' && (close = strchr(end, ']')) != NULL) {
+        if (close == end + 2 && (end[1] == '@' || end[1] == '*')) {
+            all = 1;
+        } else if ((err = lsh_arith_eval(end + 1, close - end - 1, &index)) != NULL || index < 0) {
+            fprintf(stderr, "lsh: %.*s: %s\n", (int)(close - end - 1), end + 1, err ? err : "bad array index");
+            lsh_status = 1;
+            lsh_expand_failed = 1;
+            index = -1;
+        }
+        end = (char *)close + 1;
+    }
+    if (len > 0 && p[2] != '#' && *end == ':') {
+        off = strtoll(end + 1, &end, 10);
+        if (*end == ':') {
+            count = strtoll(end + 1, &end, 10);
+        }
+    }
+    if (len == 0 || *end != '}' || off < 0 || (count < 0 && count != -1)) {
+        lsh_buf_append(out, "$", 1); // Not a reference we know: keep it as text
+        return p + 1;
+    }
+    if (p[2] == '#') {
+        vlen = 0;
+        if (all) {
+            vlen = lsh_var_elem_count(name, len);
+        } else if (index >= 0) {
+            lsh_var_elem(name, len, index, &vlen);
+        }
+        lsh_buf_append(out, num, snprintf(num, sizeof(num), "%zu", vlen));
+        return end + 1;
+    }
+    for (size_t i = all ? 0 : (size_t)index; index >= 0 && (all || i == (size_t)index); i++) {
+        if ((value = lsh_var_elem(name, len, i, &vlen)) == NULL) {
+            if (all && i < lsh_var_elem_count(name, len)) {
+                continue; // An unset group of a match
+            }
+            break;
+        }
+        if (all && i > 0) {
+            lsh_buf_append(out, " ", 1);
+        }
+        if ((size_t)off < vlen) {
+            vlen -= off;
+            lsh_buf_append(out, value + off, count >= 0 && (size_t)count < vlen ? (size_t)count : vlen);
+        }
+    }
+    return end + 1;
+}
+
+/**
+   @brief Expand one word: remove quotes and replace variable references
+          outside single quotes.
+   @param p Raw word.
+   @param dq Start as if inside double quotes.
+   @param out Buffer to append the result to.
+   @return Nonzero if the word had quotes.
+ */
+int lsh_expand_word(const char *p, int dq, struct lsh_buf *out) {
+    int sq = 0, quoted = dq;
+    size_t n;
+
+    // A quote with no partner is an ordinary character, as when splitting.
+    while (*p) {
+        if (*p == '\'' && !dq && (sq || strchr(p + 1, '\''))) {
+            sq = !sq;
+            quoted = 1;
+            p++;
+        } else if (*p == '"' && !sq && (dq || strchr(p + 1, '"'))) {
+            dq = !dq;
+            quoted = 1;
+            p++;
+        } else if (*p == '$' && !sq) {
+            p = lsh_expand_ref(p, out);
+        } else {
+            n = strcspn(p + 1, sq ? "'" : "'\"$") + 1;
+            lsh_buf_append(out, p, n);
+            p += n;
+        }
+    }
+    return quoted;
+}
+
+/**
+   @brief Run a line made only of name=value words as assignments.
+   @param args Raw words of the line.
+   @return 1 if the line was assignments, 0 if it is a command.
+ */
+int lsh_assign(char **args) {
+    static struct lsh_buf value;
+    struct lsh_var *v;
+    const char *raw, *ref, *err;
+    long long num;
+    size_t n;
+    int i, dq, append;
+
+    for (i = 0; args[i] != NULL; i++) {
+        if ((n = lsh_var_name_len(args[i])) == 0 || args[i][n] != '=') {
+            return 0;
+        }
+    }
+
+    lsh_status = 0;
+    for (i = 0; args[i] != NULL; i++) {
+        n = lsh_var_name_len(args[i]);
+        raw = args[i] + n + 1;
+        // name=$((expr)) with no expansions inside stores just the integer.
+        if (raw[0] == '$' && raw[1] == '(' && raw[2] == '(' && (ref = lsh_arith_close(raw)) != NULL &&
+            ref[2] == '\0' && memchr(raw + 3, '$', ref - raw - 3) == NULL) {
+            if ((err = lsh_arith_eval(raw + 3, ref - raw - 3, &num)) != NULL) {
+                fprintf(stderr, "lsh: %.*s: %s\n", (int)(ref - raw - 3), raw + 3, err);
+                lsh_status = 1;
+                return 1;
+            }
+            lsh_var_set_num(lsh_var_find(args[i], n, 1), num);
+            continue;
+        }
+        // name=$name..., name="$name..." or with ${name}: append the rest.
+        dq = raw[0] == '"';
+        ref = raw + dq;
+        append = 0;
+        if (ref[0] == '$' && ref[1] == '{' && strncmp(ref + 2, args[i], n) == 0 && ref[2 + n] == '}') {
+            raw = ref + n + 3;
+            append = 1;
+        } else if (ref[0] == '$' && strncmp(ref + 1, args[i], n) == 0 && lsh_var_name_len(ref + 1) == n) {
+            raw = ref + n + 1;
+            append = 1;
+        } else {
+            dq = 0;
+        }
+        // Expanded aside first: the rest may refer to the variable itself.
+        // The variable is looked up after, as arithmetic may add others.
+        value.len = 0;
+        lsh_expand_word(raw, dq, &value);
+        if (lsh_expand_failed) {
+            return 1; // The error set $?; the variable keeps its value
+        }
+        v = lsh_var_find(args[i], n, 1);
+        lsh_var_sync(v);
+        v->num_ok = 0;
+        v->array = 0;
+        if (!append) {
+            v->value.len = 0;
+        }
+        lsh_buf_append(&v->value, value.data, value.len);
+        lsh_buf_append(&v->value, "", 1);
+        v->value.len--;
+    }
+    return 1;
+}
+
+/**
+   @brief Expand the words of a command. A failed expansion, such as a
+          bad $((...)), sets lsh_expand_failed and the command should not
+          run.
+   @param args Raw words.
+   @return Newly allocated argument list (one block, strings behind the
+           pointers), or NULL if no word needs expanding.
+ */
+char **lsh_expand_args(char **args) {
+    struct lsh_buf block = { NULL, 0, 0 };
+    char **argv;
+    size_t head, at;
+    int i, argc, found = 0;
+
+    for (argc = 0; args[argc] != NULL; argc++) {
+        found |= strpbrk(args[argc], "$'\"") != NULL;
+    }
+    if (!found) {
+        return NULL;
+    }
+
+    // Pointers first, filled in once the strings have stopped moving.
+    head = (argc + 1) * sizeof(char *);
+    block.cap = head + 256;
+    if ((block.data = malloc(block.cap)) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    block.len = head;
+    for (i = 0; i < argc; i++) {
+        at = block.len;
+        // An unquoted word that expands to nothing is dropped.
+        if (lsh_expand_word(args[i], 0, &block) || block.len > at) {
+            lsh_buf_append(&block, "", 1);
+        }
+    }
+    argv = (char **)block.data;
+    argc = 0;
+    for (at = head; at < block.len; at += strlen(block.data + at) + 1) {
+        argv[argc++] = block.data + at;
+    }
+    argv[argc] = NULL;
+    return argv;
+}
+
+/**
+   @brief Put the current values of variables that came from the
+          environment back into it, for a child about to exec or for
+          cachedsource to start from.
+ */
+void lsh_var_child_env(void) {
+    const char *env;
+
+    for (size_t i = 0; i < lsh_var_cap; i++) {
+        if (lsh_vars[i].name && lsh_vars[i].exported) {
+            lsh_var_sync(&lsh_vars[i]);
+            env = getenv(lsh_vars[i].name);
+            if (env == NULL || strcmp(env, lsh_vars[i].value.data) != 0) {
+                setenv(lsh_vars[i].name, lsh_vars[i].value.data, 1);
+            }
+        }
+    }
+}
+
+/**
+   @brief Builtin command: evaluate arithmetic expressions.
+   @param args List of args: expressions such as i+=1 or "n = n * 2".
+   @return Always returns 1 to continue executing. The status is 0 if the
+           last expression is nonzero, 1 if it is zero or on error.
+ */
+int lsh_let(char **args) {
+    const char *err;
+    long long n = 0;
+
+    lsh_status = 1;
+    if (args[1] == NULL) {
+        fprintf(stderr, "lsh: expected argument to \"let\"\n");
+        return 1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        if ((err = lsh_arith_eval(args[i], strlen(args[i]), &n)) != NULL) {
+            fprintf(stderr, "lsh: let: %s: %s\n", args[i], err);
+            return 1;
+        }
+    }
+    lsh_status = n == 0;
+    return 1;
+}
+
+/**
+   @brief Evaluate a test expression.
+   @param a Words of the expression.
+   @param n Number of words.
+   @return 0 if true, 1 if false, 2 on error.
+ */
+int lsh_test_expr(char **a, int n) {
+    static const char *num_ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+    struct stat st;
+    long long l, r;
+    const char *err;
+    int i;
+
+    if (n > 0 && strcmp(a[0], "!") == 0) {
+        i = lsh_test_expr(a + 1, n - 1);
+        return i == 2 ? 2 : !i;
+    }
+    if (n == 0) {
+        return 1;
+    }
+    if (n == 1) {
+        return a[0][0] == '\0';
+    }
+    if (n == 2 && a[0][0] == '-' && a[0][1] != '\0' && a[0][2] == '\0') {
+        switch (a[0][1]) {
+        case 'n': return a[1][0] == '\0';
+        case 'z': return a[1][0] != '\0';
+        case 'e': return stat(a[1], &st) != 0;
+        case 'f': return stat(a[1], &st) != 0 || !S_ISREG(st.st_mode);
+        case 'd': return stat(a[1], &st) != 0 || !S_ISDIR(st.st_mode);
+        case 's': return stat(a[1], &st) != 0 || st.st_size == 0;
+        case 'h':
+        case 'L': return lstat(a[1], &st) != 0 || !S_ISLNK(st.st_mode);
+        case 'r': return access(a[1], R_OK) != 0;
+        case 'w': return access(a[1], W_OK) != 0;
+        case 'x': return access(a[1], X_OK) != 0;
+        }
+    }
+    if (n == 3) {
+        if (strcmp(a[1], "=") == 0 || strcmp(a[1], "==") == 0) {
+            return strcmp(a[0], a[2]) != 0;
+        } else if (strcmp(a[1], "!=") == 0) {
+            return strcmp(a[0], a[2]) == 0;
+        }
+        for (i = 0; i < 6 && strcmp(a[1], num_ops[i]) != 0; i++);
+        if (i < 6) {
+            // Operands are arithmetic, so a variable's cached integer is used
+            // as is: "test i -lt 10".
+            if ((err = lsh_arith_eval(a[0], strlen(a[0]), &l)) != NULL ||
+                (err = lsh_arith_eval(a[2], strlen(a[2]), &r)) != NULL) {
+                fprintf(stderr, "lsh: test: %s\n", err);
+                return 2;
+            }
+            switch (i) {
+            case 0: return !(l == r);
+            case 1: return !(l != r);
+            case 2: return !(l < r);
+            case 3: return !(l <= r);
+            case 4: return !(l > r);
+            default: return !(l >= r);
+            }
+        }
+    }
+    fprintf(stderr, "lsh: test: bad expression\n");
+    return 2;
+}
+
+/**
+   @brief Builtin command: evaluate a condition, as test or [ ... ].
+   @param args List of args: the expression. Numeric comparisons (-eq,
+               -ne, -lt, -le, -gt, -ge) take arithmetic expressions.
+   @return Always returns 1 to continue executing. The status is 0 if the
+           condition holds, 1 if not and 2 on error.
+ */
+int lsh_test(char **args) {
+    int argc;
+
+    for (argc = 0; args[argc] != NULL; argc++);
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[argc - 1], "]") != 0) {
+            fprintf(stderr, "lsh: [: missing ']'\n");
+            lsh_status = 2;
+            return 1;
+        }
+        argc--;
+    }
+    lsh_status = lsh_test_expr(args + 1, argc - 1);
+    return 1;
+}
+
+/*
+  Compiled regular expressions for [[ =~ ]], least recently used first out.
+  A pattern matched in a loop is compiled once.
+*/
+#define LSH_REGEX_CACHE 32
+
+struct lsh_regex {
+    char *pattern;        // NULL if the slot is free
+    uint64_t hash;
+    int flags;            // regcomp flags it was compiled with
+    uint64_t used;        // Lookup tick of the last use
+    regex_t re;
+};
+
+struct lsh_regex lsh_regex_cache[LSH_REGEX_CACHE];
+uint64_t lsh_regex_tick = 0;
+
+/**
+   @brief Get a compiled regular expression from the cache, compiling it
+          if need be.
+   @param pattern Pattern.
+   @param flags regcomp flags.
+   @param err Set to a description of a bad pattern.
+   @param errlen Size of err.
+   @return The expression, or NULL if the pattern does not compile.
+ */
+regex_t *lsh_regex_get(const char *pattern, int flags, char *err, size_t errlen) {
+    uint64_t hash = lsh_hash(pattern, strlen(pattern));
+    struct lsh_regex *slot = &lsh_regex_cache[0];
+    regex_t re;
+    int rc;
+
+    for (int i = 0; i < LSH_REGEX_CACHE; i++) {
+        struct lsh_regex *r = &lsh_regex_cache[i];
+        if (r->pattern && r->hash == hash && r->flags == flags && strcmp(r->pattern, pattern) == 0) {
+            r->used = ++lsh_regex_tick;
+            return &r->re;
+        }
+        // Free slots first, then the one used longest ago.
+        if (slot->pattern && (!r->pattern || r->used < slot->used)) {
+            slot = r;
+        }
+    }
+
+    if ((rc = regcomp(&re, pattern, flags)) != 0) {
+        regerror(rc, &re, err, errlen);
+        return NULL;
+    }
+    if (slot->pattern) {
+        regfree(&slot->re);
+        free(slot->pattern);
+    }
+    if ((slot->pattern = strdup(pattern)) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    slot->hash = hash;
+    slot->flags = flags;
+    slot->used = ++lsh_regex_tick;
+    slot->re = re;
+    return &slot->re;
+}
+
+/**
+   @brief Match a string against an extended regular expression, setting
+          BASH_REMATCH to the match and its groups.
+   @param str Subject.
+   @param pattern Pattern.
+   @return 0 on a match, 1 if none, 2 for a bad pattern.
+ */
+int lsh_regex_match(const char *str, const char *pattern) {
+    struct lsh_var *v;
+    regmatch_t *m;
+    regex_t *re;
+    char err[256];
+    size_t n, slice[2];
+
+    if ((re = lsh_regex_get(pattern, REG_EXTENDED, err, sizeof(err))) == NULL) {
+        fprintf(stderr, "lsh: [[: %s: %s\n", pattern, err);
+        return 2;
+    }
+    n = re->re_nsub + 1;
+    if ((m = malloc(n * sizeof(regmatch_t))) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    v = lsh_var_find("BASH_REMATCH", 12, 1);
+    v->num_ok = 0;
+    v->str_stale = 0;
+    v->value.len = 0;
+    v->elems.len = 0;
+    v->array = 1;
+    if (regexec(re, str, n, m, 0) != 0) {
+        lsh_buf_append(&v->value, "", 1);
+        v->value.len = 0;
+        free(m);
+        return 1;
+    }
+
+    // The subject is kept once; groups are slices of it.
+    lsh_buf_append(&v->value, str, strlen(str) + 1);
+    v->value.len--;
+    for (size_t i = 0; i < n; i++) {
+        slice[0] = m[i].rm_so < 0 ? (size_t)-1 : (size_t)m[i].rm_so;
+        slice[1] = m[i].rm_so < 0 ? 0 : (size_t)(m[i].rm_eo - m[i].rm_so);
+        lsh_buf_append(&v->elems, (char *)slice, sizeof(slice));
+    }
+    free(m);
+    return 0;
+}
+
+/**
+   @brief Builtin command: evaluate a condition, as [[ ... ]].
+   @param args List of args: the expression then "]]". Besides what test
+               takes, str =~ regex matches an extended regular expression
+               (groups go to ${BASH_REMATCH[n]}), and == and != match
+               glob patterns.
+   @return Always returns 1 to continue executing. The status is 0 if the
+           condition holds, 1 if not and 2 on error.
+ */
+int lsh_dbracket(char **args) {
+    int argc;
+
+    for (argc = 0; args[argc] != NULL; argc++);
+    if (strcmp(args[argc - 1], "]]") != 0) {
+        fprintf(stderr, "lsh: [[: missing ']]'\n");
+        lsh_status = 2;
+        return 1;
+    }
+    args++;
+    argc -= 2;
+    if (argc == 3 && strcmp(args[1], "=~") == 0) {
+        lsh_status = lsh_regex_match(args[0], args[2]);
+    } else if (argc == 3 && (strcmp(args[1], "==") == 0 || strcmp(args[1], "=") == 0)) {
+        lsh_status = fnmatch(args[2], args[0], 0) != 0;
+    } else if (argc == 3 && strcmp(args[1], "!=") == 0) {
+        lsh_status = fnmatch(args[2], args[0], 0) == 0;
+    } else {
+        lsh_status = lsh_test_expr(args, argc);
+    }
+    return 1;
+}
+
+/**
+   @brief Start a program in a child process.
+   @param args Null terminated list of arguments (including program).
+   @param dir Directory to run it in, or NULL for the current one.
+   @param out_fd Descriptor for its stdout and stderr, or -1 to inherit.
+   @return Child pid, or -1 if fork failed.
+ */
+pid_t lsh_spawn(char **args, const char *dir, int out_fd) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // Child process
+        if (out_fd >= 0) {
+            dup2(out_fd, STDOUT_FILENO);
+            dup2(out_fd, STDERR_FILENO);
+            close(out_fd);
+        }
+        if (dir != NULL && chdir(dir) != 0) {
+            perror("lsh");
+            exit(EXIT_FAILURE);
+        }
+        lsh_trace_child_env();
+        lsh_var_child_env();
+        if (execvp(args[0], args) == -1) {
+            perror("lsh");
+        }
+        exit(EXIT_FAILURE);
+    } else if (pid < 0) {
+        // Error forking
+        perror("lsh");
+    }
+    return pid;
+}
+
+/**
+   @brief Turn a wait status into a shell exit status.
+   @param status Wait status, or -1 if the command never ran.
+   @return The exit code, 128 plus the signal number, or 1.
+ */
+int lsh_exit_code(int status) {
+    if (status == -1) {
+        return 1;
+    }
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/**
+   @brief Wait for a child started by lsh_spawn to finish.
+   @param pid Child pid.
+   @param usage Filled with the child's resource usage, or NULL.
+   @return Its wait status.
+ */
+int lsh_wait(pid_t pid, struct rusage *usage) {
+    struct rusage ru;
+    int status;
+
+    do {
+        if (wait4(pid, &status, WUNTRACED, &ru) < 0 && errno != EINTR) {
+            return -1;
+        }
+    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    if (usage != NULL) {
+        *usage = ru;
+    }
+    return status;
+}
+
+/*
+  Subreaper mode. With it on, orphaned descendants of commands (daemons,
+  abandoned grandchildren) are reparented to the shell instead of init,
+  and the shell reaps them. Every process it reaps is charged to the
+  command it came from: direct children by pid, orphans by their start
+  time, which falls within the run of the command that created them.
+  Start times are in 10ms ticks, so within a tick the pid decides: pids
+  are handed out in increasing order.
+  Peak memory is the largest peak RSS of any single process in the tree.
+*/
+#define LSH_TREE_HISTORY 64 // Commands remembered for accounting
+
+struct lsh_tree_cmd {
+    char name[64];
+    unsigned long long start, end; // Clock ticks since boot; end 0 while running
+    pid_t pid;                     // First process started for it
+    struct timeval cpu;            // User plus system time of the tree
+    long peak_kb;
+    int procs;                     // Processes reaped so far
+};
+
+struct lsh_tree {
+    int on;
+    struct lsh_tree_cmd cmds[LSH_TREE_HISTORY]; // Ring, oldest overwritten
+    long count;                                 // Commands recorded in total
+} lsh_tree;
+
+/**
+   @brief The time now, in the clock ticks /proc uses for start times.
+ */
+unsigned long long lsh_tree_ticks(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * (unsigned long long)sysconf(_SC_CLK_TCK) +
+           ts.tv_nsec / (1000000000 / sysconf(_SC_CLK_TCK));
+}
+
+/**
+   @brief When a process (possibly a zombie) started.
+   @param pid Process id.
+   @return Start time in clock ticks since boot, or 0 if unknown.
+ */
+unsigned long long lsh_tree_proc_start(pid_t pid) {
+    char path[64], text[1024], *p;
+    unsigned long long start = 0;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return 0;
+    }
+    n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    text[n] = '\0';
+    // The command name is in parentheses and may hold spaces; start time
+    // is the 20th field after it.
+    if ((p = strrchr(text, ')')) != NULL) {
+        p++;
+        for (int field = 0; field < 19 && p != NULL; field++) {
+            p = strchr(p + 1, ' ');
+        }
+        if (p != NULL) {
+            start = strtoull(p + 1, NULL, 10);
+        }
+    }
+    return start;
+}
+
+/**
+   @brief Start accounting for a command.
+   @param name Command name.
+   @return Its record, or NULL when subreaper mode is off.
+ */
+struct lsh_tree_cmd *lsh_tree_begin(const char *name) {
+    struct lsh_tree_cmd *cmd;
+
+    if (!lsh_tree.on) {
+        return NULL;
+    }
+    cmd = &lsh_tree.cmds[lsh_tree.count++ % LSH_TREE_HISTORY];
+    memset(cmd, 0, sizeof(*cmd));
+    snprintf(cmd->name, sizeof(cmd->name), "%s", name);
+    cmd->start = lsh_tree_ticks();
+    return cmd;
+}
+
+/**
+   @brief Charge a reaped process to a command.
+   @param cmd Command, or NULL to pick it by the process's start time.
+   @param pid Process id.
+   @param start Process start time (ticks since boot).
+   @param ru Its resource usage.
+ */
+void lsh_tree_charge(struct lsh_tree_cmd *cmd, pid_t pid, unsigned long long start, const struct rusage *ru) {
+    // Newest first: the latest command that had started by then.
+    for (long i = lsh_tree.count - 1; cmd == NULL && i >= 0 && i >= lsh_tree.count - LSH_TREE_HISTORY; i--) {
+        struct lsh_tree_cmd *c = &lsh_tree.cmds[i % LSH_TREE_HISTORY];
+        if (c->start < start || (c->start == start && c->pid > 0 && c->pid <= pid)) {
+            cmd = c;
+        }
+    }
+    if (cmd == NULL) {
+        return; // From before accounting began, or long forgotten
+    }
+    timeradd(&cmd->cpu, &ru->ru_utime, &cmd->cpu);
+    timeradd(&cmd->cpu, &ru->ru_stime, &cmd->cpu);
+    if (ru->ru_maxrss > cmd->peak_kb) {
+        cmd->peak_kb = ru->ru_maxrss;
+    }
+    cmd->procs++;
+}
+
+/**
+   @brief Reap children, charging each to its command, until the given
+          ones have all exited; with none given, reap only what has
+          already exited.
+   @param cmd Command that pids belong to.
+   @param pids Direct children to wait for (entries <= 0 are skipped).
+   @param n Number of pids.
+   @param status Set to the wait status of the last of pids, or NULL.
+ */
+void lsh_tree_wait(struct lsh_tree_cmd *cmd, pid_t *pids, int n, int *status) {
+    unsigned long long start;
+    struct rusage ru;
+    siginfo_t info;
+    int left = 0, st, mine;
+    pid_t pid;
+
+    for (int i = 0; i < n; i++) {
+        left += pids[i] > 0;
+        if (pids[i] > 0 && (cmd->pid == 0 || pids[i] < cmd->pid)) {
+            cmd->pid = pids[i];
+        }
+    }
+    while (1) {
+        // Peek first: the start time is only readable before the reap.
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT | (left > 0 ? 0 : WNOHANG)) != 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; // No children at all
+        }
+        if (info.si_pid == 0) {
+            break;
+        }
+        pid = info.si_pid;
+        start = lsh_tree_proc_start(pid);
+        if (wait4(pid, &st, 0, &ru) != pid) {
+            continue;
+        }
+        mine = 0;
+        for (int i = 0; i < n; i++) {
+            if (pids[i] == pid) {
+                mine = 1;
+                left--;
+                if (status != NULL && pid == pids[n - 1]) {
+                    *status = st;
+                }
+            }
+        }
+        lsh_tree_charge(mine ? cmd : NULL, pid, start, &ru);
+    }
+    if (cmd != NULL && n > 0) {
+        cmd->end = lsh_tree_ticks();
+    }
+}
+
+/**
+   @brief Builtin command: turn subreaper mode on or off, or report what
+          the process trees of recent commands used.
+   @param args List of args. args[1] is "on", "off" or absent.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_subreaper(char **args) {
+    char line[160];
+    int len;
+
+    if (args[1] != NULL) {
+        int on = strcmp(args[1], "on") == 0;
+        if (!on && strcmp(args[1], "off") != 0) {
+            fprintf(stderr, "lsh: subreaper: expected on or off\n");
+        } else if (prctl(PR_SET_CHILD_SUBREAPER, on, 0, 0, 0) != 0) {
+            perror("lsh: subreaper");
+        } else {
+            lsh_tree.on = on;
+        }
+        return 1;
+    }
+
+    // Pick up orphans that finished since the last command.
+    lsh_tree_wait(NULL, NULL, 0, NULL);
+    for (long i = lsh_tree.count > LSH_TREE_HISTORY ? lsh_tree.count - LSH_TREE_HISTORY : 0; i < lsh_tree.count; i++) {
+        struct lsh_tree_cmd *cmd = &lsh_tree.cmds[i % LSH_TREE_HISTORY];
+        len = snprintf(line, sizeof(line), "%s\t%d procs\tcpu %ld.%03lds\tpeak %ldK\n", cmd->name, cmd->procs,
+                       (long)cmd->cpu.tv_sec, (long)cmd->cpu.tv_usec / 1000, cmd->peak_kb);
+        lsh_out_write(line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+    }
+    lsh_out_flush();
+    return 1;
+}
+
+/**
+  @brief Launch a program and wait for it to terminate.
+  @param args Null terminated list of arguments (including program).
+  @return Always returns 1, to continue execution.
+ */
+int lsh_launch(char **args) {
+    struct lsh_tree_cmd *cmd = lsh_tree_begin(args[0]);
+    pid_t pid = lsh_spawn(args, NULL, -1);
+    int status = -1;
+
+    if (cmd != NULL) {
+        lsh_tree_wait(cmd, &pid, 1, &status);
+    } else if (pid > 0) {
+        status = lsh_wait(pid, NULL);
+    }
+    lsh_status = lsh_exit_code(status);
+    return 1;
+}
+
+/*
+  The job spool is a directory that outlives the shells using it:
+
+    tmp/      files being written, renamed into place when complete
+    pending/  queued jobs, one file each, named by zero-padded job id
+    running/  jobs a runner has claimed (mtime is the start time)
+    done/     finished jobs, with their exit status appended
+    out/      combined stdout and stderr of each job
+
+  Every state change is a rename, so a crash leaves each job in exactly
+  one state. Job ids come from a counter file under an flock, and a
+  runner holds runner.lock for as long as it serves the spool.
+*/
+#define LSH_SPOOL_IDLE_MS 2000 // A runner exits after this long with nothing to do
+
+/*
+  A job as stored in its file: "key value" lines, the command as one
+  "arg" line per argument.
+*/
+struct lsh_spool_job {
+    long id;
+    struct lsh_buf text;  // File contents
+    struct lsh_buf fields; // A copy split into lines and unescaped in place
+    const char *cwd;
+    const char *out;
+    long long mem;        // Declared memory footprint in bytes, or 0
+    char **argv;
+    int argc;
+    const char *status;   // Set once the job is done
+};
+
+/**
+   @brief Find (and create) the spool directory.
+   @return Its path: $MYSHELL_SPOOL, or ~/.myshell_spool.
+ */
+const char *lsh_spool_dir(void) {
+    static char dir[PATH_MAX];
+    const char *sub[] = { "tmp", "pending", "running", "done", "out" };
+    char path[PATH_MAX + 16];
+
+    if (dir[0] == '\0') {
+        if (getenv("MYSHELL_SPOOL") != NULL) {
+            snprintf(dir, sizeof(dir), "%s", getenv("MYSHELL_SPOOL"));
+        } else {
+            snprintf(dir, sizeof(dir), "%s/.myshell_spool", getenv("HOME") ? getenv("HOME") : "/tmp");
+        }
+        mkdir(dir, 0700);
+        for (int i = 0; i < (int)(sizeof(sub) / sizeof(sub[0])); i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, sub[i]);
+            mkdir(path, 0700);
+        }
+    }
+    return dir;
+}
+
+/**
+   @brief Build the path of a file in the spool.
+   @param path Buffer of PATH_MAX bytes.
+   @param state Subdirectory, or NULL for the spool itself.
+   @param id Job id, or -1 for state to name a plain file.
+   @return path.
+ */
+char *lsh_spool_path(char *path, const char *state, long id) {
+    if (id < 0) {
+        snprintf(path, PATH_MAX, "%s/%s", lsh_spool_dir(), state);
+    } else {
+        snprintf(path, PATH_MAX, "%s/%s/%010ld", lsh_spool_dir(), state, id);
+    }
+    return path;
+}
+
+/**
+   @brief Durably write a job file and move it into a state directory.
+   @param state Destination subdirectory.
+   @param id Job id, or -1 for state to name a plain file.
+   @param data File contents.
+   @param len Length of data.
+   @return 0 on success, -1 on error.
+ */
+int lsh_spool_commit(const char *state, long id, const char *data, size_t len) {
+    char tmp[PATH_MAX], dest[PATH_MAX];
+    int fd, rc = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s/tmp/%010ld.%d", lsh_spool_dir(), id, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        return -1;
+    }
+    if (lsh_write_all(fd, data, len) != 0 || fsync(fd) != 0) {
+        rc = -1;
+    }
+    close(fd);
+    if (rc == 0 && rename(tmp, lsh_spool_path(dest, state, id)) != 0) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        unlink(tmp);
+    }
+    return rc;
+}
+
+/**
+   @brief Add a "key value" line to a job file, escaping newlines and
+          backslashes in the value so that it stays on one line.
+   @param text Job file text.
+   @param key Key, with its trailing space.
+   @param value Value.
+ */
+void lsh_spool_put(struct lsh_buf *text, const char *key, const char *value) {
+    lsh_buf_append(text, key, strlen(key));
+    for (const char *p = value; *p; p++) {
+        if (*p == '\n') {
+            lsh_buf_append(text, "\\n", 2);
+        } else if (*p == '\\') {
+            lsh_buf_append(text, "\\\\", 2);
+        } else {
+            lsh_buf_append(text, p, 1);
+        }
+    }
+    lsh_buf_append(text, "\n", 1);
+}
+
+/**
+   @brief Undo the escapes of lsh_spool_put in place.
+   @param s Line.
+ */
+void lsh_spool_unescape(char *s) {
+    char *out = s;
+
+    for (; *s; s++) {
+        if (*s == '\\' && (s[1] == 'n' || s[1] == '\\')) {
+            *out++ = *++s == 'n' ? '\n' : '\\';
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+/**
+   @brief Read and parse a job file.
+   @param state Subdirectory holding it.
+   @param id Job id.
+   @param job Filled in; release with lsh_spool_job_free.
+   @return 0 on success, -1 if the job is not there.
+ */
+int lsh_spool_job_read(const char *state, long id, struct lsh_spool_job *job) {
+    char path[PATH_MAX], chunk[4096], *line, *next;
+    ssize_t n;
+    int fd, argcap = 0;
+
+    memset(job, 0, sizeof(*job));
+    job->id = id;
+    if ((fd = open(lsh_spool_path(path, state, id), O_RDONLY)) < 0) {
+        return -1;
+    }
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+        lsh_buf_append(&job->text, chunk, n);
+    }
+    close(fd);
+    lsh_buf_append(&job->text, "", 1);
+    job->text.len--;
+    lsh_buf_append(&job->fields, job->text.data, job->text.len + 1);
+
+    for (line = job->fields.data; *line; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        } else {
+            next = line + strlen(line);
+        }
+        lsh_spool_unescape(line);
+        if (strncmp(line, "cwd ", 4) == 0) {
+            job->cwd = line + 4;
+        } else if (strncmp(line, "out ", 4) == 0) {
+            job->out = line + 4;
+        } else if (strncmp(line, "mem ", 4) == 0) {
+            job->mem = atoll(line + 4);
+        } else if (strncmp(line, "status ", 7) == 0) {
+            job->status = line + 7;
+        } else if (strncmp(line, "arg ", 4) == 0) {
+            if (job->argc + 1 >= argcap) {
+                argcap = argcap ? argcap * 2 : 8;
+                if ((job->argv = realloc(job->argv, argcap * sizeof(char *))) == NULL) {
+                    fprintf(stderr, "lsh: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            job->argv[job->argc++] = line + 4;
+            job->argv[job->argc] = NULL;
+        }
+    }
+    return job->argc > 0 ? 0 : -1;
+}
+
+/**
+   @brief Release a job read by lsh_spool_job_read.
+   @param job Job.
+ */
+void lsh_spool_job_free(struct lsh_spool_job *job) {
+    free(job->text.data);
+    free(job->fields.data);
+    free(job->argv);
+}
+
+/**
+   @brief Compare job ids for qsort.
+ */
+int lsh_spool_id_cmp(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+   @brief List the jobs in one state, oldest first.
+   @param state Subdirectory.
+   @param n Set to the number of jobs.
+   @return Array of job ids (free it), or NULL if there are none.
+ */
+long *lsh_spool_list(const char *state, int *n) {
+    char path[PATH_MAX], *end;
+    struct dirent *entry;
+    long *ids = NULL, id;
+    int cap = 0;
+    DIR *d;
+
+    *n = 0;
+    if ((d = opendir(lsh_spool_path(path, state, -1))) == NULL) {
+        return NULL;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        id = strtol(entry->d_name, &end, 10);
+        if (entry->d_name[0] == '.' || *end != '\0') {
+            continue;
+        }
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 64;
+            if ((ids = realloc(ids, cap * sizeof(long))) == NULL) {
+                fprintf(stderr, "lsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ids[(*n)++] = id;
+    }
+    closedir(d);
+    if (*n > 1) {
+        qsort(ids, *n, sizeof(long), lsh_spool_id_cmp);
+    }
+    return ids;
+}
+
+/**
+   @brief Take the next job id from the spool's counter.
+   @return The id, or -1 on error.
+ */
+long lsh_spool_next_id(void) {
+    char path[PATH_MAX], text[32];
+    long id = 0;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(lsh_spool_path(path, "next", -1), O_RDWR | O_CREAT, 0600)) < 0) {
+        return -1;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return -1;
+    }
+    if ((n = pread(fd, text, sizeof(text) - 1, 0)) > 0) {
+        text[n] = '\0';
+        id = atol(text);
+    }
+    n = snprintf(text, sizeof(text), "%ld\n", id + 1);
+    if (pwrite(fd, text, n, 0) != n || ftruncate(fd, n) != 0) {
+        id = -1;
+    }
+    close(fd); // Drops the lock
+    return id;
+}
+
+/**
+   @brief Start a runner for the spool in the background, detached from
+          this shell. It exits at once if another runner is active.
+   @param slots Number of jobs to run at a time (0 for one per CPU).
+   @param budget Memory the jobs may use together (0 for what is free).
+ */
+void lsh_spool_start_runner(int slots, long long budget) {
+    char nslots[16], nbudget[32];
+    pid_t pid;
+    int fd;
+
+    snprintf(nslots, sizeof(nslots), "%d", slots);
+    snprintf(nbudget, sizeof(nbudget), "%lld", budget);
+    if ((pid = fork()) == 0) {
+        setsid();
+        if (fork() == 0) {
+            // Grandchild: reparented away from the shell, so never a zombie here.
+            char *argv[] = { "myshell", "--spool-runner", nslots, nbudget, NULL };
+            if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+                dup2(fd, STDIN_FILENO);
+                dup2(fd, STDOUT_FILENO);
+                dup2(fd, STDERR_FILENO);
+                close(fd);
+            }
+            execv("/proc/self/exe", argv);
+        }
+        _exit(0);
+    } else if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/*
+  What past runs of a command cost, keyed by a hash of its arguments.
+  The runner is the only writer; it keeps the table in memory and
+  rewrites the spool's history file after each job.
+*/
+struct lsh_spool_stat {
+    uint64_t sig;    // 0 if the slot is empty
+    long rss_kb;     // Largest peak RSS seen
+    long ms;         // Typical run time (moving average), 0 if unknown
+};
+
+struct lsh_spool_history {
+    struct lsh_spool_stat *slots;
+    size_t cap, n;   // cap is a power of two
+};
+
+/**
+   @brief Hash a job's command into its signature.
+   @param job Job.
+   @return Signature (never 0).
+ */
+uint64_t lsh_spool_signature(const struct lsh_spool_job *job) {
+    uint64_t sig = 0;
+
+    for (int i = 0; i < job->argc; i++) {
+        sig = (sig * 0x100000001b3ULL) ^ lsh_hash(job->argv[i], strlen(job->argv[i]));
+    }
+    return sig ? sig : 1;
+}
+
+/**
+   @brief Find a command's entry in the history, adding it if new.
+   @param h History.
+   @param sig Command signature.
+   @return The entry (rss_kb 0 if nothing is known yet).
+ */
+struct lsh_spool_stat *lsh_spool_stat(struct lsh_spool_history *h, uint64_t sig) {
+    size_t i;
+
+    if ((h->n + 1) * 2 > h->cap) {
+        struct lsh_spool_history grown = { NULL, h->cap ? h->cap * 2 : 256, h->n };
+        grown.slots = calloc(grown.cap, sizeof(struct lsh_spool_stat));
+        if (!grown.slots) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < h->cap; j++) {
+            if (h->slots[j].sig != 0) {
+                for (i = h->slots[j].sig & (grown.cap - 1); grown.slots[i].sig != 0; i = (i + 1) & (grown.cap - 1));
+                grown.slots[i] = h->slots[j];
+            }
+        }
+        free(h->slots);
+        *h = grown;
+    }
+    for (i = sig & (h->cap - 1); h->slots[i].sig != 0 && h->slots[i].sig != sig; i = (i + 1) & (h->cap - 1));
+    if (h->slots[i].sig == 0) {
+        h->slots[i].sig = sig;
+        h->n++;
+    }
+    return &h->slots[i];
+}
+
+/**
+   @brief Load the history file into memory.
+   @param h Empty history.
+ */
+void lsh_spool_history_load(struct lsh_spool_history *h) {
+    char path[PATH_MAX], *line = NULL;
+    unsigned long long sig;
+    long rss_kb, ms;
+    size_t size = 0;
+    FILE *file;
+
+    if ((file = fopen(lsh_spool_path(path, "history", -1), "r")) == NULL) {
+        return;
+    }
+    while (getline(&line, &size, file) != -1) {
+        ms = 0; // Older files have no durations
+        if (sscanf(line, "%llx %ld %ld", &sig, &rss_kb, &ms) >= 2) {
+            struct lsh_spool_stat *stat = lsh_spool_stat(h, sig);
+            stat->rss_kb = rss_kb;
+            stat->ms = ms;
+        }
+    }
+    free(line);
+    fclose(file);
+}
+
+/**
+   @brief Write the history back to its file.
+   @param h History.
+ */
+void lsh_spool_history_save(struct lsh_spool_history *h) {
+    struct lsh_buf text = { NULL, 0, 0 };
+    char line[64];
+
+    for (size_t i = 0; i < h->cap; i++) {
+        if (h->slots[i].sig != 0) {
+            lsh_buf_append(&text, line, snprintf(line, sizeof(line), "%016llx %ld %ld\n",
+                                                 (unsigned long long)h->slots[i].sig, h->slots[i].rss_kb,
+                                                 h->slots[i].ms));
+        }
+    }
+    lsh_spool_commit("history", -1, text.data ? text.data : "", text.len);
+    free(text.data);
+}
+
+/**
+   @brief Print the jobs in the spool, one line each. Running jobs show
+          the time they are expected to take still, and while the runner
+          has work a last line gives its estimated completion time.
+ */
+void lsh_spool_show(void) {
+    const char *states[] = { "done", "running", "pending" };
+    struct lsh_spool_history history = { NULL, 0, 0 };
+    struct lsh_spool_job job;
+    char line[PATH_MAX + 64], left[32], path[PATH_MAX];
+    struct stat st;
+    long *ids, eta = 0;
+    int n, len, active = 0;
+    FILE *file;
+
+    lsh_spool_history_load(&history);
+    for (int s = 0; s < 3; s++) {
+        ids = lsh_spool_list(states[s], &n);
+        active += s > 0 ? n : 0;
+        for (int i = 0; i < n; i++) {
+            if (lsh_spool_job_read(states[s], ids[i], &job) != 0) {
+                continue; // It changed state under us
+            }
+            snprintf(left, sizeof(left), "-");
+            if (s == 1 && history.cap > 0 && stat(lsh_spool_path(path, "running", job.id), &st) == 0) {
+                long ms = lsh_spool_stat(&history, lsh_spool_signature(&job))->ms;
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                ms -= (now.tv_sec - st.st_mtim.tv_sec) * 1000 + (now.tv_nsec - st.st_mtim.tv_nsec) / 1000000;
+                if (lsh_spool_stat(&history, lsh_spool_signature(&job))->ms > 0) {
+                    snprintf(left, sizeof(left), "~%.1fs left", ms > 0 ? ms / 1000.0 : 0.0);
+                }
+            }
+            len = snprintf(line, sizeof(line), "%ld\t%s\t%s\t%s\t", job.id, states[s],
+                           job.status ? job.status : left, job.out ? job.out : "-");
+            lsh_out_write(line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+            for (int a = 0; a < job.argc; a++) {
+                lsh_out_write(job.argv[a], strlen(job.argv[a]));
+                lsh_out_write(a + 1 < job.argc ? " " : "\n", 1);
+            }
+            lsh_spool_job_free(&job);
+        }
+        free(ids);
+    }
+    if (active > 0 && (file = fopen(lsh_spool_path(path, "eta", -1), "r")) != NULL) {
+        if (fscanf(file, "%ld", &eta) == 1 && eta > 0) {
+            time_t when = eta;
+            len = strftime(line, sizeof(line), "eta\t%H:%M:%S\n", localtime(&when));
+            lsh_out_write(line, len);
+        }
+        fclose(file);
+    }
+    free(history.slots);
+    lsh_out_flush();
+}
+
+/**
+   @brief Builtin command: queue a command in the job spool, or list it.
+   @param args List of args: [-j <slots>] [-M <budget>] [-m <size>] [command...].
+   @return Always returns 1 to continue executing.
+ */
+int lsh_spool(char **args) {
+    struct lsh_buf text = { NULL, 0, 0 };
+    char cwd[PATH_MAX], path[PATH_MAX], line[64];
+    long long mem = 0, budget = 0;
+    int i, slots = 0;
+    long id;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL && atoi(args[i + 1]) > 0) {
+            slots = atoi(args[++i]);
+        } else if (strcmp(args[i], "-m") == 0 && args[i + 1] != NULL &&
+                   lsh_parse_size(args[i + 1], &mem) == 0) {
+            i++;
+        } else if (strcmp(args[i], "-M") == 0 && args[i + 1] != NULL &&
+                   lsh_parse_size(args[i + 1], &budget) == 0) {
+            i++;
+        } else {
+            fprintf(stderr, "lsh: spool: bad option %s\n", args[i]);
+            return 1;
+        }
+    }
+    if (args[i] == NULL) {
+        lsh_spool_show();
+        return 1;
+    }
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL || (id = lsh_spool_next_id()) < 0) {
+        perror("lsh: spool");
+        return 1;
+    }
+    lsh_spool_put(&text, "cwd ", cwd);
+    lsh_spool_put(&text, "out ", lsh_spool_path(path, "out", id));
+    if (mem > 0) {
+        lsh_buf_append(&text, line, snprintf(line, sizeof(line), "mem %lld\n", mem));
+    }
+    for (; args[i] != NULL; i++) {
+        lsh_spool_put(&text, "arg ", args[i]);
+    }
+    if (lsh_spool_commit("pending", id, text.data, text.len) != 0) {
+        perror("lsh: spool");
+    } else {
+        printf("%ld\n", id);
+        lsh_spool_start_runner(slots, budget);
+    }
+    free(text.data);
+    return 1;
+}
+
+/*
+  A job a runner has started.
+*/
+struct lsh_spool_slot {
+    pid_t pid;      // 0 if the slot is free
+    long id;
+    uint64_t sig;
+    long long mem;  // Memory set aside for it
+    struct timespec start;
+};
+
+/*
+  A pending job the runner is considering, with what it expects to cost.
+*/
+struct lsh_spool_plan {
+    struct lsh_spool_job job;
+    uint64_t sig;
+    long long mem;
+    long ms;        // 0 if the command has not run before
+};
+
+/**
+   @brief Order pending jobs: commands never seen before first (so that
+          they are measured early), then the longest expected run first,
+          then oldest first.
+ */
+int lsh_spool_plan_cmp(const void *a, const void *b) {
+    const struct lsh_spool_plan *x = a, *y = b;
+
+    if ((x->ms == 0) != (y->ms == 0)) {
+        return x->ms == 0 ? -1 : 1;
+    }
+    if (x->ms != y->ms) {
+        return x->ms > y->ms ? -1 : 1;
+    }
+    return (x->job.id > y->job.id) - (x->job.id < y->job.id);
+}
+
+/**
+   @brief Estimate when the runner will be done and store it for spool
+          listings. Jobs are assumed to go to the first slot to come free
+          in the order they were planned; memory limits are ignored.
+   @param running Slots.
+   @param slots Number of slots.
+   @param plan Pending jobs in the order they will start.
+   @param nplan Number of pending jobs.
+   @param history Run history (for running jobs' expected durations).
+ */
+void lsh_spool_eta(struct lsh_spool_slot *running, int slots, struct lsh_spool_plan *plan,
+                   int nplan, struct lsh_spool_history *history) {
+    struct timespec now;
+    long *free_at = calloc(slots, sizeof(long)), end = 0, known = 0, total = 0;
+    char line[32];
+    int i, s, first;
+
+    if (!free_at) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < nplan; i++) {
+        known += plan[i].ms > 0;
+        total += plan[i].ms;
+    }
+    // Milliseconds from now at which each slot comes free.
+    for (s = 0; s < slots; s++) {
+        if (running[s].pid != 0) {
+            long gone = (now.tv_sec - running[s].start.tv_sec) * 1000 +
+                        (now.tv_nsec - running[s].start.tv_nsec) / 1000000;
+            long ms = lsh_spool_stat(history, running[s].sig)->ms;
+            free_at[s] = ms > gone ? ms - gone : 0;
+        }
+    }
+    for (i = 0; i < nplan; i++) {
+        for (first = 0, s = 1; s < slots; s++) {
+            if (free_at[s] < free_at[first]) {
+                first = s;
+            }
+        }
+        // A command with no history is guessed at the average of the rest.
+        free_at[first] += plan[i].ms > 0 ? plan[i].ms : (known ? total / known : 0);
+    }
+    for (s = 0; s < slots; s++) {
+        end = free_at[s] > end ? free_at[s] : end;
+    }
+    free(free_at);
+    lsh_spool_commit("eta", -1, line, snprintf(line, sizeof(line), "%ld\n", (long)time(NULL) + (end + 999) / 1000));
+}
+
+/**
+   @brief Claim a pending job and start it.
+   @param job The job, as read from pending/.
+   @return Child pid, 0 if another runner took the job, -1 if it could
+           not be started (it is then recorded as done).
+ */
+pid_t lsh_spool_start(struct lsh_spool_job *job) {
+    char from[PATH_MAX], to[PATH_MAX];
+    pid_t pid = -1;
+    int fd;
+
+    if (rename(lsh_spool_path(from, "pending", job->id), lsh_spool_path(to, "running", job->id)) != 0) {
+        return 0;
+    }
+    utimensat(AT_FDCWD, to, NULL, 0); // Record the start time
+    if ((fd = open(job->out, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0) {
+        pid = lsh_spawn(job->argv, job->cwd, fd);
+        close(fd);
+    }
+    return pid;
+}
+
+/**
+   @brief Record a job as done.
+   @param id Job id.
+   @param status Wait status, or -1 if the job never started.
+   @param usage Its resource usage, or NULL.
+ */
+void lsh_spool_finish(long id, int status, const struct rusage *usage) {
+    char path[PATH_MAX], line[96];
+    struct lsh_spool_job job;
+    int len;
+
+    if (lsh_spool_job_read("running", id, &job) != 0) {
+        return;
+    }
+    if (status == -1) {
+        len = snprintf(line, sizeof(line), "status failed\n");
+    } else if (WIFSIGNALED(status)) {
+        len = snprintf(line, sizeof(line), "status signal %d\n", WTERMSIG(status));
+    } else {
+        len = snprintf(line, sizeof(line), "status %d\n", WEXITSTATUS(status));
+    }
+    if (usage != NULL) {
+        len += snprintf(line + len, sizeof(line) - len, "rss %ld\n", usage->ru_maxrss);
+    }
+    lsh_buf_append(&job.text, line, len);
+    if (lsh_spool_commit("done", id, job.text.data, job.text.len) == 0) {
+        unlink(lsh_spool_path(path, "running", id));
+    }
+    lsh_spool_job_free(&job);
+}
+
+/**
+   @brief Put jobs a crashed runner left behind back in the queue.
+ */
+void lsh_spool_recover(void) {
+    char from[PATH_MAX], to[PATH_MAX];
+    long *ids;
+    int n;
+
+    ids = lsh_spool_list("running", &n);
+    for (int i = 0; i < n; i++) {
+        lsh_spool_path(from, "running", ids[i]);
+        if (access(lsh_spool_path(to, "done", ids[i]), F_OK) == 0) {
+            unlink(from); // Finished; only the cleanup was lost
+        } else {
+            rename(from, lsh_spool_path(to, "pending", ids[i]));
+        }
+    }
+    free(ids);
+}
+
+/**
+   @brief Serve the job spool: run pending jobs, at most slots at a time,
+          until the spool has been idle for a while.
+
+   Pending jobs are tried longest expected run first, by the durations of
+   earlier runs of the same command (commands never run before go first,
+   to be measured), so that long jobs do not start last and stretch the
+   batch.
+
+   Jobs are packed by memory: each is charged what it declared with -m,
+   else the largest peak RSS seen in earlier runs of the same command,
+   and starts only while the charges fit in the budget. Pending jobs that
+   do not fit are passed over for later ones that do; a job larger than
+   the whole budget still runs once nothing else is running.
+
+   @param slots Number of jobs to run at a time (0 for one per CPU).
+   @param budget Memory in bytes the jobs may use together (0 for the
+                 memory free when the runner starts).
+   @return Exit status for the runner process.
+ */
+int lsh_spool_runner(int slots, long long budget) {
+    struct lsh_spool_history history = { NULL, 0, 0 };
+    struct lsh_spool_slot *running;
+    struct timespec nap = { 0, 100 * 1000 * 1000 }, seen = { 0, 0 }, now;
+    struct rusage usage;
+    struct stat st;
+    char path[PATH_MAX], pending_dir[PATH_MAX];
+    struct lsh_spool_plan *plan = NULL;
+    int lock, nrunning = 0, idle_ms = 0, npending, nplan, status, i, j, rescan = 1;
+    long long used = 0;
+    long *pending;
+    pid_t pid;
+
+    if (slots <= 0) {
+        slots = lsh_num_cpus();
+    }
+    if (budget <= 0) {
+        budget = (long long)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    }
+    running = calloc(slots, sizeof(struct lsh_spool_slot));
+    if (!running) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((lock = open(lsh_spool_path(path, "runner.lock", -1), O_RDWR | O_CREAT, 0600)) < 0 ||
+        flock(lock, LOCK_EX | LOCK_NB) != 0) {
+        return EXIT_SUCCESS; // Another runner is serving the spool
+    }
+    lsh_spool_recover();
+    lsh_spool_history_load(&history);
+    lsh_spool_path(pending_dir, "pending", -1);
+
+    while (1) {
+        // Only look at the queue again when it or the set of running jobs
+        // changed; a queue of jobs that do not fit would otherwise be
+        // reread on every poll.
+        if (stat(pending_dir, &st) == 0 &&
+            (st.st_mtim.tv_sec != seen.tv_sec || st.st_mtim.tv_nsec != seen.tv_nsec)) {
+            seen = st.st_mtim;
+            rescan = 1;
+        }
+
+        // Fill free slots with the jobs that fit, longest expected first.
+        pending = nrunning < slots && rescan ? lsh_spool_list("pending", &npending) : NULL;
+        rescan = pending != NULL ? 0 : rescan && nrunning == slots;
+        nplan = 0;
+        if (pending != NULL && (plan = calloc(npending, sizeof(struct lsh_spool_plan))) == NULL) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; pending && i < npending; i++) {
+            struct lsh_spool_plan *p = &plan[nplan];
+            struct lsh_spool_stat *stat;
+            if (lsh_spool_job_read("pending", pending[i], &p->job) != 0) {
+                continue;
+            }
+            p->sig = lsh_spool_signature(&p->job);
+            stat = lsh_spool_stat(&history, p->sig);
+            p->mem = p->job.mem > 0 ? p->job.mem : stat->rss_kb * 1024LL;
+            p->ms = stat->ms;
+            nplan++;
+        }
+        free(pending);
+        if (nplan > 1) {
+            qsort(plan, nplan, sizeof(struct lsh_spool_plan), lsh_spool_plan_cmp);
+        }
+        for (i = 0, j = 0; i < nplan; i++) {
+            struct lsh_spool_plan *p = &plan[i];
+            if (nrunning == slots || (nrunning > 0 && used + p->mem > budget) ||
+                (pid = lsh_spool_start(&p->job)) == 0) {
+                plan[j++] = *p; // Still pending
+                continue;
+            }
+            if (pid < 0) {
+                lsh_spool_finish(p->job.id, -1, NULL);
+            } else {
+                int s = 0;
+                while (running[s].pid != 0) {
+                    s++;
+                }
+                running[s].pid = pid;
+                running[s].id = p->job.id;
+                running[s].sig = p->sig;
+                running[s].mem = p->mem;
+                clock_gettime(CLOCK_MONOTONIC, &running[s].start);
+                used += p->mem;
+                nrunning++;
+            }
+            lsh_spool_job_free(&p->job);
+        }
+        if (plan != NULL) {
+            lsh_spool_eta(running, slots, plan, j, &history);
+            for (i = 0; i < j; i++) {
+                lsh_spool_job_free(&plan[i].job);
+            }
+            free(plan);
+            plan = NULL;
+        }
+
+        if (nrunning == 0) {
+            if (idle_ms >= LSH_SPOOL_IDLE_MS) {
+                // Let go of the spool, then make sure no job slipped in
+                // while this runner was deciding to stop.
+                flock(lock, LOCK_UN);
+                pending = lsh_spool_list("pending", &npending);
+                free(pending);
+                if (npending == 0 || flock(lock, LOCK_EX | LOCK_NB) != 0) {
+                    break;
+                }
+                idle_ms = 0;
+                rescan = 1;
+                continue;
+            }
+            nanosleep(&nap, NULL);
+            idle_ms += 100;
+            continue;
+        }
+        idle_ms = 0;
+
+        // With every slot busy nothing can start, so block; otherwise poll
+        // so that newly queued jobs are picked up.
+        pid = wait4(-1, &status, nrunning == slots ? 0 : WNOHANG, &usage);
+        if (pid == 0) {
+            nanosleep(&nap, NULL);
+            continue;
+        }
+        if (pid < 0 || (!WIFEXITED(status) && !WIFSIGNALED(status))) {
+            continue;
+        }
+        for (i = 0; i < slots; i++) {
+            if (running[i].pid == pid) {
+                struct lsh_spool_stat *stat = lsh_spool_stat(&history, running[i].sig);
+                long ms;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                ms = (now.tv_sec - running[i].start.tv_sec) * 1000 +
+                     (now.tv_nsec - running[i].start.tv_nsec) / 1000000;
+                if (usage.ru_maxrss > stat->rss_kb) {
+                    stat->rss_kb = usage.ru_maxrss;
+                }
+                stat->ms = stat->ms ? (stat->ms * 3 + ms) / 4 : (ms ? ms : 1);
+                lsh_spool_history_save(&history);
+                lsh_spool_finish(running[i].id, status, &usage);
+                used -= running[i].mem;
+                running[i].pid = 0;
+                nrunning--;
+                rescan = 1;
+            }
+        }
+    }
+    free(history.slots);
+    free(running);
+    close(lock);
+    return EXIT_SUCCESS;
+}
+
+/*
+  cachedsource runs an activation script once in /bin/sh and records what
+  it changed: exported variables, the working directory and aliases. The
+  delta is cached under a key made from the script's contents, its path,
+  the working directory and the environment it started from, so running
+  the same script in the same situation again replays it without a shell.
+  Files the script itself sources are not part of the key; use -f to
+  refresh after changing them.
+*/
+
+/**
+   @brief Whether an environment variable is shell bookkeeping that
+          should neither key nor change the cache.
+   @param entry "NAME=VALUE" string.
+   @return Nonzero to ignore it.
+ */
+int lsh_source_ignored(const char *entry) {
+    const char *ignored[] = { "PWD=", "OLDPWD=", "SHLVL=", "_=" };
+
+    for (int i = 0; i < (int)(sizeof(ignored) / sizeof(ignored[0])); i++) {
+        if (strncmp(entry, ignored[i], strlen(ignored[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+   @brief Work out the cache file for a script in the current situation.
+   @param script Script path.
+   @param path Buffer of PATH_MAX bytes for the cache file name.
+   @return 0 on success, -1 if the script cannot be read.
+ */
+int lsh_source_key(const char *script, char *path) {
+    struct lsh_input in;
+    const char *data;
+    char cwd[PATH_MAX], dir[PATH_MAX];
+    uint64_t key, env = 0;
+    size_t len;
+
+    if (lsh_input_open(&in, script) != 0) {
+        return -1;
+    }
+    key = lsh_hash(script, strlen(script));
+    while (lsh_input_next(&in, &data, &len) == 1) {
+        key = (key * 0x100000001b3ULL) ^ lsh_hash(data, len);
+    }
+    lsh_input_close(&in);
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        key = (key * 0x100000001b3ULL) ^ lsh_hash(cwd, strlen(cwd));
+    }
+    // The environment is a set, so combine entries in an order-free way.
+    for (char **e = environ; *e != NULL; e++) {
+        if (!lsh_source_ignored(*e)) {
+            env += lsh_hash(*e, strlen(*e));
+        }
+    }
+    key = (key * 0x100000001b3ULL) ^ env;
+
+    if (getenv("XDG_CACHE_HOME") != NULL) {
+        snprintf(dir, sizeof(dir), "%s/myshell", getenv("XDG_CACHE_HOME"));
+    } else {
+        snprintf(dir, sizeof(dir), "%s/.cache", getenv("HOME") ? getenv("HOME") : "/tmp");
+        mkdir(dir, 0700);
+        strncat(dir, "/myshell", sizeof(dir) - strlen(dir) - 1);
+    }
+    mkdir(dir, 0700);
+    snprintf(path, PATH_MAX, "%.*s/%016llx.delta", PATH_MAX - 32, dir, (unsigned long long)key);
+    return 0;
+}
+
+/**
+   @brief Compare "NAME=VALUE" entries (or bare names) by name for qsort.
+ */
+int lsh_source_cmp(const void *a, const void *b) {
+    const char *x = *(const char **)a, *y = *(const char **)b;
+
+    for (; *x == *y && *x != '=' && *x != '\0'; x++, y++);
+    return (*x == '=' || *x == '\0' ? 0 : (unsigned char)*x + 1) -
+           (*y == '=' || *y == '\0' ? 0 : (unsigned char)*y + 1);
+}
+
+/**
+   @brief Compare delta records by name, then by their place in the delta,
+          for qsort.
+ */
+int lsh_source_rec_cmp(const void *a, const void *b) {
+    int cmp = lsh_source_cmp(a, b);
+    const char *x = *(const char **)a, *y = *(const char **)b;
+
+    return cmp != 0 ? cmp : (x > y) - (x < y);
+}
+
+/**
+   @brief Run a script in /bin/sh and turn what it changed into a delta.
+   @param script Script path.
+   @param delta Filled with NUL-terminated records: "set NAME=VALUE",
+                "unset NAME", "cwd PATH" and "alias NAME VALUE".
+   @return 0 on success, -1 if the script failed.
+ */
+int lsh_source_capture(const char *script, struct lsh_buf *delta) {
+    // Aliases, a NUL, then the environment and cwd as myshell sees them.
+    const char *wrapper = ". \"$1\" || exit $?; alias >&3; printf '\\000' >&3; exec \"$0\" --dump-env >&3";
+    struct lsh_buf out = { NULL, 0, 0 };
+    char self[PATH_MAX], chunk[65536], cwd[PATH_MAX], **env = NULL, **old;
+    char *p, *end, *line, *next;
+    int fds[2], status, n = 0, cap = 0, nenv;
+    ssize_t got, len;
+    pid_t pid;
+
+    if ((len = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0 || pipe(fds) != 0) {
+        perror("lsh: cachedsource");
+        return -1;
+    }
+    self[len] = '\0';
+    if ((pid = fork()) == 0) {
+        close(fds[0]);
+        if (fds[1] != 3) {
+            dup2(fds[1], 3);
+            close(fds[1]);
+        }
+        // "." searches PATH for names without a slash; sourcing means this file.
+        if (strchr(script, '/') == NULL) {
+            char local[PATH_MAX];
+            snprintf(local, sizeof(local), "./%s", script);
+            execl("/bin/sh", "sh", "-c", wrapper, self, local, (char *)NULL);
+        }
+        execl("/bin/sh", "sh", "-c", wrapper, self, script, (char *)NULL);
+        perror("lsh");
+        exit(EXIT_FAILURE);
+    }
+    close(fds[1]);
+    while ((got = read(fds[0], chunk, sizeof(chunk))) > 0 || (got < 0 && errno == EINTR)) {
+        if (got > 0) {
+            lsh_buf_append(&out, chunk, got);
+        }
+    }
+    close(fds[0]);
+    if (pid < 0 || (status = lsh_wait(pid, NULL)) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        out.len == 0 || out.data[out.len - 1] != '\0') {
+        fprintf(stderr, "lsh: cachedsource: %s failed\n", script);
+        free(out.data);
+        return -1;
+    }
+
+    // Captured environment: everything after the alias text and the cwd.
+    p = memchr(out.data, '\0', out.len) + 1;
+    end = out.data + out.len;
+    const char *new_cwd = p;
+    for (p += strlen(p) + 1; p < end; p += strlen(p) + 1) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 128;
+            if ((env = realloc(env, cap * sizeof(char *))) == NULL) {
+                fprintf(stderr, "lsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        env[n++] = p;
+    }
+
+    // Walk both environments in name order to find what changed.
+    for (nenv = 0; environ[nenv] != NULL; nenv++);
+    if ((old = malloc((nenv + 1) * sizeof(char *))) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(old, environ, nenv * sizeof(char *));
+    qsort(old, nenv, sizeof(char *), lsh_source_cmp);
+    qsort(env, n, sizeof(char *), lsh_source_cmp);
+    for (int i = 0, j = 0; i < n || j < nenv; ) {
+        int cmp = i == n ? 1 : j == nenv ? -1 : lsh_source_cmp(&env[i], &old[j]);
+        if (cmp < 0 || (cmp == 0 && strcmp(env[i], old[j]) != 0)) {
+            if (!lsh_source_ignored(env[i])) {
+                lsh_buf_append(delta, "set ", 4);
+                lsh_buf_append(delta, env[i], strlen(env[i]) + 1);
+            }
+        } else if (cmp > 0 && !lsh_source_ignored(old[j])) {
+            lsh_buf_append(delta, "unset ", 6);
+            lsh_buf_append(delta, old[j], strcspn(old[j], "="));
+            lsh_buf_append(delta, "", 1);
+        }
+        i += cmp <= 0;
+        j += cmp >= 0;
+    }
+    free(old);
+    if (getcwd(cwd, sizeof(cwd)) == NULL || strcmp(cwd, new_cwd) != 0) {
+        lsh_buf_append(delta, "cwd ", 4);
+        lsh_buf_append(delta, new_cwd, strlen(new_cwd) + 1);
+    }
+
+    // sh prints aliases as name='value' (some shells prefix "alias ").
+    // Only single-word values can become myshell aliases.
+    for (line = out.data; *line; line = next) {
+        char *eq, *value, *w;
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        } else {
+            next = line + strlen(line);
+        }
+        if (strncmp(line, "alias ", 6) == 0) {
+            line += 6;
+        }
+        if ((eq = strchr(line, '=')) == NULL) {
+            continue;
+        }
+        *eq = '\0';
+        value = eq + 1;
+        if (value[0] == '\'' && (len = strlen(value)) > 1 && value[len - 1] == '\'') {
+            value[len - 1] = '\0';
+            value++;
+        }
+        for (w = value; *w && strchr(" \t'\"\\", *w) == NULL; w++);
+        if (*w == '\0' && *value != '\0') {
+            lsh_buf_append(delta, "alias ", 6);
+            lsh_buf_append(delta, line, strlen(line));
+            lsh_buf_append(delta, " ", 1);
+            lsh_buf_append(delta, value, strlen(value) + 1);
+        }
+    }
+    free(env);
+    free(out.data);
+    return 0;
+}
+
+/**
+   @brief Apply a delta recorded by lsh_source_capture.
+   @param delta Records.
+   @param len Length of delta.
+ */
+void lsh_source_apply(char *delta, size_t len) {
+    static char **built = NULL; // Environment array made by the last call
+    char *end = delta + len, *sp, **names = NULL, **old, **env, *value;
+    int n = 0, cap = 0, nenv, k = 0;
+    struct lsh_var *v;
+
+    // Environment changes are merged into a new array in one pass, as a
+    // setenv per variable scans the whole environment each time.
+    for (char *rec = delta; rec < end; rec += strlen(rec) + 1) {
+        char *name = strncmp(rec, "set ", 4) == 0 && strchr(rec, '=') ? rec + 4
+                     : strncmp(rec, "unset ", 6) == 0 ? rec + 6 : NULL;
+        if (name == NULL) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            if ((names = realloc(names, cap * sizeof(char *))) == NULL) {
+                fprintf(stderr, "lsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        names[n++] = name;
+    }
+    if (n > 0) {
+        for (nenv = 0; environ[nenv] != NULL; nenv++);
+        old = malloc((nenv + 1) * sizeof(char *));
+        env = malloc((nenv + n + 1) * sizeof(char *));
+        if (old == NULL || env == NULL) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(old, environ, nenv * sizeof(char *));
+        qsort(old, nenv, sizeof(char *), lsh_source_cmp);
+        qsort(names, n, sizeof(char *), lsh_source_rec_cmp);
+        for (int i = 0, j = 0; i < n || j < nenv; ) {
+            int cmp = i == n ? 1 : j == nenv ? -1 : lsh_source_cmp(&names[i], &old[j]);
+            if (cmp > 0) {
+                env[k++] = old[j++];
+                continue;
+            }
+            j += cmp == 0;
+            // Of several records for a name, the last one counts.
+            if (i + 1 < n && lsh_source_cmp(&names[i], &names[i + 1]) == 0) {
+                i++;
+                continue;
+            }
+            if (strchr(names[i], '=') != NULL && (env[k++] = strdup(names[i])) == NULL) {
+                fprintf(stderr, "lsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            // A shell variable of that name would hide the change.
+            if ((v = lsh_var_find(names[i], strcspn(names[i], "="), 0)) != NULL) {
+                if ((value = strchr(names[i], '=')) == NULL) {
+                    lsh_var_remove(v);
+                } else {
+                    v->value.len = 0;
+                    lsh_buf_append(&v->value, value + 1, strlen(value));
+                    v->value.len--;
+                    v->num_ok = v->str_stale = v->array = 0;
+                    v->exported = 1;
+                }
+            }
+            i++;
+        }
+        env[k] = NULL;
+        if (environ == built) {
+            free(built);
+        }
+        environ = built = env;
+        free(old);
+    }
+    free(names);
+
+    for (char *rec = delta; rec < end; rec += strlen(rec) + 1) {
+        if (strncmp(rec, "cwd ", 4) == 0) {
+            if (chdir(rec + 4) != 0) {
+                perror("lsh");
+            } else {
+                lsh_alias_enter_cwd();
+            }
+        } else if (strncmp(rec, "alias ", 6) == 0 && (sp = strchr(rec + 6, ' ')) != NULL) {
+            *sp = '\0';
+            lsh_alias_base_set(rec + 6, sp + 1, 1);
+            *sp = ' ';
+        }
+    }
+}
+
+/**
+   @brief Builtin command: source an activation script, replaying its
+          cached effect when the script and its inputs are unchanged.
+   @param args List of args: [-f] <script>. -f ignores the cache.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_cachedsource(char **args) {
+    struct lsh_buf delta = { NULL, 0, 0 };
+    char path[PATH_MAX], tmp[PATH_MAX + 16], chunk[65536];
+    int force = 0, fd;
+    ssize_t got;
+
+    if (args[1] != NULL && strcmp(args[1], "-f") == 0) {
+        force = 1;
+        args++;
+    }
+    if (args[1] == NULL) {
+        fprintf(stderr, "lsh: expected argument to \"cachedsource\"\n");
+        return 1;
+    }
+    // Key, capture and compare against what commands would see.
+    lsh_var_child_env();
+    if (lsh_source_key(args[1], path) != 0) {
+        perror("lsh: cachedsource");
+        return 1;
+    }
+
+    if (!force && (fd = open(path, O_RDONLY)) >= 0) {
+        while ((got = read(fd, chunk, sizeof(chunk))) > 0) {
+            lsh_buf_append(&delta, chunk, got);
+        }
+        close(fd);
+    } else if (lsh_source_capture(args[1], &delta) == 0) {
+        // Publish the delta atomically; a torn file would replay garbage.
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+        if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0) {
+            if (lsh_write_all(fd, delta.data ? delta.data : "", delta.len) == 0 && close(fd) == 0) {
+                rename(tmp, path);
+            } else {
+                unlink(tmp);
+            }
+        }
+    } else {
+        return 1;
+    }
+    if (delta.len > 0) {
+        lsh_source_apply(delta.data, delta.len);
+    }
+    free(delta.data);
+    return 1;
+}
+
+/**
+   @brief Print the working directory and environment, NUL-separated, for
+          cachedsource to compare with its own.
+   @return Exit status.
+ */
+int lsh_dump_env(void) {
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return EXIT_FAILURE;
+    }
+    lsh_out_write(cwd, strlen(cwd) + 1);
+    for (char **e = environ; *e != NULL; e++) {
+        lsh_out_write(*e, strlen(*e) + 1);
+    }
+    lsh_out_flush();
+    return EXIT_SUCCESS;
+}
+
+/**
+   @brief Replace an alias in the command position with its command.
+   @param args Null terminated list of arguments.
+ */
+void lsh_resolve_alias(char **args) {
+    // One probe covers the shell's aliases and every directory layer.
+    struct lsh_alias_slot *slot = lsh_alias_lookup(args[0]);
+
+    if (slot != NULL) {
+        args[0] = (char *)slot->value;
+    }
+}
+
+/*
+  Builtins added by plugins. They are numbered after the shell's own, so
+  lsh_find_builtin indices cover both.
+*/
+struct lsh_plugin_builtin {
+    char *name;
+    int (*func)(char **args);
+    int plugin;   // Index into lsh_plugins
+};
+
+struct lsh_plugin_builtin *plugin_builtins = NULL;
+int plugin_builtin_count = 0;
+int plugin_builtin_cap = 0;
+
+/**
+   @brief Look up a builtin command by name.
+   @param name Command name.
+   @return Index for lsh_call_builtin, or -1 if it is not a builtin.
+ */
+int lsh_find_builtin(const char *name) {
+    for (int i = 0; i < lsh_num_builtins(); i++) {
+        if (strcmp(name, builtin_str[i]) == 0) {
+            return i;
+        }
+    }
+    for (int i = 0; i < plugin_builtin_count; i++) {
+        if (strcmp(name, plugin_builtins[i].name) == 0) {
+            return lsh_num_builtins() + i;
+        }
+    }
+    return -1;
+}
+
+/**
+   @brief Run a builtin found by lsh_find_builtin.
+   @param i Builtin index.
+   @param args Null terminated list of arguments.
+   @return The builtin's status: 1 to continue, 0 to exit.
+ */
+int lsh_call_builtin(int i, char **args) {
+    if (i < lsh_num_builtins()) {
+        return (*builtin_func[i])(args);
+    }
+    return (*plugin_builtins[i - lsh_num_builtins()].func)(args);
+}
+
+/**
+   @brief Look up a builtin that can run as a record stage.
+   @param name Command name.
+   @return Index into record_builtin_open, or -1.
+ */
+int lsh_find_record_builtin(const char *name) {
+    for (int i = 0; i < (int)(sizeof(record_builtin_str) / sizeof(char *)); i++) {
+        if (strcmp(name, record_builtin_str[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+   @brief Run a pipeline of commands. Neighbouring record-stage builtins
+          share one process and pass rows (a later one that names its own
+          files starts a new group); every other command gets its own.
+   @param args Null terminated list of words as typed, with "|" between
+               commands. Each command's words are expanded once split off.
+   @return Always returns 1 to continue execution.
+ */
+int lsh_pipeline(char **args) {
+    int nstages = 1, i, j, b, in_fd = STDIN_FILENO, fds[2], *opened;
+    char **stage, ***stages, ***expanded;
+    struct lsh_stage *recs;
+    struct lsh_tree_cmd *cmd;
+    pid_t *pids;
+    int status;
+
+    for (i = 0; args[i] != NULL; i++) {
+        if (strcmp(args[i], "|") == 0) {
+            if (i == 0 || args[i + 1] == NULL || strcmp(args[i + 1], "|") == 0) {
+                fprintf(stderr, "lsh: syntax error near `|'\n");
+                return 1;
+            }
+            nstages++;
+        }
+    }
+
+    stages = malloc(nstages * sizeof(char **));
+    recs = calloc(nstages, sizeof(struct lsh_stage));
+    opened = calloc(nstages, sizeof(int));
+    pids = calloc(nstages, sizeof(pid_t));
+    expanded = calloc(nstages, sizeof(char **));
+    if (!stages || !recs || !opened || !pids || !expanded) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0, stage = args; i < nstages; i++) {
+        stages[i] = stage;
+        while (*stage != NULL && strcmp(*stage, "|") != 0) {
+            stage++;
+        }
+        if (*stage != NULL) {
+            *stage++ = NULL;
+        }
+        if ((expanded[i] = lsh_expand_args(stages[i])) != NULL) {
+            stages[i] = expanded[i];
+        }
+        if (lsh_expand_failed) {
+            lsh_status = 1;
+            goto out;
+        }
+        // A stage whose words all expanded to nothing runs as a no-op.
+        if (stages[i][0] == NULL) {
+            continue;
+        }
+        lsh_resolve_alias(stages[i]);
+        if ((b = lsh_find_record_builtin(stages[i][0])) >= 0) {
+            if ((*record_builtin_open[b])(&recs[i], stages[i]) != 0) {
+                lsh_status = 1;
+                goto out;
+            }
+            opened[i] = 1;
+        }
+    }
+    fflush(stdout);
+
+    // A pipeline of record stages only runs right here, like a lone builtin.
+    for (j = 1; j < nstages && opened[j] && recs[j].files[0] == NULL; j++);
+    if (opened[0] && j == nstages) {
+        lsh_status = 0;
+        lsh_stages_run(recs, nstages);
+        memset(opened, 0, nstages * sizeof(int));
+        goto out;
+    }
+    cmd = lsh_tree_begin(stages[0][0] ? stages[0][0] : "");
+
+    for (i = 0; i < nstages; i = j) {
+        // Stages [i, j) run in one process.
+        j = i + 1;
+        if (opened[i]) {
+            while (j < nstages && opened[j] && recs[j].files[0] == NULL) {
+                j++;
+            }
+        }
+        fds[0] = -1;
+        fds[1] = STDOUT_FILENO;
+        if (j < nstages && pipe(fds) != 0) {
+            perror("lsh");
+            break;
+        }
+
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            // Child process: wire up the pipe ends, then run the stage.
+            if (in_fd != STDIN_FILENO) {
+                dup2(in_fd, STDIN_FILENO);
+                close(in_fd);
+            }
+            if (fds[1] != STDOUT_FILENO) {
+                dup2(fds[1], STDOUT_FILENO);
+                close(fds[1]);
+                close(fds[0]);
+            }
+            // Builtins and record stages exit with the status they set.
+            lsh_status = 0;
+            if (opened[i]) {
+                lsh_stages_run(&recs[i], j - i);
+                exit(lsh_status);
+            }
+            if (stages[i][0] == NULL) {
+                exit(EXIT_SUCCESS);
+            }
+            if ((b = lsh_find_builtin(stages[i][0])) >= 0) {
+                lsh_call_builtin(b, stages[i]);
+                lsh_out_flush();
+                exit(lsh_status);
+            }
+            lsh_trace_child_env();
+            lsh_var_child_env();
+            execvp(stages[i][0], stages[i]);
+            perror("lsh");
+            exit(EXIT_FAILURE);
+        } else if (pids[i] < 0) {
+            perror("lsh");
+        }
+
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (fds[1] != STDOUT_FILENO) {
+            close(fds[1]);
+        }
+        in_fd = fds[0];
+    }
+    if (in_fd != STDIN_FILENO) {
+        close(in_fd);
+    }
+
+    // The pipeline's status is its last stage's.
+    status = pids[nstages - 1] > 0 ? -1 : 0;
+    if (cmd != NULL) {
+        lsh_tree_wait(cmd, pids, nstages, &status);
+    }
+    for (i = 0; cmd == NULL && i < nstages; i++) {
+        if (pids[i] > 0) {
+            waitpid(pids[i], i == nstages - 1 ? &status : NULL, 0);
+        }
+    }
+    lsh_status = lsh_exit_code(status);
+
+out:
+    // The parent's copies of stages run by children are dropped unused.
+    for (i = 0; i < nstages; i++) {
+        if (opened[i] && recs[i].release) {
+            recs[i].release(&recs[i]);
+        }
+        free(expanded[i]);
+    }
+    free(stages);
+    free(expanded);
+    free(recs);
+    free(opened);
+    free(pids);
+    return 1;
+}
+
+/**
+   @brief Execute shell built-in or launch program.
+   @param args Null terminated list of expanded arguments.
+   @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int lsh_dispatch(char **args) {
+    int i;
+
+    if (args[0] == NULL) {
+        // An empty command was entered.
+        return 1;
+    }
+
+    // Check for alias replacement
+    lsh_resolve_alias(args);
+
+    // Check for built-in commands
+    if ((i = lsh_find_builtin(args[0])) >= 0) {
+        int status;
+        lsh_status = 0;
+        status = lsh_call_builtin(i, args);
+        lsh_out_flush();
+        return status;
+    }
+
+    // Launch external command
+    return lsh_launch(args);
+}
+
+/**
+   @brief Run a line of words: assign variables or expand and execute.
+   @param args Null terminated list of words as typed.
+   @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int lsh_run_command(char **args) {
+    char **expanded;
+    int i, status;
+
+    lsh_expand_failed = 0;
+    if (args[0] != NULL && lsh_assign(args)) {
+        return 1;
+    }
+    // Commands joined by pipes each get their own process. Pipes are found
+    // among the words as typed, so a quoted or expanded "|" is literal.
+    for (i = 0; args[i] != NULL; i++) {
+        if (strcmp(args[i], "|") == 0) {
+            return lsh_pipeline(args);
+        }
+    }
+    if ((expanded = lsh_expand_args(args)) == NULL) {
+        return lsh_dispatch(args);
+    }
+    if (lsh_expand_failed) {
+        // As in bash, the command does not run and $? is 1.
+        free(expanded);
+        lsh_status = 1;
+        return 1;
+    }
+    status = lsh_dispatch(expanded);
+    free(expanded);
+    return status;
+}
+
+/**
+   @brief Execute a command line, as a span of its own when tracing.
+   @param args Null terminated list of arguments.
+   @return 1 if the shell should continue running, 0 if it should terminate.
+ */
+int lsh_execute(char **args) {
+    struct lsh_buf command = { NULL, 0, 0 };
+    const char *name = args[0];
+    char parent[17], span[17];
+    uint64_t start;
+    int status;
+
+    if (lsh_trace.fd < 0 || args[0] == NULL) {
+        return lsh_run_command(args);
+    }
+    // Taken before aliases rewrite args[0].
+    for (int i = 0; args[i] != NULL; i++) {
+        lsh_buf_append(&command, args[i], strlen(args[i]));
+        lsh_buf_append(&command, args[i + 1] ? " " : "", 1);
+    }
+    memcpy(parent, lsh_trace.current_id, 17);
+    lsh_trace_random_id(span, 16);
+    memcpy(lsh_trace.current_id, span, 17);
+    start = lsh_trace_now();
+
+    status = lsh_run_command(args);
+
+    lsh_trace_emit(name, span, parent, start, lsh_trace_now(), command.data);
+    memcpy(lsh_trace.current_id, parent, 17);
+    free(command.data);
+    return status;
+}
+
+/*
+  Loaded plugins, in load order.
+*/
+struct lsh_plugin {
+    char *path;
+    void *handle;
+};
+
+struct lsh_plugin *lsh_plugins = NULL;
+int lsh_plugin_count = 0;
+int lsh_plugin_loading = -1; // Plugin whose init is running
+
+/**
+   @brief Plugin API: add a builtin.
+   @param name Command name (copied).
+   @param func Builtin function.
+   @return 0, or -1 if a builtin of that name exists.
+ */
+int lsh_plugin_register(const char *name, int (*func)(char **args)) {
+    if (name == NULL || func == NULL || lsh_find_builtin(name) >= 0) {
+        return -1;
+    }
+    if (plugin_builtin_count == plugin_builtin_cap) {
+        plugin_builtin_cap = plugin_builtin_cap ? plugin_builtin_cap * 2 : 16;
+        plugin_builtins = realloc(plugin_builtins, plugin_builtin_cap * sizeof(struct lsh_plugin_builtin));
+        if (!plugin_builtins) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ((plugin_builtins[plugin_builtin_count].name = strdup(name)) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    plugin_builtins[plugin_builtin_count].func = func;
+    plugin_builtins[plugin_builtin_count].plugin = lsh_plugin_loading;
+    plugin_builtin_count++;
+    return 0;
+}
+
+/**
+   @brief Plugin API: the command an alias stands for.
+ */
+const char *lsh_plugin_alias(const char *name) {
+    struct lsh_alias_slot *slot = lsh_alias_lookup(name);
+    return slot ? slot->value : NULL;
+}
+
+/**
+   @brief Plugin API: the prompt's shell name.
+ */
+const char *lsh_plugin_shell_name(void) {
+    return shellname;
+}
+
+/**
+   @brief Plugin API: the prompt terminator.
+ */
+const char *lsh_plugin_terminator(void) {
+    return terminator;
+}
+
+const struct myshell_api lsh_plugin_api = {
+    MYSHELL_PLUGIN_ABI,
+    sizeof(struct myshell_api),
+    lsh_plugin_register,
+    lsh_out_write,
+    lsh_out_flush,
+    lsh_execute,
+    lsh_plugin_alias,
+    lsh_plugin_shell_name,
+    lsh_plugin_terminator
+};
+
+/**
+   @brief Load a plugin and let it register its builtins.
+   @param path Shared object to load.
+   @return 0 on success, -1 on error (reported on stderr).
+ */
+int lsh_plugin_load(const char *path) {
+    const int *abi;
+    int (*init)(const struct myshell_api *);
+    void *handle;
+    int first = plugin_builtin_count;
+
+    if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+        fprintf(stderr, "lsh: plugin: %s\n", dlerror());
+        return -1;
+    }
+    for (int i = 0; i < lsh_plugin_count; i++) {
+        if (lsh_plugins[i].handle == handle) {
+            dlclose(handle); // Already loaded; drop the extra reference
+            return 0;
+        }
+    }
+    abi = dlsym(handle, "myshell_plugin_abi");
+    *(void **)&init = dlsym(handle, "myshell_plugin_init");
+    if (abi == NULL || init == NULL) {
+        fprintf(stderr, "lsh: plugin: %s: not a myshell plugin\n", path);
+        dlclose(handle);
+        return -1;
+    }
+    if (*abi != MYSHELL_PLUGIN_ABI) {
+        fprintf(stderr, "lsh: plugin: %s: built for plugin ABI %d, shell has %d\n",
+                path, *abi, MYSHELL_PLUGIN_ABI);
+        dlclose(handle);
+        return -1;
+    }
+
+    lsh_plugins = realloc(lsh_plugins, (lsh_plugin_count + 1) * sizeof(struct lsh_plugin));
+    if (!lsh_plugins || (lsh_plugins[lsh_plugin_count].path = strdup(path)) == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    lsh_plugins[lsh_plugin_count].handle = handle;
+    lsh_plugin_loading = lsh_plugin_count;
+    if ((*init)(&lsh_plugin_api) != 0) {
+        // Take back whatever it registered before failing.
+        fprintf(stderr, "lsh: plugin: %s: initialisation failed\n", path);
+        while (plugin_builtin_count > first) {
+            free(plugin_builtins[--plugin_builtin_count].name);
+        }
+        free(lsh_plugins[lsh_plugin_count].path);
+        lsh_plugin_loading = -1;
+        dlclose(handle);
+        return -1;
+    }
+    lsh_plugin_loading = -1;
+    lsh_plugin_count++;
+    return 0;
+}
+
+/**
+   @brief Load the plugins named in $MYSHELL_PLUGINS (colon-separated).
+ */
+void lsh_plugin_load_startup(void) {
+    char *list, *path, *save;
+
+    if (getenv("MYSHELL_PLUGINS") == NULL || (list = strdup(getenv("MYSHELL_PLUGINS"))) == NULL) {
+        return;
+    }
+    for (path = strtok_r(list, ":", &save); path != NULL; path = strtok_r(NULL, ":", &save)) {
+        lsh_plugin_load(path);
+    }
+    free(list);
+}
+
+/**
+   @brief Builtin command: load plugins, or list loaded plugins and their
+          builtins.
+   @param args List of args. args[1..] are shared objects to load.
+   @return Always returns 1 to continue executing.
+ */
+int lsh_plugin(char **args) {
+    if (args[1] == NULL) {
+        for (int p = 0; p < lsh_plugin_count; p++) {
+            printf("%s:", lsh_plugins[p].path);
+            for (int i = 0; i < plugin_builtin_count; i++) {
+                if (plugin_builtins[i].plugin == p) {
+                    printf(" %s", plugin_builtins[i].name);
+                }
+            }
+            printf("\n");
+        }
+        return 1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        // dlopen only searches the library path for names without a slash.
+        if (strchr(args[i], '/') == NULL) {
+            char local[PATH_MAX];
+            snprintf(local, sizeof(local), "./%s", args[i]);
+            lsh_plugin_load(local);
+        } else {
+            lsh_plugin_load(args[i]);
+        }
+    }
+    return 1;
+}
+
+/*
+  Standard input is read in large chunks. With bracketed paste enabled the
+  terminal wraps pasted text in ESC[200~ ... ESC[201~; a pasted block is
+  taken in whole and its lines are handed out without a prompt between
+  them.
+*/
+#define LSH_RL_BUFSIZE 65536
+#define LSH_PASTE_START "\033[200~"
+#define LSH_PASTE_END "\033[201~"
+
+struct lsh_reader {
+    char buf[LSH_RL_BUFSIZE];
+    size_t pos, len;
+} lsh_stdin;
+
+struct lsh_buf lsh_paste;   // Pasted text not yet handed out
+size_t lsh_paste_pos = 0;
+int lsh_bracketed_paste = 0;
+pid_t lsh_paste_owner = 0; // Forked children must not switch the mode off
+
+/**
+   @brief Read more of standard input, keeping what is still unread.
+   @return Number of bytes added, 0 at end of input.
+ */
+size_t lsh_reader_fill(void) {
+    ssize_t n;
+
+    if (lsh_stdin.pos > 0) {
+        memmove(lsh_stdin.buf, lsh_stdin.buf + lsh_stdin.pos, lsh_stdin.len - lsh_stdin.pos);
+        lsh_stdin.len -= lsh_stdin.pos;
+        lsh_stdin.pos = 0;
+    }
+    fflush(stdout); // The prompt must be out before we block
+    do {
+        n = read(STDIN_FILENO, lsh_stdin.buf + lsh_stdin.len, LSH_RL_BUFSIZE - lsh_stdin.len);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return 0;
+    }
+    lsh_stdin.len += n;
+    return n;
+}
+
+/**
+   @brief Check whether unread input starts with a marker, reading more
+          only while what has arrived could still be the marker.
+   @param marker Byte string to look for.
+   @return 1 if the input starts with it.
+ */
+int lsh_reader_starts_with(const char *marker) {
+    size_t n = strlen(marker);
+
+    while (1) {
+        size_t avail = lsh_stdin.len - lsh_stdin.pos;
+        size_t cmp = avail < n ? avail : n;
+        if (memcmp(lsh_stdin.buf + lsh_stdin.pos, marker, cmp) != 0) {
+            return 0;
+        }
+        if (avail >= n) {
+            return 1;
+        }
+        if (lsh_reader_fill() == 0) {
+            return 0;
+        }
+    }
+}
+
+/**
+   @brief Take a whole pasted block (after its start marker) into the
+          paste buffer, searching each chunk for the end marker at once.
+ */
+void lsh_reader_paste(void) {
+    size_t keep = strlen(LSH_PASTE_END) - 1;
+
+    lsh_stdin.pos += strlen(LSH_PASTE_START);
+    while (1) {
+        const char *chunk = lsh_stdin.buf + lsh_stdin.pos;
+        size_t avail = lsh_stdin.len - lsh_stdin.pos;
+        const char *end = memmem(chunk, avail, LSH_PASTE_END, strlen(LSH_PASTE_END));
+        if (end != NULL) {
+            lsh_buf_append(&lsh_paste, chunk, end - chunk);
+            lsh_stdin.pos += end - chunk + strlen(LSH_PASTE_END);
+            return;
+        }
+        // Hold back what could be the start of a split end marker.
+        if (avail > keep) {
+            lsh_buf_append(&lsh_paste, chunk, avail - keep);
+            lsh_stdin.pos += avail - keep;
+        }
+        if (lsh_reader_fill() == 0) {
+            lsh_buf_append(&lsh_paste, lsh_stdin.buf + lsh_stdin.pos, lsh_stdin.len - lsh_stdin.pos);
+            lsh_stdin.pos = lsh_stdin.len;
+            return;
+        }
+    }
+}
+
+/**
+   @brief Whether lines of a pasted block are still waiting to be run.
+   @return Nonzero while pasted lines remain.
+ */
+int lsh_paste_pending(void) {
+    return lsh_paste_pos < lsh_paste.len;
+}
+
+/**
+   @brief Turn off bracketed paste when the shell exits.
+ */
+void lsh_paste_disable(void) {
+    if (lsh_bracketed_paste && getpid() == lsh_paste_owner) {
+        fputs("\033[?2004l", stdout);
+        fflush(stdout);
+    }
+}
+
+/**
+   @brief Ask the terminal to bracket pasted text, if we are interactive.
+ */
+void lsh_paste_enable(void) {
+    if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+        lsh_bracketed_paste = 1;
+        lsh_paste_owner = getpid();
+        fputs("\033[?2004h", stdout);
+        atexit(lsh_paste_disable);
+    }
+}
+
+/**
+   @brief Read a line of input, from a pasted block first, then stdin.
+   @return The line, without its newline.
+ */
+char *lsh_read_line(void) {
+    struct lsh_buf line = { NULL, 0, 0 };
+    const char *chunk, *nl, *esc;
+    size_t avail;
+
+    while (1) {
+        if (lsh_paste_pending()) {
+            chunk = lsh_paste.data + lsh_paste_pos;
+            avail = lsh_paste.len - lsh_paste_pos;
+            nl = memchr(chunk, '\n', avail);
+            lsh_buf_append(&line, chunk, nl ? (size_t)(nl - chunk) : avail);
+            lsh_paste_pos += nl ? (size_t)(nl - chunk) + 1 : avail;
+            if (!lsh_paste_pending()) {
+                lsh_paste.len = lsh_paste_pos = 0;
+            }
+            if (nl) {
+                break;
+            }
+            continue; // Text pasted without a final newline continues the line
+        }
+
+        if (lsh_stdin.pos == lsh_stdin.len && lsh_reader_fill() == 0) {
+            exit(EXIT_SUCCESS);
+        }
+        chunk = lsh_stdin.buf + lsh_stdin.pos;
+        avail = lsh_stdin.len - lsh_stdin.pos;
+        nl = memchr(chunk, '\n', avail);
+        esc = lsh_bracketed_paste ? memchr(chunk, '\033', nl ? (size_t)(nl - chunk) : avail) : NULL;
+
+        if (esc != NULL) {
+            lsh_buf_append(&line, chunk, esc - chunk);
+            lsh_stdin.pos += esc - chunk;
+            if (lsh_reader_starts_with(LSH_PASTE_START)) {
+                lsh_reader_paste();
+            } else {
+                lsh_buf_append(&line, "\033", 1);
+                lsh_stdin.pos++;
+            }
+        } else if (nl != NULL) {
+            lsh_buf_append(&line, chunk, nl - chunk);
+            lsh_stdin.pos += nl - chunk + 1;
+            break;
+        } else {
+            lsh_buf_append(&line, chunk, avail);
+            lsh_stdin.pos += avail;
+        }
+    }
+
+    lsh_buf_append(&line, "", 1);
+    return line.data;
+}
+
+#define LSH_TOK_DELIM " \t\r\n\a"
+
+/*
+  Arguments of the current line, laid out as execvp wants them: the NULL
+  terminated pointer array first, then every argument string packed
+  behind it. The block is reused from line to line and only ever grows
+  (geometrically), so a line with a million arguments costs one pass to
+  count, one allocation at most and one pass to copy.
+*/
+struct lsh_buf lsh_argv_arena;
+
+/**
+   @brief Length of the word at the start of a string: up to the first
+          blank outside single or double quotes or $((...)). The quotes are
+          kept for expansion to remove.
+   @param p Start of the word.
+   @return Its length.
+ */
+size_t lsh_token_len(const char *p) {
+    const char *s = p, *close;
+
+    while (*s && !strchr(LSH_TOK_DELIM, *s)) {
+        if ((*s == '\'' || *s == '"') && (close = strchr(s + 1, *s)) != NULL) {
+            s = close + 1;
+        } else if (s[0] == '$' && s[1] == '(' && s[2] == '(' && (close = lsh_arith_close(s)) != NULL) {
+            s = close + 2;
+        } else {
+            s++;
+        }
+    }
+    return s - p;
+}
+
+/**
+   @brief Split a line into words at blanks outside quotes.
+   @param line The line to be split. It is not modified and may be freed
+               once this returns.
+   @return Null-terminated array of tokens, valid until the next call.
+ */
+char **lsh_split_line(char *line) {
+    size_t count = 0, bytes = 0, need, len;
+    char **tokens, *strings;
+    const char *p;
+
+    // First pass: size the block.
+    for (p = line + strspn(line, LSH_TOK_DELIM); *p; p += len, p += strspn(p, LSH_TOK_DELIM)) {
+        len = lsh_token_len(p);
+        count++;
+        bytes += len + 1;
+    }
+
+    need = (count + 1) * sizeof(char *) + bytes;
+    if (need > lsh_argv_arena.cap) {
+        lsh_argv_arena.cap = need * 2;
+        free(lsh_argv_arena.data); // Nothing in it survives the line
+        lsh_argv_arena.data = malloc(lsh_argv_arena.cap);
+        if (!lsh_argv_arena.data) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Second pass: pointers up front, strings behind them.
+    tokens = (char **)lsh_argv_arena.data;
+    strings = lsh_argv_arena.data + (count + 1) * sizeof(char *);
+    count = 0;
+    for (p = line + strspn(line, LSH_TOK_DELIM); *p; p += len, p += strspn(p, LSH_TOK_DELIM)) {
+        len = lsh_token_len(p);
+        tokens[count++] = strings;
+        memcpy(strings, p, len);
+        strings[len] = '\0';
+        strings += len + 1;
+    }
+    tokens[count] = NULL;
+    return tokens;
+}
+
+/**
+   @brief Loop getting input and executing it.
+ */
+void lsh_loop(void) {
+    char *line;
+    char **args;
+    int status;
+
+    do {
+        // Reap orphans that finished since the last command.
+        if (lsh_tree.on) {
+            lsh_tree_wait(NULL, NULL, 0, NULL);
+        }
+        // Lines of a pasted block run back to back under a single prompt.
+        if (!lsh_paste_pending()) {
+            printf("%s%s ", shellname, terminator); // Use both shellname and terminator
+        }
+        line = lsh_read_line();
+        args = lsh_split_line(line);
+        free(line); // The arguments were copied out of it
+        status = lsh_execute(args);
+    } while (status);
+}
+
+/**
+   @brief Main entry point.
+   @param argc Argument count.
+   @param argv Argument vector.
+   @return status code.
+ */
+int main(int argc, char **argv) {
+    // Serve the job spool instead of reading commands.
+    if (argc > 1 && strcmp(argv[1], "--spool-runner") == 0) {
+        long long budget = 0;
+        if (argc > 3) {
+            lsh_parse_size(argv[3], &budget);
+        }
+        return lsh_spool_runner(argc > 2 ? atoi(argv[2]) : 0, budget);
+    }
+    // Report the environment to cachedsource.
+    if (argc > 1 && strcmp(argv[1], "--dump-env") == 0) {
+        return lsh_dump_env();
+    }
+
+    // Load config files, if any.
+    lsh_alias_enter_cwd();
+    lsh_plugin_load_startup();
+    lsh_trace_start();
+
+    // Let the terminal mark pasted text.
+    lsh_paste_enable();
+
+    // Run command loop.
+    lsh_loop();
+
+    // Perform any shutdown/cleanup.
+
+    return EXIT_SUCCESS;
+}
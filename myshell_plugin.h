@@ -0,0 +1,54 @@
+/***************************************************************************//**
+  @file         myshell_plugin.h
+  @brief        Interface for myshell builtin plugins.
+
+  A plugin is a shared object that adds builtins to myshell. They run in the
+  shell process with the same calling convention as the shell's own: they
+  take a NULL-terminated argument list and return 1 to keep the shell
+  running. A plugin exports two symbols:
+
+    const int myshell_plugin_abi = MYSHELL_PLUGIN_ABI;
+    int myshell_plugin_init(const struct myshell_api *api);
+
+  myshell refuses a plugin built against a different MYSHELL_PLUGIN_ABI.
+  Fields are only ever added at the end of struct myshell_api; a plugin
+  that needs a newer field checks api->size first. myshell_plugin_init
+  registers the plugin's builtins and returns 0, or nonzero to fail the
+  load.
+
+  Build a plugin with: gcc -O2 -shared -fPIC hello.c -o hello.so
+*******************************************************************************/
+
+#ifndef MYSHELL_PLUGIN_H
+#define MYSHELL_PLUGIN_H
+
+#include <stddef.h>
+
+#define MYSHELL_PLUGIN_ABI 1
+
+/*
+  What the shell offers its plugins.
+*/
+struct myshell_api {
+    int abi;      // MYSHELL_PLUGIN_ABI the shell was built with
+    size_t size;  // sizeof(struct myshell_api) in the shell
+
+    // Add a builtin; returns 0, or -1 if the name is taken.
+    int (*register_builtin)(const char *name, int (*func)(char **args));
+
+    // Buffered standard output shared with the shell's own builtins.
+    void (*out_write)(const char *data, size_t len);
+    void (*out_flush)(void);
+
+    // Run a command as if it had been typed; returns 0 to ask for exit.
+    int (*execute)(char **args);
+
+    // The command an alias stands for, or NULL.
+    const char *(*alias_lookup)(const char *name);
+
+    // Current prompt parts.
+    const char *(*shell_name)(void);
+    const char *(*terminator)(void);
+};
+
+#endif
@@ -0,0 +1,119 @@
+#!/bin/bash
+#
+# Complexity regression suite: times line reading, word splitting,
+# readnewnames, cachedsource and appending to a variable at doubling input
+# sizes and fails when the time grows faster than linearly. It also checks
+# that match keeps up with grep -F on a large file.
+#
+# Usage: tests/complexity.sh [path/to/myshell]
+# Without a path, myshell.c is built into a temporary directory.
+#
+# Each case runs at n, 2n, 4n and 8n, best of three, less the time the
+# shell takes on empty input. Linear work grows about 8x from n to 8n and
+# quadratic work 64x; the case fails above LIMIT (default 20). match may
+# take at most GREP_LIMIT (default 2) times as long as grep -F.
+
+set -u
+
+here=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+limit=${LIMIT:-20}
+grep_limit=${GREP_LIMIT:-2}
+
+if [ $# -gt 0 ]; then
+    shell=$1
+else
+    shell=$work/myshell
+    gcc -O2 -pthread "$here/myshell.c" -o "$shell" -ldl || exit 1
+fi
+export HOME=$work XDG_CACHE_HOME=$work/cache
+
+# Milliseconds taken by the shell on an input file, best of three.
+run_ms() {
+    local best=-1 start end ms
+    for _ in 1 2 3; do
+        start=$(date +%s%N)
+        "$shell" < "$1" > /dev/null 2>&1
+        end=$(date +%s%N)
+        ms=$(( (end - start) / 1000000 ))
+        if [ $best -lt 0 ] || [ $ms -lt $best ]; then
+            best=$ms
+        fi
+    done
+    echo $best
+}
+
+# Input generators: gen_<case> <size> <file>.
+gen_read_line() {
+    # One command on a single very long line.
+    awk -v n="$1" 'BEGIN { s = "x"; while (length(s) < n) s = s s; print "echo " substr(s, 1, n) }' > "$2"
+}
+
+gen_split_line() {
+    # One command with many arguments.
+    awk -v n="$1" 'BEGIN { printf "echo"; for (i = 0; i < n; i++) printf " a%d", i; print "" }' > "$2"
+}
+
+gen_readnewnames() {
+    # Aliases in random order, loaded then looked up and extended.
+    awk -v n="$1" 'BEGIN { srand(1); for (i = 0; i < n; i++) print "a" int(rand() * 1e9) "_" i, "echo" }' > "$2.aliases"
+    printf 'readnewnames %s\nnewname zz echo\nzz done\n' "$2.aliases" > "$2"
+}
+
+gen_cachedsource() {
+    # A script exporting many variables, captured and compared afresh.
+    awk -v n="$1" 'BEGIN { for (i = 0; i < n; i++) print "export V" i "=" i }' > "$2.sh"
+    printf 'cachedsource -f %s\n' "$2.sh" > "$2"
+}
+
+gen_append() {
+    # A variable grown one fragment per assignment.
+    { echo 's='; awk -v n="$1" 'BEGIN { for (i = 0; i < n; i++) print "s=\"$s\"x" }'; echo 'echo ${#s}'; } > "$2"
+}
+
+: > "$work/empty"
+base=$(run_ms "$work/empty")
+failed=0
+
+for spec in read_line:1000000 split_line:100000 readnewnames:50000 cachedsource:2000 append:125000; do
+    name=${spec%%:*}
+    n=${spec#*:}
+    times=()
+    for scale in 1 2 4 8; do
+        gen_$name $((n * scale)) "$work/in"
+        ms=$(( $(run_ms "$work/in") - base ))
+        times+=($(( ms > 1 ? ms : 1 )))
+    done
+    ratio=$(( times[3] / times[0] ))
+    if [ $ratio -gt "$limit" ]; then
+        echo "FAIL $name: ${times[*]} ms for n..8n (${ratio}x)"
+        failed=1
+    else
+        echo "ok   $name: ${times[*]} ms for n..8n (${ratio}x)"
+    fi
+done
+
+# match against grep -F on about 100 MB of lines, best of three each.
+if command -v grep > /dev/null; then
+    awk 'BEGIN { srand(2); for (i = 0; i < 2500000; i++) printf "line %d %08x filler text\n", i, int(rand() * 4e9) }' > "$work/big"
+    printf 'match -c deadbeef %s\n' "$work/big" > "$work/in"
+    ms=$(( $(run_ms "$work/in") - base ))
+    best=-1
+    for _ in 1 2 3; do
+        start=$(date +%s%N)
+        grep -Fc deadbeef "$work/big" > /dev/null
+        end=$(date +%s%N)
+        g=$(( (end - start) / 1000000 ))
+        if [ $best -lt 0 ] || [ $g -lt $best ]; then
+            best=$g
+        fi
+    done
+    if [ $ms -gt $(( (best > 1 ? best : 1) * grep_limit )) ]; then
+        echo "FAIL match: $ms ms, grep -F $best ms"
+        failed=1
+    else
+        echo "ok   match: $ms ms, grep -F $best ms"
+    fi
+fi
+exit $failed
@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# Record stage equivalence: for every pair of record stages (match, jget,
+# csv), "a | b" passes rows in one process while "a | cat | b" goes
+# through text. Both must print the same.
+#
+# Usage: tests/records.sh [path/to/myshell]
+# Without a path, myshell.c is built into a temporary directory.
+
+set -u
+
+here=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+if [ $# -gt 0 ]; then
+    shell=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+else
+    shell=$work/myshell
+    gcc -O2 -pthread "$here/myshell.c" -o "$shell" -ldl || exit 1
+fi
+cd "$work" || exit 1
+
+cat > j.json <<'EOF'
+{"a":"x,y","b":{"c":"1;2","d":[1,2]},"e":"q\"r"}
+{"a":"p,q","b":{"c":"3","d":[3]},"e":"two\nlines"}
+{"a":"m", "b": {
+  "c": "spread", "d": []
+}, "e": "z"}
+EOF
+cat > s.csv <<'EOF'
+a,b;c,"x,y",{"k":1}
+d,"e""f",g;h,{"k":2}
+"i,j",k,l,{"k":3}
+EOF
+
+# First stages (each reads one of the files), then second stages.
+firsts=(
+    "match x j.json"
+    "match -v zzz s.csv"
+    "jget -r .a j.json"
+    "jget .b j.json"
+    "jget -r .e j.json"
+    "csv -f 1 s.csv"
+    "csv -f 2,3 s.csv"
+    "csv s.csv"
+)
+seconds=(
+    "match ,"
+    "match ^\""
+    "match y\$"
+    "jget .c"
+    "jget -r .k"
+    "csv -f 2"
+    "csv -d ; -f 2"
+    "csv -g 1"
+)
+
+failed=0
+for a in "${firsts[@]}"; do
+    for b in "${seconds[@]}"; do
+        direct=$(echo "$a | $b" | "$shell" 2>&1)
+        text=$(echo "$a | cat | $b" | "$shell" 2>&1)
+        if [ "$direct" != "$text" ]; then
+            echo "FAIL $a | $b"
+            diff <(echo "$direct") <(echo "$text") | sed 's/^/     /'
+            failed=1
+        fi
+    done
+done
+[ $failed -eq 0 ] && echo "ok   ${#firsts[@]}x${#seconds[@]} record stage pairs"
+exit $failed